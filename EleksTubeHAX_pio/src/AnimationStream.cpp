@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include "AnimationStream.h"
+#include "RowKernels.h"
+
+bool AnimationStream::open(ImageStorage &storage, uint16_t file_index_, const ImageDecoder &decoder) {
+  close();
+  char path[16];
+  fileName(file_index_, path);
+  if (!storage.open(path, file)) return fail("no animation");
+
+  uint8_t header[16];
+  if (file.read(header, sizeof(header)) != sizeof(header) || header[0] != 'C' || header[1] != 'A') {
+    file.close();
+    return fail("not an animation");
+  }
+  format = header[3];
+  width = ImageReader::le16(header + 4);
+  height = ImageReader::le16(header + 6);
+  uint16_t palette_size = ImageReader::le16(header + 8);
+  frame_ms = ImageReader::le16(header + 10);
+  change_frames = ImageReader::le16(header + 12);
+  idle_frames = ImageReader::le16(header + 14);
+  if (header[2] != ANIMATION_VERSION || format > CLK2_FORMAT_IDX8 ||
+      width == 0 || height == 0 || width > MAX_IMAGE_SIZE || height > MAX_IMAGE_SIZE ||
+      (format == CLK2_FORMAT_IDX8) != (palette_size > 0) || palette_size > 256 ||
+      frame_ms == 0 || idle_frames == 0) {
+    file.close();
+    return fail("Invalid animation");
+  }
+
+  uint8_t palette[256 * 2];
+  if (file.read(palette, palette_size * 2) != size_t(palette_size * 2)) {
+    file.close();
+    return fail("truncated or corrupt file");
+  }
+  for (uint16_t i = 0; i < 256; i++) {
+    frame.palette[i] = (i < palette_size) ? ImageReader::le16(palette + i * 2) : 0;
+  }
+  offsets_pos = sizeof(header) + palette_size * 2;
+
+  uint8_t bytes_per_pixel = (format == CLK2_FORMAT_RGB565) ? 2 : 1;
+  row_size = width * bytes_per_pixel;
+  max_row_bytes = row_size + (width + 127) / 128;
+  buffer_size = (max_row_bytes + 2 > ANIMATION_READ_BUFFER) ? max_row_bytes + 2 : ANIMATION_READ_BUFFER;
+  buffer_size = (buffer_size + 3) & ~3;  // the row behind it holds 16 bit pixels
+  buffer = (uint8_t*)malloc(buffer_size + row_size);
+  if (buffer == nullptr) {
+    file.close();
+    return fail("out of memory");
+  }
+
+  placement = decoder.place(width, height);
+  frame.format = (format == CLK2_FORMAT_RGB565) ? ImageFrame::rgb565 : ImageFrame::indexed;
+  frame.sprite = false;
+  frame.bits = bytes_per_pixel * 8;
+  frame.x = placement.x;
+  frame.y = 0;
+  frame.width = placement.width;
+  frame.height = 0;
+  frame.src_x = placement.src_x;   // rows are unpacked whole
+  frame.stride = row_size;
+  frame.pixels = buffer + buffer_size;
+  file_index = file_index_;
+  read_pos = read_len = 0;
+  next_row = 0;
+  return true;
+}
+
+void AnimationStream::close() {
+  file.close();
+  free(buffer);
+  buffer = nullptr;
+  file_index = 0;
+}
+
+bool AnimationStream::beginFrame(uint32_t n) {
+  if (!isOpen()) return fail("not open");
+  uint32_t index = (n < change_frames) ? n : change_frames + (n - change_frames) % idle_frames;
+  uint8_t offset[4];
+  if (!file.seek(offsets_pos + index * 4) || file.read(offset, sizeof(offset)) != sizeof(offset) ||
+      !file.seek(ImageReader::le32(offset))) {
+    return fail("truncated or corrupt file");
+  }
+  read_pos = read_len = 0;
+  next_row = 0;
+  // Rows cropped off the top
+  while (next_row < placement.src_y) {
+    if (!readRow(false)) return false;
+  }
+  return true;
+}
+
+const ImageFrame* AnimationStream::line(int16_t y) {
+  frame.y = y;
+  frame.height = 0;   // outside of the image: the kernels fill black
+  int16_t row = y - placement.y;
+  if (row < 0 || row >= placement.height) return &frame;
+  while (next_row < placement.src_y + row) {
+    if (!readRow(false)) return nullptr;
+  }
+  if (!readRow(true)) return nullptr;
+  frame.height = 1;
+  return &frame;
+}
+
+// The next len bytes of the file. len must fit the read buffer.
+const uint8_t* AnimationStream::take(uint16_t len) {
+  if (read_len - read_pos < len) {
+    memmove(buffer, buffer + read_pos, read_len - read_pos);
+    read_len -= read_pos;
+    read_pos = 0;
+    read_len += file.read(buffer + read_len, buffer_size - read_len);
+    if (read_len < len) return nullptr;
+  }
+  const uint8_t *p = buffer + read_pos;
+  read_pos += len;
+  return p;
+}
+
+// Reads the next row of the image; unpacks it into the row buffer or just skips it.
+bool AnimationStream::readRow(bool unpack) {
+  const uint8_t *p = take(2);
+  if (p == nullptr) return fail("truncated or corrupt file");
+  uint16_t len = ImageReader::le16(p);
+  const uint8_t *src = (len <= max_row_bytes) ? take(len) : nullptr;
+  if (src == nullptr) return fail("truncated or corrupt file");
+  next_row++;
+  if (!unpack) return true;
+
+  uint8_t *row = buffer + buffer_size;
+  bool ok = (format == CLK2_FORMAT_RGB565) ? RowKernels::unpackRow<uint16_t>(src, len, (uint16_t*)row, width)
+                                           : RowKernels::unpackRow<uint8_t>(src, len, row, width);
+  return ok || fail("truncated or corrupt file");
+}
@@ -0,0 +1,82 @@
+#ifndef ANIMATION_STREAM_H
+#define ANIMATION_STREAM_H
+
+#include <stdint.h>
+#include "ImageFrame.h"
+#include "ImageStorage.h"
+#include "ImageDecoder.h"
+
+#define ANIMATION_VERSION       (1)
+
+// Bytes read from the file at once. Streams need this plus one row of pixels each.
+#ifndef ANIMATION_READ_BUFFER
+  #define ANIMATION_READ_BUFFER (1024)
+#endif
+
+/*
+ * Plays an animated digit, "/10.ani" for digit 0 of face 1 and so on, straight from the file system:
+ * frames are never decoded whole, each display line is unpacked just before it is pushed. So memory use
+ * is one read buffer and one row per stream, whatever the length of the animation.
+ *
+ * An animation has an optional change part, played once when the digit appears, and an idle loop
+ * played after it for as long as the digit is shown. Build them with `clktool animate`
+ * (see Prepare_images/clktool.cpp).
+ *
+ * Layout, little-endian:
+ *   char     magic[2]  "CA"
+ *   uint8_t  version   1
+ *   uint8_t  format    CLK2_FORMAT_RGB565 or CLK2_FORMAT_IDX8, for all frames
+ *   uint16_t width, height
+ *   uint16_t palette size (IDX8 only, shared by all frames)
+ *   uint16_t frame_ms  time between frames
+ *   uint16_t change_frames, idle_frames
+ *   uint16_t palette[palette size]
+ *   uint32_t offsets[change_frames + idle_frames], from the start of the file; change frames first
+ *   frames, each top-down rows like CLK v2: a 16-bit byte count followed by RLE packets
+ */
+class AnimationStream {
+public:
+  AnimationStream() : file_index(0), buffer(nullptr), error("") {}
+  ~AnimationStream() { close(); }
+
+  static void fileName(uint16_t file_index, char *buffer) { sprintf(buffer, "/%d.ani", file_index); }
+
+  // Opens the animation of file_index, placed on the display like decoder places images.
+  bool open(ImageStorage &storage, uint16_t file_index_, const ImageDecoder &decoder);
+  void close();
+  bool isOpen() const            { return buffer != nullptr; }
+  uint16_t getFileIndex() const  { return file_index; }
+  uint16_t getFrameMs() const    { return frame_ms; }
+  // Bytes allocated while open
+  uint32_t getMemory() const     { return isOpen() ? buffer_size + row_size : 0; }
+  const char* getError() const   { return error; }
+
+  // Starts frame n of the playback: the change frames once, then the idle loop forever.
+  bool beginFrame(uint32_t n);
+  // Display line y of the current frame, as a frame of (at most) one row. Lines must be read in order.
+  // nullptr if the file is corrupt.
+  const ImageFrame* line(int16_t y);
+
+private:
+  ImageFile file;
+  uint16_t file_index;
+  uint8_t format;
+  uint16_t width, height, frame_ms, change_frames, idle_frames;
+  uint32_t offsets_pos;         // of the offset table in the file
+  ImageDecoder::Placement placement;
+  uint16_t max_row_bytes;       // packed, with its byte count
+
+  // One allocation: the read buffer, then the unpacked row
+  uint8_t *buffer;
+  uint16_t buffer_size, row_size;
+  uint16_t read_pos, read_len;
+  int16_t next_row;             // of the image, in the current frame
+  ImageFrame frame;             // the row handed out by line()
+  const char *error;
+
+  bool fail(const char *message) { error = message; return false; }
+  const uint8_t* take(uint16_t len);
+  bool readRow(bool unpack);
+};
+
+#endif // ANIMATION_STREAM_H
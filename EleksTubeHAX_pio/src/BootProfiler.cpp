@@ -0,0 +1,58 @@
+#include "BootProfiler.h"
+
+uint32_t BootProfiler::first_digits_ms = 0;
+uint32_t BootProfiler::first_correct_ms = 0;
+bool BootProfiler::confirmed = false;
+
+void BootProfiler::phase(const char *phase_name) {
+  end();
+  running = phase_name;
+  started = millis();
+}
+
+void BootProfiler::end() {
+  if (running == nullptr) return;
+  uint32_t ms = millis() - started;
+  Serial.printf("%s: %s took %u ms\n", name, running, unsigned(ms));
+  if (count < max_phases) {
+    phases[count].name = running;
+    phases[count].ms = ms;
+    count++;
+  }
+  running = nullptr;
+}
+
+void BootProfiler::finish() {
+  end();
+  uint32_t total = 0;
+  Serial.printf("%s phases:\n", name);
+  for (uint8_t i = 0; i < count; i++) {
+    Serial.printf("  %-12s %6u ms\n", phases[i].name, unsigned(phases[i].ms));
+    total += phases[i].ms;
+  }
+  Serial.printf("  %-12s %6u ms, done %u ms after reset\n", "total", unsigned(total), unsigned(millis()));
+}
+
+void BootProfiler::digitsShown(const char *source) {
+  uint32_t now = millis();
+  if (first_digits_ms == 0) {
+    first_digits_ms = now;
+    Serial.printf("Boot: first digits shown %u ms after reset, time from %s\n", unsigned(now), source);
+  }
+  if (confirmed && first_correct_ms == 0) {
+    first_correct_ms = now;
+    Serial.printf("Boot: first correct digits %u ms after reset\n", unsigned(now));
+  }
+}
+
+void BootProfiler::timeConfirmed(int32_t error_s) {
+  if (confirmed) return;
+  confirmed = true;
+  if (first_digits_ms != 0 && error_s >= -1 && error_s <= 1) {
+    first_correct_ms = first_digits_ms;
+    Serial.printf("Boot: NTP confirms the time, first correct digits %u ms after reset\n", unsigned(first_correct_ms));
+  }
+  else if (first_digits_ms != 0) {
+    Serial.printf("Boot: NTP time is %d s off the time shown\n", int(error_s));
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef BOOT_PROFILER_H
+#define BOOT_PROFILER_H
+
+#include <stdint.h>
+#include <Arduino.h>
+
+/*
+ * Times the phases of the boot, for the serial output.
+ *
+ * phase() ends the running phase and starts the next one, finish() ends the last and prints a summary.
+ * Each task keeps its own profiler: setup() one, the boot task (FAST_BOOT in main.cpp) another.
+ *
+ * The time to the first correct digits is tracked separately, in milliseconds since reset: digitsShown()
+ * after the displays show a valid time, timeConfirmed() when NTP answered. If the NTP time was within a
+ * second of the time shown, the digits were right from the start; otherwise only from the next draw.
+ */
+class BootProfiler {
+public:
+  BootProfiler(const char *name_) : name(name_), count(0), started(0), running(nullptr) {}
+
+  void phase(const char *phase_name);
+  void finish();
+
+  static void digitsShown(const char *source);
+  // error_s: NTP time minus the time shown
+  static void timeConfirmed(int32_t error_s);
+  // millis() at the first correct digits, 0 while not known
+  static uint32_t getFirstCorrectMillis() { return first_correct_ms; }
+
+private:
+  const static uint8_t max_phases = 12;
+  struct Phase {
+    const char *name;
+    uint32_t ms;
+  };
+  const char *name;
+  Phase phases[max_phases];
+  uint8_t count;
+  uint32_t started;
+  const char *running;
+
+  void end();
+
+  static uint32_t first_digits_ms, first_correct_ms;
+  static bool confirmed;
+};
+
+#endif // BOOT_PROFILER_H
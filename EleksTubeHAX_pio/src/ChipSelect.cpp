@@ -1,4 +1,13 @@
 #include "ChipSelect.h"
+#ifdef CHIP_SELECT_DIRECT_GPIO
+  #include <soc/gpio_reg.h>
+
+  // The set/clear registers for GPIO 0..31; GPIO_OUT1_* would be needed above.
+  static_assert(CSSR_LATCH_PIN < 32 && CSSR_DATA_PIN < 32 && CSSR_CLOCK_PIN < 32, "CHIP_SELECT_DIRECT_GPIO needs the shift register on GPIO 0..31");
+  const uint32_t latch_mask = 1UL << CSSR_LATCH_PIN;
+  const uint32_t data_mask  = 1UL << CSSR_DATA_PIN;
+  const uint32_t clock_mask = 1UL << CSSR_CLOCK_PIN;
+#endif
 
 void ChipSelect::begin() {
   pinMode(CSSR_LATCH_PIN, OUTPUT);
@@ -8,10 +17,17 @@ void ChipSelect::begin() {
   digitalWrite(CSSR_DATA_PIN, LOW);
   digitalWrite(CSSR_CLOCK_PIN, LOW);
   digitalWrite(CSSR_LATCH_PIN, LOW);
+  latched_map = not_latched;
   update();
 }
 
 void ChipSelect::update() {
+  if (digits_map == latched_map) {
+    skipped++;
+    return;
+  }
+  uint32_t start = ESP.getCycleCount();
+
   // Documented in README.md.  Q7 and Q6 are unused. Q5 is Seconds Ones, Q0 is Hours Tens.
   // Q7 is the first bit written, Q0 is the last.  So we push two dummy bits, then start with
   // Seconds Ones and end with Hours Tens.
@@ -19,7 +35,38 @@ void ChipSelect::update() {
 
   uint8_t to_shift = (~digits_map) << 2;
 
+#ifdef CHIP_SELECT_DIRECT_GPIO
+  // Same sequence as shiftOut(LSBFIRST): data, then a rising clock edge per bit
+  REG_WRITE(GPIO_OUT_W1TC_REG, latch_mask);
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    REG_WRITE((to_shift & (1 << bit)) ? GPIO_OUT_W1TS_REG : GPIO_OUT_W1TC_REG, data_mask);
+    REG_WRITE(GPIO_OUT_W1TS_REG, clock_mask);
+    REG_WRITE(GPIO_OUT_W1TC_REG, clock_mask);
+  }
+  REG_WRITE(GPIO_OUT_W1TS_REG, latch_mask);
+#else
   digitalWrite(CSSR_LATCH_PIN, LOW);
   shiftOut(CSSR_DATA_PIN, CSSR_CLOCK_PIN, LSBFIRST, to_shift);
   digitalWrite(CSSR_LATCH_PIN, HIGH);
+#endif
+
+  latched_map = digits_map;
+  latches++;
+  busy_cycles += ESP.getCycleCount() - start;
+}
+
+void ChipSelect::printStats() {
+  Serial.print("Chip select latched/skipped: ");
+  Serial.print(latches);
+  Serial.print("/");
+  Serial.print(skipped);
+  Serial.print(", ");
+  Serial.print(getBusyMicros());
+  Serial.print(" us");
+  if (latches > 0) {
+    Serial.print(" (");
+    Serial.print(uint32_t(busy_cycles * 1000 / getCpuFrequencyMhz() / latches));
+    Serial.print(" ns per latch)");
+  }
+  Serial.println();
 }
@@ -5,15 +5,26 @@
 
 /*
  * `digit`s are as defined in Hardware.h, 0 == seconds ones, 5 == hours tens.
+ *
+ * The selection is shifted into the 74HC595 on every change of the map; setting the map that is
+ * already latched costs nothing. With CHIP_SELECT_DIRECT_GPIO the pins are driven through the GPIO
+ * set/clear registers instead of digitalWrite() and shiftOut().
  */
 
 class ChipSelect {
 public:
-  ChipSelect() : digits_map(all_off) {}
+  ChipSelect() : digits_map(all_off), latched_map(not_latched), latches(0), skipped(0), busy_cycles(0) {}
 
   void begin();
   void update();
 
+  // Time spent shifting and latching, in CPU cycles for sub-microsecond resolution
+  uint32_t getLatches()                        { return latches; }
+  uint32_t getSkipped()                        { return skipped; }
+  uint32_t getBusyMicros()                     { return busy_cycles / getCpuFrequencyMhz(); }
+  void resetStats()                            { latches = 0; skipped = 0; busy_cycles = 0; }
+  void printStats();
+
   // These speak the indexes defined in Hardware.h.
   // So 0 is disabled, 1 is enabled (even though CS is active low, this gets mapped.)
   // So bit 0 (LSB), is index 0, is SECONDS_ONES
@@ -41,8 +52,12 @@ public:
 
 private:
   uint8_t digits_map;
-  const uint8_t all_on = 0x3F;
-  const uint8_t all_off = 0x00;
+  uint8_t latched_map;      // in the shift register, not_latched before begin()
+  uint32_t latches, skipped;
+  uint64_t busy_cycles;
+  const static uint8_t all_on = 0x3F;
+  const static uint8_t all_off = 0x00;
+  const static uint8_t not_latched = 0xFF;
 };
 
 
@@ -20,7 +20,7 @@ void disableWiFi();
 
 
 
-void Clock::begin(StoredConfig::Config::Clock *config_) {
+void Clock::begin(StoredConfig::Config::Clock *config_, bool from_rtc) {
   config = config_;
   
 
@@ -37,6 +37,14 @@ void Clock::begin(StoredConfig::Config::Clock *config_) {
   
   RtcBegin();
   ntpTimeClient.begin();
+  if (from_rtc) {
+    // An RTC that lost its time (no battery) reads 0; the time stays unset until NTP answers.
+    time_t rtc_now = RtcGet();
+    if (rtc_now != 0) setTime(rtc_now);
+    Serial.print("RTC time = ");
+    Serial.println(uint32_t(rtc_now));
+    return;
+  }
   ntpTimeClient.update();
   Serial.print("NTP time = ");
   Serial.println(ntpTimeClient.getFormattedTime());
@@ -49,7 +57,9 @@ void Clock::loop() {
   }
   else {
     loop_time = now();
+    time_t previous = local_time;
     local_time = loop_time + config->time_zone_offset;
+    if (local_time != previous) tick_millis = millis();
     time_valid = true;
   }
 }
@@ -62,32 +72,11 @@ time_t Clock::syncProvider() {
     rtc_now = RtcGet();
     
     if (millis() - millis_last_ntp > refresh_ntp_every_ms || millis_last_ntp == 0) {
-        // Switch to WiFi mode
-        switchToWifi();
-        
-        if (WiFi.status() == WL_CONNECTED) {
-            Serial.print("Getting NTP.");
-            if (ntpTimeClient.update()) {
-                Serial.print(".");
-                ntp_now = ntpTimeClient.getEpochTime();
-                Serial.println("NTP query done.");
-                Serial.print("NTP time = ");
-                Serial.println(ntpTimeClient.getFormattedTime());
-                
-                if (ntp_now != rtc_now) {
-                    RtcSet(ntp_now);
-                    Serial.println("Updating RTC");
-                }
-                millis_last_ntp = millis();
-                
-                // Switch back to Bluetooth 
-                switchToBluetooth();
-                return ntp_now;
-            }
-        }
-        
-        // If we get here, something failed - switch back to Bluetooth
+        bool got_ntp = queryNtp(rtc_now, ntp_now);
+        // Switch back to Bluetooth 
         switchToBluetooth();
+        if (got_ntp) return ntp_now;
+        
         Serial.println("Using RTC time due to failure");
         return rtc_now;
     }
@@ -96,6 +85,40 @@ time_t Clock::syncProvider() {
     return rtc_now;
 }
 
+bool Clock::queryNtp(time_t rtc_now, time_t &ntp_now) {
+    // Switch to WiFi mode
+    switchToWifi();
+    
+    if (WiFi.status() == WL_CONNECTED) {
+        Serial.print("Getting NTP.");
+        if (ntpTimeClient.update()) {
+            Serial.print(".");
+            ntp_now = ntpTimeClient.getEpochTime();
+            Serial.println("NTP query done.");
+            Serial.print("NTP time = ");
+            Serial.println(ntpTimeClient.getFormattedTime());
+            
+            if (ntp_now != rtc_now) {
+                RtcSet(ntp_now);
+                Serial.println("Updating RTC");
+            }
+            millis_last_ntp = millis();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Clock::queryNtp(time_t &ntp_now) {
+    return queryNtp(RtcGet(), ntp_now);
+}
+
+// TimeLib calls the sync provider right away; after a failed query, it only tries NTP again after retry_ntp_after_ms.
+void Clock::startSync() {
+    if (millis_last_ntp == 0) millis_last_ntp = millis() - (refresh_ntp_every_ms - retry_ntp_after_ms);
+    setSyncProvider(&Clock::syncProvider);
+}
+
 uint8_t Clock::getHoursTens() {
   uint8_t hour_tens = getHour()/10;
   
@@ -107,6 +130,40 @@ uint8_t Clock::getHoursTens() {
   }
 }
 
+void Clock::getDigitsAt(time_t t, uint8_t values[NUM_DIGITS]) {
+  uint8_t h = config->twelve_hour ? hourFormat12(t) : hour(t);
+  values[SECONDS_ONES] = second(t) % 10;
+  values[SECONDS_TENS] = second(t) / 10;
+  values[MINUTES_ONES] = minute(t) % 10;
+  values[MINUTES_TENS] = minute(t) / 10;
+  values[HOURS_ONES]   = h % 10;
+  values[HOURS_TENS]   = (config->blank_hours_zero && h < 10) ? TFTs::blanked : h / 10;
+}
+
+// Digits only change on second, 10 second, minute, 10 minute and hour boundaries,
+// so it is enough to look at the next one of each (and the next 24 hours for the hours).
+void Clock::getNextChanges(uint32_t horizon_s, DigitChange changes[NUM_DIGITS]) {
+  uint8_t current[NUM_DIGITS], future[NUM_DIGITS];
+  getDigitsAt(local_time, current);
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    changes[digit].seconds = 0;
+  }
+
+  time_t t = local_time;
+  time_t boundaries[4] = { t + 1, t - t % 10 + 10, t - t % 60 + 60, t - t % 600 + 600 };
+  for (uint8_t i = 0; i < 4 + 24; i++) {
+    time_t next = (i < 4) ? boundaries[i] : t - t % 3600 + (i - 3) * 3600;
+    if (uint32_t(next - t) > horizon_s) break;
+    getDigitsAt(next, future);
+    for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+      if (changes[digit].seconds == 0 && future[digit] != current[digit]) {
+        changes[digit].value = future[digit];
+        changes[digit].seconds = next - t;
+      }
+    }
+  }
+}
+
 uint32_t Clock::millis_last_ntp = 0;
 WiFiUDP Clock::ntpUDP;
 NTPClient Clock::ntpTimeClient(ntpUDP);
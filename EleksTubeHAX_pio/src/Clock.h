@@ -15,15 +15,23 @@
 
 class Clock {
 public:
-  Clock() : loop_time(0), local_time(0), time_valid(false), config(NULL) {}
+  Clock() : loop_time(0), local_time(0), time_valid(false), tick_millis(0), config(NULL) {}
   
   // The global WiFi from WiFi.h must already be .begin()'d before calling Clock::begin()
-  void begin(StoredConfig::Config::Clock *config_); 
+  // from_rtc: only take the time from the RTC, without NTP or the sync provider; startSync() follows later.
+  void begin(StoredConfig::Config::Clock *config_, bool from_rtc = false);
   void loop();
 
   // Calls NTPClient::getEpochTime() or RTC::get() as appropriate
   // This has to be static to pass to TimeLib::setSyncProvider.
   static time_t syncProvider();
+  // Switches to WiFi, gets the NTP time and sets the RTC to it. Blocks for seconds and leaves WiFi on;
+  // switchToBluetooth() (main.h) goes back. Returns false if there was no answer.
+  static bool queryNtp(time_t &ntp_now);
+  static bool hasNtpTime()              { return millis_last_ntp != 0; }
+  // Sets the sync provider, after begin(config, true)
+  void startSync();
+  bool isTimeValid()                    { return time_valid; }
 
   // Set preferred hour format. true = 12hr, false = 24hr
   void setTwelveHour(bool th)           { config->twelve_hour = th; }
@@ -80,11 +88,23 @@ public:
   uint8_t getMinutesOnes()  { return getMinute()%10; }
   uint8_t getSecondsTens()  { return getSecond()/10; }
   uint8_t getSecondsOnes()  { return getSecond()%10; }
+
+  // The values of all digits at local time t, as shown on the displays
+  void getDigitsAt(time_t t, uint8_t values[NUM_DIGITS]);
+  // When each digit changes next, counted from the last tick, and to what value
+  struct DigitChange {
+    uint8_t value;
+    uint32_t seconds;   // 0: no change within the horizon
+  };
+  void getNextChanges(uint32_t horizon_s, DigitChange changes[NUM_DIGITS]);
+  // millis() when local_time last changed; the next tick follows about 1000 ms later
+  uint32_t getTickMillis() { return tick_millis; }
   
   time_t loop_time, local_time;
 
 private:
   bool time_valid;
+  uint32_t tick_millis;
   StoredConfig::Config::Clock *config;
 
   // Static variables needed for syncProvider()
@@ -92,6 +112,8 @@ private:
   static NTPClient ntpTimeClient;
   static uint32_t millis_last_ntp;
   const static uint32_t refresh_ntp_every_ms = 3600000; // Get new NTP every hour, use RTC in between.
+  const static uint32_t retry_ntp_after_ms = 600000;    // After a failed query at boot
+  static bool queryNtp(time_t rtc_now, time_t &ntp_now);
 };
 
 extern Clock uclock;
@@ -0,0 +1,55 @@
+#include "DecodeWorker.h"
+
+bool DecodeWorker::begin(DecodeFunction decode_, void *context_) {
+  if (task != nullptr) return true;
+  decode = decode_;
+  context = context_;
+  // begin() runs on the loop task, the decoder goes to the other core
+  BaseType_t core = (xPortGetCoreID() == 0) ? 1 : 0;
+  if (xTaskCreatePinnedToCore(run, "decode", DECODE_TASK_STACK, this, DECODE_TASK_PRIORITY, &task, core) != pdPASS) {
+    task = nullptr;
+    return false;
+  }
+  Serial.print("Decode task running on core ");
+  Serial.println(core);
+  return true;
+}
+
+bool DecodeWorker::request(uint16_t file_index, uint8_t animation) {
+  Request r = { file_index, animation };
+  if (!requests.push(r)) return false;
+  xTaskNotifyGive(task);
+  return true;
+}
+
+bool DecodeWorker::poll(Result &result) {
+  return results.pop(result);
+}
+
+// Sleeps until a request comes in, then decodes until the request queue is empty.
+void DecodeWorker::run(void *param) {
+  DecodeWorker *worker = (DecodeWorker*)param;
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    Request request;
+    while (worker->requests.pop(request)) {
+      Result result;
+      worker->decode(worker->context, request, result);
+      // The loop has at most DECODE_QUEUE_LENGTH requests out, so this only waits if it misbehaves.
+      while (!worker->results.push(result)) vTaskDelay(1);
+    }
+  }
+}
+
+ImageFrame* DecodeWorker::Frames::acquire(uint16_t file_index, size_t data_bytes_) {
+  if (!staged) return cache.acquire(file_index, data_bytes_);
+  discard();
+  frame = cache.allocate(data_bytes_);
+  data_bytes = data_bytes_;
+  return frame;
+}
+
+void DecodeWorker::Frames::discard() {
+  if (frame != nullptr) cache.discard(frame);
+  frame = nullptr;
+}
@@ -0,0 +1,76 @@
+#ifndef DECODE_WORKER_H
+#define DECODE_WORKER_H
+
+#include "GLOBAL_DEFINES.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "ImageCache.h"
+#include "SpscQueue.h"
+
+/*
+ * Decodes images on a FreeRTOS task pinned to the core the Arduino loop doesn't run on, so slow
+ * flash reads don't hold up the clock tick and the backlights. It also opens animations, which is a
+ * file system lookup like loading an image.
+ *
+ * The loop task request()s file indices and poll()s finished frames; both go through lock-free
+ * single producer / single consumer queues. Decoded frames live outside of the cache (Frames) until
+ * the loop adopts them (ImageCache::adopt()), so the cache is only ever touched by the loop task.
+ */
+class DecodeWorker {
+public:
+  DecodeWorker() : task(nullptr), decode(nullptr), context(nullptr) {}
+
+  const static uint8_t no_animation = 0xFF;
+  // An image to decode, or the animation of a display to open
+  struct Request {
+    uint16_t file_index;
+    uint8_t animation;    // the display, no_animation for an image
+  };
+  struct Result {
+    uint16_t file_index;
+    uint8_t animation;    // as requested
+    bool ok;
+    ImageFrame *frame;    // the decoded image, nullptr for animations and failures
+    size_t data_bytes;
+  };
+  // Carries out a request, on the decode task
+  typedef void (*DecodeFunction)(void *context, const Request &request, Result &result);
+
+  // Starts the task on the other core. Returns false if it couldn't be created.
+  bool begin(DecodeFunction decode_, void *context_);
+  bool isRunning() const { return task != nullptr; }
+
+  // Loop task only. request() returns false if the queue is full.
+  bool request(uint16_t file_index, uint8_t animation = no_animation);
+  bool poll(Result &result);
+
+  // The allocator for the decoder: writes into the cache while no task is running,
+  // into memory outside of the cache (taken over by the Result) while it is.
+  class Frames : public FrameAllocator {
+  public:
+    Frames(ImageCache &cache_) : cache(cache_), staged(false), frame(nullptr), data_bytes(0) {}
+    ImageFrame* acquire(uint16_t file_index, size_t data_bytes_) override;
+    void setStaged(bool staged_) { staged = staged_; }
+    bool isStaged() const { return staged; }
+    // The frame decoded last; it is not released anymore.
+    ImageFrame* take(size_t *data_bytes_) { ImageFrame *f = frame; *data_bytes_ = data_bytes; frame = nullptr; return f; }
+    // Releases the frame of a failed decode.
+    void discard();
+  private:
+    ImageCache &cache;
+    bool staged;
+    ImageFrame *frame;
+    size_t data_bytes;
+  };
+
+private:
+  TaskHandle_t task;
+  DecodeFunction decode;
+  void *context;
+  SpscQueue<Request, DECODE_QUEUE_LENGTH> requests;
+  SpscQueue<Result, DECODE_QUEUE_LENGTH> results;
+
+  static void run(void *worker);
+};
+
+#endif // DECODE_WORKER_H
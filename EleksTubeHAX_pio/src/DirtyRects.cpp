@@ -0,0 +1,79 @@
+#include "DirtyRects.h"
+
+// Above this share of the display area, a single full push is cheaper than setting up windows.
+#define DIRTY_RECTS_FULL_PERCENT (75)
+
+static int16_t min16(int16_t a, int16_t b) { return a < b ? a : b; }
+static int16_t max16(int16_t a, int16_t b) { return a > b ? a : b; }
+
+void DirtyRects::addRow(int16_t line, int16_t first_col, int16_t last_col) {
+  if (first_col < 0) {
+    open = false;
+    return;
+  }
+  if (open) {
+    // Extend the current rectangle down by one line and widen it if needed.
+    Rect &r = rects[count - 1];
+    int16_t x0 = min16(r.x, first_col);
+    int16_t x1 = max16(r.x + r.w - 1, last_col);
+    r.x = x0;
+    r.w = x1 - x0 + 1;
+    r.h++;
+    return;
+  }
+  append(line, first_col, last_col);
+}
+
+void DirtyRects::append(int16_t line, int16_t first_col, int16_t last_col) {
+  if (count == MAX_DIRTY_RECTS) {
+    mergeCheapestPair();
+  }
+  Rect &r = rects[count++];
+  r.x = first_col;
+  r.y = line;
+  r.w = last_col - first_col + 1;
+  r.h = 1;
+  open = true;
+}
+
+// Merges the two neighbouring rectangles (they are sorted top-down) whose bounding box adds the fewest pixels.
+void DirtyRects::mergeCheapestPair() {
+  uint8_t best = 0;
+  int32_t best_cost = INT32_MAX;
+  for (uint8_t i = 0; i + 1 < count; i++) {
+    const Rect &a = rects[i], &b = rects[i + 1];
+    int16_t x0 = min16(a.x, b.x);
+    int16_t x1 = max16(a.x + a.w, b.x + b.w);
+    int32_t merged = int32_t(x1 - x0) * (b.y + b.h - a.y);
+    int32_t cost = merged - int32_t(a.w) * a.h - int32_t(b.w) * b.h;
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = i;
+    }
+  }
+  Rect &a = rects[best];
+  const Rect &b = rects[best + 1];
+  int16_t x0 = min16(a.x, b.x);
+  int16_t x1 = max16(a.x + a.w, b.x + b.w);
+  a.h = b.y + b.h - a.y;
+  a.x = x0;
+  a.w = x1 - x0;
+  for (uint8_t i = best + 1; i + 1 < count; i++) {
+    rects[i] = rects[i + 1];
+  }
+  count--;
+}
+
+void DirtyRects::end(int16_t width, int16_t height) {
+  open = false;
+  valid = true;
+  full = (area() * 100 > uint32_t(width) * height * DIRTY_RECTS_FULL_PERCENT);
+}
+
+uint32_t DirtyRects::area() const {
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    sum += uint32_t(rects[i].w) * rects[i].h;
+  }
+  return sum;
+}
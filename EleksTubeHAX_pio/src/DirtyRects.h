@@ -0,0 +1,41 @@
+#ifndef DIRTY_RECTS_H
+#define DIRTY_RECTS_H
+
+#include <stdint.h>
+
+#ifndef MAX_DIRTY_RECTS
+  #define MAX_DIRTY_RECTS (4)
+#endif
+
+/*
+ * The areas of the display that change between two images of a clock face.
+ *
+ * Built row by row: addRow() is called once per display line, top to bottom, with the first
+ * and last column that differ (or none). Consecutive changed lines become one rectangle;
+ * if there are more than MAX_DIRTY_RECTS of them, the pair that wastes the fewest pixels
+ * when merged is merged. When the rectangles cover most of the display, it is marked full.
+ */
+struct DirtyRects {
+  struct Rect {
+    uint8_t x, y, w, h;   // fits 135 x 240 displays
+  };
+
+  bool    valid;   // false == not computed yet
+  bool    full;    // push the full frame, it's cheaper
+  uint8_t count;   // 0 with valid && !full means the images are identical
+  Rect    rects[MAX_DIRTY_RECTS];
+
+  void reset()      { valid = false; full = false; count = 0; open = false; }
+  void begin()      { reset(); }
+  void addRow(int16_t line, int16_t first_col, int16_t last_col);  // first_col < 0: no change in this line
+  void end(int16_t width, int16_t height);
+
+  uint32_t area() const;
+
+private:
+  bool open;       // the last rectangle is still growing
+  void append(int16_t line, int16_t first_col, int16_t last_col);
+  void mergeCheapestPair();
+};
+
+#endif // DIRTY_RECTS_H
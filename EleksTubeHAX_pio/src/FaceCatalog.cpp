@@ -0,0 +1,264 @@
+#include <string.h>
+#include "FaceCatalog.h"
+#include "FacePack.h"
+
+#ifdef USE_CLK_FILES
+  #define IMAGE_EXTENSION ".clk"
+#else
+  #define IMAGE_EXTENSION ".bmp"
+#endif
+
+void FaceCatalog::fileName(uint16_t file_index, char *buffer) {
+  if (isBackground(file_index)) {
+    sprintf(buffer, "/%ubg" IMAGE_EXTENSION, unsigned(file_index & ~background_bit));
+  }
+  else {
+    sprintf(buffer, "/%u" IMAGE_EXTENSION, unsigned(file_index));
+  }
+}
+
+void FaceCatalog::clear() {
+  memset(&data, 0, sizeof(data));
+  data.version = block_version;
+  data.size = sizeof(data);
+  for (uint8_t i = 0; i < max_faces; i++) {
+    data.faces[i].name = no_name;
+    data.faces[i].info.format = ImageDecoder::format_unknown;
+  }
+}
+
+void FaceCatalog::addImage(uint16_t file_index, const uint8_t *image, uint32_t length) {
+  addIndex(file_index);
+  uint16_t face = file_index / 10;
+  if (!isBackground(file_index) && file_index % 10 == 0 && face >= 1 && face <= max_faces) {
+    MemoryImageReader reader(image, length);
+    ImageDecoder::probe(reader, &data.faces[face - 1].info);
+  }
+  // The index, the length and the start of the image stand for it
+  uint32_t h = hash((const uint8_t*)&file_index, sizeof(file_index));
+  h = hash((const uint8_t*)&length, sizeof(length), h);
+  data.stamp.extra_hash += hash(image, (length < 32) ? length : 32, h);
+}
+
+void FaceCatalog::addIndex(uint16_t file_index) {
+  if (isBackground(file_index)) {
+    uint16_t face = file_index & ~background_bit;
+    if (face >= 1 && face <= max_faces) data.faces[face - 1].flags |= has_background;
+  }
+  else if (file_index >= 10 && file_index / 10 <= max_faces) {
+    data.faces[file_index / 10 - 1].images |= 1 << (file_index % 10);
+  }
+}
+
+uint8_t FaceCatalog::build(ImageStorage &storage) {
+  data.stamp = currentStamp(storage);
+  storage.list(listed, this);
+
+  data.count = 0;
+  while (data.count < max_faces && ((data.faces[data.count].images & 0x01) || (data.faces[data.count].flags & has_pack))) {
+    data.count++;
+  }
+
+  loadPacks(storage);
+  probeFiles(storage);
+  loadNames(storage);
+  for (uint8_t face = 1; face <= data.count; face++) {
+    addToTable(face);
+  }
+  data.hash = hashBlock(data);
+  return data.count;
+}
+
+bool FaceCatalog::restore(const void *block, size_t size, ImageStorage &storage) {
+  if (size != sizeof(Data)) return false;
+  const Data &saved = *(const Data*)block;
+  if (saved.version != block_version || saved.size != sizeof(Data) || saved.hash != hashBlock(saved)) return false;
+  // The cheap parts first, the listing only if they match
+  Stamp stamp = currentStamp(storage);
+  stamp.files_hash = saved.stamp.files_hash;
+  if (!sameStamp(saved.stamp, stamp)) return false;
+  stamp.files_hash = 0;
+  if (!storage.list(hashListed, &stamp.files_hash) || stamp.files_hash != saved.stamp.files_hash) return false;
+  memcpy(&data, block, sizeof(Data));
+  return true;
+}
+
+// Without files_hash, which needs the listing. clockfaces.txt is a single small file.
+FaceCatalog::Stamp FaceCatalog::currentStamp(ImageStorage &storage) const {
+  Stamp stamp;
+  stamp.used_bytes = storage.usedBytes();
+  stamp.total_bytes = storage.totalBytes();
+  stamp.names_hash = 0;
+  stamp.files_hash = 0;
+  stamp.extra_hash = data.stamp.extra_hash;
+  ImageFile file;
+  if (storage.open("/clockfaces.txt", file)) {
+    uint32_t h = hash_basis;
+    uint8_t buffer[64];
+    size_t got;
+    while ((got = file.read(buffer, sizeof(buffer))) > 0) h = hash(buffer, got, h);
+    stamp.names_hash = h;
+  }
+  return stamp;
+}
+
+bool FaceCatalog::sameStamp(const Stamp &a, const Stamp &b) {
+  return a.used_bytes == b.used_bytes && a.total_bytes == b.total_bytes && a.names_hash == b.names_hash &&
+         a.files_hash == b.files_hash && a.extra_hash == b.extra_hash;
+}
+
+uint32_t FaceCatalog::hashBlock(const Data &block) {
+  return hash((const uint8_t*)&block + sizeof(block.hash), sizeof(Data) - sizeof(block.hash));
+}
+
+// Summed up over the files, so the order of the listing doesn't matter
+uint32_t FaceCatalog::hashFile(const char *name, uint32_t size, uint32_t mtime) {
+  uint32_t h = hash(name);
+  h = hash((const uint8_t*)&size, sizeof(size), h);
+  return hash((const uint8_t*)&mtime, sizeof(mtime), h);
+}
+
+void FaceCatalog::listed(void *context, const char *name, uint32_t size, uint32_t mtime) {
+  FaceCatalog *catalog = (FaceCatalog*)context;
+  catalog->addFile(name);
+  catalog->data.stamp.files_hash += hashFile(name, size, mtime);
+}
+
+void FaceCatalog::hashListed(void *context, const char *name, uint32_t size, uint32_t mtime) {
+  *(uint32_t*)context += hashFile(name, size, mtime);
+}
+
+// Sorts a file of the root directory in by its name, see the table in FaceCatalog.h
+void FaceCatalog::addFile(const char *name) {
+  uint32_t n = 0;
+  const char *suffix = name;
+  while (*suffix >= '0' && *suffix <= '9' && n < 0x10000) n = n * 10 + (*suffix++ - '0');
+  if (suffix == name) return;
+
+  if (strcmp(suffix, IMAGE_EXTENSION) == 0) {
+    if (n < background_bit) addIndex(n);
+  }
+  else if (strncmp(suffix, "bg", 2) == 0 && strcmp(suffix + 2, IMAGE_EXTENSION) == 0) {
+    if (n >= 1 && n <= max_faces) addIndex(backgroundIndex(n));
+  }
+  else if (strcmp(suffix, ".ani") == 0) {
+    if (n >= 10 && n / 10 <= max_faces) data.faces[n / 10 - 1].animated |= 1 << (n % 10);
+  }
+  else if (strcmp(suffix, ".face") == 0) {
+    if (n >= 1 && n <= max_faces) data.faces[n - 1].flags |= has_pack;
+  }
+}
+
+// Name, background and header of digit 0 from the packs. Images in the face partition come first, like when drawing.
+void FaceCatalog::loadPacks(ImageStorage &storage) {
+  FacePack pack;
+  for (uint8_t face = 1; face <= data.count; face++) {
+    if (!hasPack(face) || !pack.open(storage, face)) continue;
+    Face &f = data.faces[face - 1];
+    setName(face, pack.getName(), strlen(pack.getName()));
+    uint32_t offset, length;
+    if (pack.find(FacePack::background, &offset, &length)) f.flags |= has_background;
+    if (f.info.format == ImageDecoder::format_unknown && pack.select(0)) ImageDecoder::probe(pack.getFile(), &f.info);
+  }
+  pack.close();
+}
+
+// Header of digit 0 from the single file, for the faces not covered by the face partition or a pack
+void FaceCatalog::probeFiles(ImageStorage &storage) {
+  ImageFile file;
+  char filename[16];
+  for (uint8_t face = 1; face <= data.count; face++) {
+    Face &f = data.faces[face - 1];
+    if (f.info.format != ImageDecoder::format_unknown || !(f.images & 0x01)) continue;
+    fileName(face * 10, filename);
+    if (!storage.open(filename, file)) continue;
+    ImageDecoder::probe(file, &f.info);
+    file.close();
+  }
+}
+
+// Pack names first (loadPacks()), then clockfaces.txt for the faces without one, then the numbers.
+void FaceCatalog::loadNames(ImageStorage &storage) {
+  ImageFile file;
+  if (storage.open("/clockfaces.txt", file)) {
+    char line[33];
+    size_t length = 0;
+    uint8_t face = 1;
+    uint8_t buffer[64];
+    size_t got;
+    while (face <= data.count && (got = file.read(buffer, sizeof(buffer))) > 0) {
+      for (size_t i = 0; i < got && face <= data.count; i++) {
+        char c = buffer[i];
+        if (c == '\n') {
+          if (data.faces[face - 1].name == no_name) setName(face, line, length);
+          face++;
+          length = 0;
+        }
+        else if (c != '\r' && length < sizeof(line) - 1) {
+          line[length++] = c;
+        }
+      }
+    }
+    // The last line may not end with a newline
+    if (face <= data.count && data.faces[face - 1].name == no_name) setName(face, line, length);
+    file.close();
+  }
+
+  for (uint8_t face = 1; face <= data.count; face++) {
+    if (data.faces[face - 1].name != no_name) continue;
+    char number[4];
+    setName(face, number, sprintf(number, "%u", face));
+  }
+}
+
+// Copies name into the pool. Empty names and names that don't fit anymore are not set.
+bool FaceCatalog::setName(uint8_t face, const char *name, size_t length) {
+  if (length == 0 || data.names_used + length + 1 > sizeof(data.names)) return false;
+  memcpy(data.names + data.names_used, name, length);
+  data.names[data.names_used + length] = 0;
+  data.faces[face - 1].name = data.names_used;
+  data.names_used += length + 1;
+  return true;
+}
+
+ImageDecoder::Info FaceCatalog::getInfo(uint8_t face) const {
+  if (isListed(face)) return data.faces[face - 1].info;
+  ImageDecoder::Info none = { ImageDecoder::format_unknown, 0, 0, 0 };
+  return none;
+}
+
+const char* FaceCatalog::getName(uint8_t face) const {
+  if (!isListed(face) || data.faces[face - 1].name == no_name) return "";
+  return data.names + data.faces[face - 1].name;
+}
+
+uint32_t FaceCatalog::hash(const char *name) {
+  return hash((const uint8_t*)name, strlen(name));
+}
+
+// FNV-1a, continued from h
+uint32_t FaceCatalog::hash(const uint8_t *bytes, size_t length, uint32_t h) {
+  for (size_t i = 0; i < length; i++) {
+    h ^= bytes[i];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+// Faces sharing a name are found as the first of them.
+void FaceCatalog::addToTable(uint8_t face) {
+  const char *name = getName(face);
+  if (name[0] == 0 || find(name) != 0) return;
+  uint8_t slot = hash(name) & (table_size - 1);
+  while (data.table[slot] != 0) slot = (slot + 1) & (table_size - 1);
+  data.table[slot] = face;
+}
+
+uint8_t FaceCatalog::find(const char *name) const {
+  uint8_t slot = hash(name) & (table_size - 1);
+  while (data.table[slot] != 0) {
+    if (strcmp(getName(data.table[slot]), name) == 0) return data.table[slot];
+    slot = (slot + 1) & (table_size - 1);
+  }
+  return 0;
+}
@@ -0,0 +1,138 @@
+#ifndef FACE_CATALOG_H
+#define FACE_CATALOG_H
+
+#include "ImageStorage.h"
+#include "ImageDecoder.h"
+
+#ifdef ARDUINO
+  #include "GLOBAL_DEFINES.h"   // USE_CLK_FILES, FACE_CATALOG_MAX
+#endif
+#ifndef FACE_CATALOG_MAX
+  #define FACE_CATALOG_MAX        (48)
+#endif
+#ifndef FACE_CATALOG_NAME_BYTES
+  #define FACE_CATALOG_NAME_BYTES (768)
+#endif
+
+/*
+ * Index of the clock faces, built at boot from one listing of the root directory.
+ *
+ * It records which digit images, animations, packs and backgrounds each face has, so neither counting
+ * the faces nor drawing has to ask the file system whether a file is there (on SPIFFS every exists()
+ * scans the object lookup pages of the whole partition). Faces are numbered from 1 without gaps,
+ * the first face without an image of digit 0 ends the list; up to FACE_CATALOG_MAX are kept.
+ *
+ * File names, face f and digit d:
+ *   /<f><d>.bmp or .clk  image of the digit, file index f * 10 + d (10.bmp is digit 0 of face 1)
+ *   /<f>bg.bmp or .clk   background of a layered face (ImageDecoder.h), file index backgroundIndex(f)
+ *   /<f><d>.ani          animation of the digit (AnimationStream.h)
+ *   /<f>.face            all images of the face in one file (FacePack.h)
+ *   /clockfaces.txt      names, one per line for face 1, 2, ...
+ * Names stored in face packs take precedence over clockfaces.txt, faces without either are named after
+ * their number. Names are found through a hash table.
+ * The format, bit depth and size of each face are taken from the header of its digit 0 (ImageDecoder::probe()).
+ *
+ * The catalog is one block of plain data, so it can be kept across reboots (TFTs saves it in NVS with
+ * FACE_CATALOG_CACHE) and restored without opening the files. Its stamp tells which file system contents
+ * it was built from: the used and total bytes of the storage, a hash of clockfaces.txt, a hash of the name,
+ * size and write time of every file from one listing, and a hash of the images added from elsewhere.
+ * Renaming, swapping or replacing files changes the stamp, and the catalog is built again. Only files that
+ * trade places with the same size and write time go unnoticed (SPIFFS images may be built without write times).
+ */
+class FaceCatalog {
+public:
+  FaceCatalog() { clear(); }
+
+  const static uint8_t max_faces = FACE_CATALOG_MAX;
+  // Backgrounds are kept apart from the digits: face * 10 + digit stays below this.
+  const static uint16_t background_bit = 0x8000;
+  static uint16_t backgroundIndex(uint8_t face) { return background_bit | face; }
+  static bool isBackground(uint16_t file_index) { return file_index & background_bit; }
+  static uint8_t faceOf(uint16_t file_index)    { return isBackground(file_index) ? file_index & 0xFF : file_index / 10; }
+  // "/12.bmp" or "/1bg.bmp" for file index 12 or backgroundIndex(1), .clk with USE_CLK_FILES. buffer: 16 chars
+  static void fileName(uint16_t file_index, char *buffer);
+
+  void clear();
+  // Adds an image stored outside of the file system (face partition), length bytes at data.
+  // Call before build() or restore().
+  void addImage(uint16_t file_index, const uint8_t *data, uint32_t length);
+  // Lists the root directory of storage once, numbers the faces and loads their names from the packs
+  // and clockfaces.txt. Returns the number of faces.
+  uint8_t build(ImageStorage &storage);
+
+  // The catalog as a block of bytes, after build()
+  const void* getBlock() const          { return &data; }
+  static size_t getBlockSize()          { return sizeof(Data); }
+  // Takes over a block from getBlock() instead of build(), if it is intact and its stamp matches
+  // storage and the images added so far. Lists the root directory once, but opens no image.
+  // Returns false, leaving the catalog as it was, if not.
+  bool restore(const void *block, size_t size, ImageStorage &storage);
+
+  uint8_t getCount() const { return data.count; }
+  // Name of face 1..getCount(), "" for others
+  const char* getName(uint8_t face) const;
+  // The face with this name, 0 if there is none
+  uint8_t find(const char *name) const;
+
+  bool hasPack(uint8_t face) const       { return isListed(face) && (data.faces[face - 1].flags & has_pack); }
+  bool hasBackground(uint8_t face) const { return isListed(face) && (data.faces[face - 1].flags & has_background); }
+  // Bit per digit value with an animation
+  uint16_t getAnimated(uint8_t face) const { return isListed(face) ? data.faces[face - 1].animated : 0; }
+  // Header of digit 0 of the face; format is ImageDecoder::format_unknown if it couldn't be read
+  ImageDecoder::Info getInfo(uint8_t face) const;
+
+private:
+  enum flags_t : uint8_t { has_pack = 0x01, has_background = 0x02 };
+  struct Face {
+    uint16_t images;    // bit per digit with a single image file (or in the face partition)
+    uint16_t animated;  // bit per digit with an animation
+    uint16_t name;      // offset in names, or no_name
+    uint8_t  flags;
+    ImageDecoder::Info info;
+  };
+  const static uint16_t no_name = 0xFFFF;
+  // Open addressing, at most half full; entries are face numbers, 0 is free
+  const static uint8_t table_size = 128;
+  static_assert(FACE_CATALOG_MAX <= table_size / 2, "FACE_CATALOG_MAX too large for the name table");
+
+  const static uint16_t block_version = 2;
+  struct Stamp {
+    uint32_t used_bytes, total_bytes;   // of the storage
+    uint32_t names_hash;                // of clockfaces.txt, 0 if there is none
+    uint32_t files_hash;                // sum of the hashes of name, size and write time of the listed files
+    uint32_t extra_hash;                // of the images added with addImage()
+  };
+
+  // Everything in one block; the hash covers it as stored, padding included
+  struct Data {
+    uint32_t hash;      // of the rest of the block
+    uint16_t version;
+    uint16_t size;
+    Stamp    stamp;
+    Face     faces[max_faces];
+    char     names[FACE_CATALOG_NAME_BYTES];
+    uint16_t names_used;
+    uint8_t  table[table_size];
+    uint8_t  count;
+  } data;
+
+  bool isListed(uint8_t face) const { return face >= 1 && face <= data.count; }
+  Stamp currentStamp(ImageStorage &storage) const;
+  static bool sameStamp(const Stamp &a, const Stamp &b);
+  static uint32_t hashBlock(const Data &block);
+  static uint32_t hashFile(const char *name, uint32_t size, uint32_t mtime);
+  static void listed(void *context, const char *name, uint32_t size, uint32_t mtime);
+  static void hashListed(void *context, const char *name, uint32_t size, uint32_t mtime);
+  void addFile(const char *name);
+  void addIndex(uint16_t file_index);
+  void loadPacks(ImageStorage &storage);
+  void probeFiles(ImageStorage &storage);
+  void loadNames(ImageStorage &storage);
+  bool setName(uint8_t face, const char *name, size_t length);
+  static uint32_t hash(const char *name);
+  const static uint32_t hash_basis = 2166136261UL;
+  static uint32_t hash(const uint8_t *bytes, size_t length, uint32_t h = hash_basis);
+  void addToTable(uint8_t face);
+};
+
+#endif // FACE_CATALOG_H
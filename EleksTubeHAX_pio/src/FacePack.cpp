@@ -0,0 +1,69 @@
+#include "FacePack.h"
+
+#define FACE_PACK_VERSION     (1)
+#define FACE_PACK_HEADER_SIZE (40)
+#define FACE_PACK_ENTRY_SIZE  (12)
+
+bool FacePack::open(ImageStorage &storage, uint8_t face_) {
+  if (face_ == face) return true;
+  // Faces without a pack would otherwise cost a file system lookup for every image
+  if (face_ == no_pack) return false;
+  close();
+
+  // One lookup: a failed open() means there is no pack. Callers ask the catalog (hasPack()) first.
+  char filename[10];
+  fileName(face_, filename);
+  if (!storage.open(filename, file)) {
+    no_pack = face_;
+    return false;
+  }
+
+  // Header and the whole index in one read
+  uint8_t header[FACE_PACK_HEADER_SIZE + 11 * FACE_PACK_ENTRY_SIZE];
+  if (file.read(header, FACE_PACK_HEADER_SIZE) != FACE_PACK_HEADER_SIZE || memcmp(header, "FACE", 4) != 0 ||
+      header[4] != FACE_PACK_VERSION || (header[5] != 10 && header[5] != 11) ||
+      file.read(header + FACE_PACK_HEADER_SIZE, header[5] * FACE_PACK_ENTRY_SIZE) != size_t(header[5] * FACE_PACK_ENTRY_SIZE)) {
+    file.close();
+    no_pack = face_;
+    return false;
+  }
+  count = header[5];
+  memcpy(name, header + 8, 32);
+  name[32] = 0;
+
+  uint32_t file_size = file.size();
+  for (uint8_t entry = 0; entry < count; entry++) {
+    const uint8_t *e = header + FACE_PACK_HEADER_SIZE + entry * FACE_PACK_ENTRY_SIZE;
+    entries[entry].offset = ImageReader::le32(e);
+    entries[entry].length = ImageReader::le32(e + 4);
+    entries[entry].format = (format_t)e[8];
+    if (entries[entry].offset + entries[entry].length > file_size) {
+      entries[entry].format = missing;
+    }
+  }
+  face = face_;
+  return true;
+}
+
+void FacePack::close() {
+  file.close();
+  face = 0;
+  name[0] = 0;
+}
+
+bool FacePack::find(uint8_t digit, uint32_t *offset, uint32_t *length, format_t *format) {
+  if (face == 0 || digit >= count || entries[digit].format == missing || entries[digit].length == 0) {
+    return false;
+  }
+  *offset = entries[digit].offset;
+  *length = entries[digit].length;
+  if (format != nullptr) *format = entries[digit].format;
+  return true;
+}
+
+bool FacePack::select(uint8_t digit) {
+  uint32_t offset, length;
+  if (!find(digit, &offset, &length)) return false;
+  file.setBase(offset);
+  return file.seek(0);
+}
@@ -0,0 +1,64 @@
+#ifndef FACE_PACK_H
+#define FACE_PACK_H
+
+#include <stdio.h>
+#include "ImageStorage.h"
+
+/*
+ * All ten digit images of a clock face in one file, "/1.face" for face 1 and so on.
+ *
+ * The file stays open while the face is in use, so loading a digit is a seek instead of a
+ * SPIFFS open(), which has to scan the object lookup pages of the whole file system.
+ * Build packs with `clktool pack` (see Prepare_images/clktool.cpp). Faces without a pack
+ * are still loaded from the single files (10.bmp ... 19.bmp).
+ *
+ * Layout, little-endian:
+ *   char     magic[4]  "FACE"
+ *   uint8_t  version   1
+ *   uint8_t  count     10, or 11 for layered faces
+ *   uint16_t reserved
+ *   char     name[32]  shown in the menu and over MQTT, replaces the line in clockfaces.txt
+ *   Entry    entries[count], one per digit 0..9, then the background of a layered face (see ImageDecoder.h)
+ *   image data (BMP, CLK or CLK v2 files as they are, 4-byte aligned)
+ */
+class FacePack {
+public:
+  enum format_t : uint8_t { bmp = 0, clk = 1, clk2 = 2, sprite = 3, missing = 255 };
+  // Entry of the background, after the digits
+  const static uint8_t background = 10;
+
+  FacePack() : face(0), no_pack(0), count(0) { name[0] = 0; }
+  ~FacePack() { close(); }
+
+  // Opens the pack of face (1..FACE_CATALOG_MAX). Returns false if there is none or it is not valid.
+  bool open(ImageStorage &storage, uint8_t face_);
+  void close();
+  bool isOpen() const        { return face != 0; }
+  uint8_t getFace() const    { return face; }
+  const char* getName() const { return name; }
+
+  // Where the image of digit (or background) starts in the file. Returns false if the pack doesn't have it.
+  bool find(uint8_t digit, uint32_t *offset, uint32_t *length, format_t *format = nullptr);
+  // Positions the file on the image of digit. Returns false if the pack doesn't have it.
+  bool select(uint8_t digit);
+  // The open file, reading the image found last (positions are relative to it)
+  ImageFile& getFile()       { return file; }
+
+  static void fileName(uint8_t face, char *buffer) { sprintf(buffer, "/%d.face", face); }
+
+private:
+  struct Entry {
+    uint32_t offset;    // from the start of the file
+    uint32_t length;
+    format_t format;
+  };
+
+  ImageFile file;
+  uint8_t face;
+  uint8_t no_pack;    // last face found without a (valid) pack
+  char name[33];
+  uint8_t count;
+  Entry entries[11];
+};
+
+#endif // FACE_PACK_H
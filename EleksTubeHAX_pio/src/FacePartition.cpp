@@ -0,0 +1,53 @@
+#include "FacePartition.h"
+
+#define FACE_PARTITION_LABEL    "faces"
+#define FACE_PARTITION_SUBTYPE  (0x40)
+#define FACE_PARTITION_VERSION  (1)
+
+FacePartition face_partition;
+
+bool FacePartition::begin() {
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+    (esp_partition_subtype_t)FACE_PARTITION_SUBTYPE, FACE_PARTITION_LABEL);
+  if (partition == nullptr) {
+    return false;
+  }
+
+  const void *mapped = nullptr;
+  if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &handle) != ESP_OK) {
+    Serial.println("Face partition: mmap failed");
+    return false;
+  }
+
+  const uint8_t *header = (const uint8_t*)mapped;
+  uint16_t version = header[4] | (header[5] << 8);
+  uint16_t num_entries = header[6] | (header[7] << 8);
+  if (memcmp(header, "TTFP", 4) != 0 || version != FACE_PARTITION_VERSION ||
+      8 + uint32_t(num_entries) * sizeof(Entry) > partition->size) {
+    Serial.println("Face partition: no valid image found, using the file system");
+    spi_flash_munmap(handle);
+    return false;
+  }
+
+  base = header;
+  size = partition->size;
+  entries = (const Entry*)(header + 8);
+  count = num_entries;
+
+  Serial.print("Face partition: ");
+  Serial.print(count);
+  Serial.println(" images mapped");
+  return true;
+}
+
+bool FacePartition::find(uint16_t file_index, const uint8_t **data, uint32_t *length) {
+  for (uint16_t i = 0; i < count; i++) {
+    if (entries[i].file_index == file_index) {
+      if (entries[i].offset + entries[i].length > size) return false;
+      *data = base + entries[i].offset;
+      *length = entries[i].length;
+      return true;
+    }
+  }
+  return false;
+}
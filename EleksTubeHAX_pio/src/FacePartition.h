@@ -0,0 +1,51 @@
+#ifndef FACE_PARTITION_H
+#define FACE_PARTITION_H
+
+#include "GLOBAL_DEFINES.h"
+#include "esp_partition.h"
+
+/*
+ * Read-only store of pre-packed clock face images in their own flash partition.
+ *
+ * The partition (label "faces", type data, subtype 0x40) is memory mapped once, so the decoders
+ * read headers and pixels straight from the flash cache: no file system lookups, no copies.
+ * Build the image with `clktool partition` (see Prepare_images/clktool.cpp) and flash it to the
+ * partition offset. Without such a partition, images are loaded from SPIFFS as before.
+ *
+ * Layout, little-endian:
+ *   char     magic[4]  "TTFP"
+ *   uint16_t version   1
+ *   uint16_t count
+ *   Entry    entries[count]
+ *   image data (BMP or CLK files as they are, 4-byte aligned)
+ */
+class FacePartition {
+public:
+  FacePartition() : base(nullptr), size(0), entries(nullptr), count(0) {}
+
+  bool begin();
+  bool isMapped() const     { return base != nullptr; }
+  uint16_t getCount() const { return count; }
+  uint16_t getFileIndex(uint16_t i) const { return entries[i].file_index; }
+
+  // Finds the image for file_index (10.bmp -> 10). Returns false if it is not in the partition.
+  bool find(uint16_t file_index, const uint8_t **data, uint32_t *length);
+
+private:
+  struct Entry {
+    uint16_t file_index;
+    uint16_t reserved;
+    uint32_t offset;   // from the start of the partition
+    uint32_t length;
+  };
+
+  const uint8_t *base;
+  uint32_t size;
+  const Entry *entries;
+  uint16_t count;
+  spi_flash_mmap_handle_t handle;
+};
+
+extern FacePartition face_partition;
+
+#endif // FACE_PARTITION_H
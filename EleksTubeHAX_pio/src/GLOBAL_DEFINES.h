@@ -28,6 +28,118 @@
 #define ESP_MODEL_NUMBER  "ESP32"
 #define ESP_MODEL_NAME    "TubeTemp"
 
+// ************ Image cache and display push *********************
+// RAM used for decoded clock face images. A 24 bit BMP or CLK image takes 2 bytes per visible pixel (TFT_WIDTH * TFT_HEIGHT * 2
+// for a full screen image), paletted BMPs stay indexed and take half (8 bit) or a quarter (4 bit) of that.
+// Can be overridden in _USER_DEFINES.h to size the cache per board; watch the hit/miss counters in the debug output.
+#ifndef IMAGE_CACHE_BYTES
+  #define IMAGE_CACHE_BYTES       (2 * 64800 + 2048)  // without PSRAM, memory comes from the internal heap (shared with WiFi and Bluetooth)
+#endif
+#ifndef IMAGE_CACHE_BYTES_PSRAM
+  #define IMAGE_CACHE_BYTES_PSRAM (1024 * 1024)       // used when the board has PSRAM
+#endif
+#define IMAGE_CACHE_MAX_SLOTS     (32)                // upper limit of images in the cache
+#define IMAGE_CACHE_HEAP_RESERVE  (48 * 1024)         // keep this much internal heap free when adding images beyond the first
+#define PUSH_STRIP_LINES          (16)                // lines expanded/dimmed and pushed at once
+
+// Images for digit changes up to this many seconds ahead are decoded in the idle part of loop(), earliest first.
+// Without PSRAM the cache only holds a few images; a longer look-ahead would evict the ones needed first.
+#ifndef PRELOAD_HORIZON_S
+  #define PRELOAD_HORIZON_S       (3)
+#endif
+#define PRELOAD_GRACE_MS          (2000)              // queued images not drawn this long after their deadline are dropped
+#define FACE_SWITCH_TIMEOUT_MS    (1000)              // longest wait for the images of a new clock face before switching anyway
+
+// Clock faces are indexed once at boot from a listing of the file system (FaceCatalog.h).
+#ifndef FACE_CATALOG_MAX
+  #define FACE_CATALOG_MAX        (48)                // faces 1..48; at most 64
+#endif
+#define FACE_CATALOG_NAME_BYTES   (768)               // all face names together, each with its terminating zero
+// Keep the catalog in NVS, so no image or pack is opened at boot while the file system stays the same.
+// Comment out to build it at every boot.
+#define FACE_CATALOG_CACHE
+#define FACE_CATALOG_KEY          "faces"             // NVS key, next to the config
+
+// Placement of images that don't match the display size: 0 = left/top, 1 = center, 2 = right/bottom.
+// Smaller images get a black border (not stored in the cache), larger images are cropped at that anchor.
+#ifndef IMAGE_ANCHOR_X
+  #define IMAGE_ANCHOR_X          (1)
+#endif
+#ifndef IMAGE_ANCHOR_Y
+  #define IMAGE_ANCHOR_Y          (1)
+#endif
+
+// File system holding the clock faces: SPIFFS by default. LittleFS opens files faster and has real directories;
+// it needs `board_build.filesystem = littlefs` in platformio.ini, so the uploaded image is LittleFS too.
+//#define IMAGE_STORAGE_LITTLEFS
+
+// Drive the chip select shift register (74HC595) through the GPIO set/clear registers instead of digitalWrite()
+// and shiftOut(). Its pins have to be GPIO 0..31. Comment out to use the Arduino functions.
+#define CHIP_SELECT_DIRECT_GPIO
+
+// Push images with DMA: the next strip is prepared while the current one is on the bus, and setDigit()
+// returns before the transfer is complete. Comment out to use blocking transfers.
+#define USE_DMA_PUSH
+
+// SPI clock of the displays. With SPI_CALIBRATION it is raised step by step at the first boot, in the steps the SPI
+// peripheral can make (80 MHz / n) from SPI_CALIBRATION_MIN to SPI_CALIBRATION_MAX. Test patterns are written to every
+// display and read back over TFT_SDA_READ, and the push time of a full frame at each step goes to the serial output.
+// One step below the fastest clock all displays keep up with is saved next to the config, as a margin for
+// temperature and wiring. Without SPI_CALIBRATION, or if no clock passes, SPI_FREQUENCY_DEFAULT is used.
+// The calibrated clock applies to the pushes of TFTs (images, transitions, overlays, blanking). init(), the text
+// output of main.cpp and other TFT_eSPI calls outside those pushes stay at SPI_FREQUENCY, readback at
+// SPI_READ_FREQUENCY. The DMA device is fixed at SPI_FREQUENCY, so a calibrated clock pushes without DMA.
+// Off by default: readback needs a wired TFT_SDA_READ line, and a marginal clock fails only later.
+//#define SPI_CALIBRATION
+//#define SPI_CALIBRATE_AT_BOOT                       // calibrate at every boot instead of once
+#define SPI_CALIBRATION_MIN       (20000000)
+#define SPI_CALIBRATION_MAX       (80000000)
+#define SPI_CALIBRATION_ROUNDS    (2)                 // times each test pattern is written to each display per step
+#define SPI_CALIBRATION_KEY       "spi"               // NVS key, next to the config
+
+// Display brightness, used for night mode (DAY_TIME, NIGHT_TIME and TFT_DIMMED_INTENSITY in _USER_DEFINES.h).
+// By default the pushed pixels are dimmed and all displays redrawn. With a panel control, brightness ramps smoothly
+// and the images are never touched:
+//   PANEL_BRIGHTNESS_PWM: PWM on TFT_ENABLE_PIN. Only for boards where that pin switches just the backlight LEDs,
+//                         not the supply of the display controllers.
+//   PANEL_BRIGHTNESS_DCS: ST7789 brightness commands, for panels with the backlight driven by the controller.
+//#define PANEL_BRIGHTNESS_PWM
+//#define PANEL_BRIGHTNESS_DCS
+#define PANEL_BRIGHTNESS_PWM_CHANNEL  (0)             // LEDC channel
+#define PANEL_BRIGHTNESS_PWM_FREQ     (20000)         // Hz, above the audible range
+#define BRIGHTNESS_RAMP_MS            (2000)          // duration of the change to and from night brightness
+
+// Transition between the old and the new image when a digit changes: transition_crossfade, transition_slide
+// (the new digit pushes the old one up) or transition_none. Only between cached images of the same clock face.
+#ifndef DIGIT_TRANSITION
+  #define DIGIT_TRANSITION        transition_crossfade
+#endif
+#define TRANSITION_MS             (300)               // duration of a transition
+#define TRANSITION_FPS            (30)                // frames per second and changing display, if the SPI bus keeps up
+
+// Animated digits ("/10.ani" for digit 0 of face 1, see AnimationStream.h) are streamed from the file system
+// while they are shown. loop() pushes due frames for at most this long; displays left over go first next time.
+// Frames that are more than one interval late are dropped, so the animations keep their speed.
+#define ANIMATION_BUDGET_MS       (12)
+
+// Decode images on a FreeRTOS task pinned to the other core, so slow flash reads don't delay the clock tick.
+// The loop task only pushes decoded images. Comment out to decode on the loop task.
+#define USE_DECODE_TASK
+#define DECODE_QUEUE_LENGTH       (4)                 // images requested from the decode task at once
+#define DECODE_TASK_STACK         (8192)              // bytes; the decoders keep row buffers on the stack
+#define DECODE_TASK_PRIORITY      (1)                 // below the WiFi and Bluetooth tasks on core 0
+#define DECODE_TIMEOUT_MS         (2000)              // longest wait for an image that is needed right now
+
+
+// ************ Boot *********************
+// Show the time from the RTC as soon as the displays are up, without boot messages and waits. The first NTP query
+// and the start of Bluetooth run on a task on core 0 while the clock already ticks; the NTP time is taken over when
+// it arrives. Comment out for the old sequence: boot messages on the displays, NTP and Bluetooth before the clock starts.
+// Either way the durations of the boot phases and the time to the first correct digits go to the serial output.
+#define FAST_BOOT
+#define BOOT_TASK_STACK           (8192)              // bytes, freed when the task ends
+#define BOOT_TASK_PRIORITY        (1)
+
 // ************ Hardware definitions *********************
 
 // Disable all warnings from the TFT_eSPI lib
@@ -116,8 +228,10 @@
   //#define LOAD_GFXFF  // FreeFonts. Include access to the 48 Adafruit_GFX free fonts FF1 to FF48 and custom fonts
 
   #define SMOOTH_FONT
-  //#define SPI_FREQUENCY  27000000
-  #define SPI_FREQUENCY  40000000
+  //#define SPI_FREQUENCY_DEFAULT  27000000
+  #define SPI_FREQUENCY_DEFAULT  40000000
+  #define SPI_FREQUENCY  SPI_FREQUENCY_DEFAULT   // a calibrated clock is set at runtime, see TFTs::startPush()
+  #define SPI_READ_FREQUENCY  6000000   // the ST7789 reads at up to 6.6 MHz
   /*
    * To make the Library not over-write all this:
    */
@@ -0,0 +1,252 @@
+#include "ImageCache.h"
+#include "esp_heap_caps.h"
+
+uint8_t ImageCache::begin(uint8_t max_slots, size_t budget_bytes) {
+  end();
+
+  if (max_slots > IMAGE_CACHE_MAX_SLOTS) max_slots = IMAGE_CACHE_MAX_SLOTS;
+  in_psram = psramFound();
+  budget = budget_bytes;
+  used = 0;
+  reserved = 0;
+
+  for (uint8_t i = 0; i < max_slots; i++) {
+    slots[i].frame = nullptr;
+    slots[i].capacity = 0;
+    slots[i].file_index = empty;
+    slots[i].last_used = 0;
+    slots[i].pinned = false;
+  }
+  num_slots = max_slots;
+
+  Serial.print("Image cache: up to ");
+  Serial.print(num_slots);
+  Serial.print(" images in ");
+  Serial.print(budget);
+  Serial.println(in_psram ? " bytes of PSRAM" : " bytes of internal RAM");
+
+  return num_slots;
+}
+
+void ImageCache::end() {
+  for (uint8_t i = 0; i < num_slots; i++) {
+    release(i);
+  }
+  num_slots = 0;
+}
+
+int8_t ImageCache::findSlot(uint16_t file_index) {
+  if (file_index == empty) return -1;
+  for (uint8_t i = 0; i < num_slots; i++) {
+    if (slots[i].file_index == file_index) return i;
+  }
+  return -1;
+}
+
+// Least recently used entry holding memory, invalidated entries first. Never returns `keep` or a pinned entry.
+int8_t ImageCache::findVictim(int8_t keep) {
+  int8_t victim = -1;
+  for (uint8_t i = 0; i < num_slots; i++) {
+    if (i == keep || slots[i].frame == nullptr || slots[i].pinned) continue;
+    if (slots[i].file_index == empty) return i;
+    if (victim < 0 || slots[i].last_used < slots[victim].last_used) victim = i;
+  }
+  return victim;
+}
+
+void ImageCache::release(uint8_t i) {
+  if (slots[i].frame != nullptr) {
+    heap_caps_free(slots[i].frame);
+    used -= sizeof(ImageFrame) + slots[i].capacity;
+  }
+  slots[i].frame = nullptr;
+  slots[i].capacity = 0;
+  slots[i].file_index = empty;
+  slots[i].pinned = false;
+}
+
+ImageFrame* ImageCache::lookup(uint16_t file_index) {
+  int8_t i = findSlot(file_index);
+  if (i < 0) {
+    misses++;
+    return nullptr;
+  }
+  hits++;
+  slots[i].last_used = ++use_counter;
+  return slots[i].frame;
+}
+
+ImageFrame* ImageCache::peek(uint16_t file_index) {
+  int8_t i = findSlot(file_index);
+  return (i < 0) ? nullptr : slots[i].frame;
+}
+
+ImageFrame* ImageCache::acquire(uint16_t file_index, size_t data_bytes) {
+  if (num_slots == 0) return nullptr;
+
+  int8_t target = findSlot(file_index);
+  if (target < 0) {
+    // Prefer a free entry that already has a large enough buffer, then any free entry, then the least recently used one.
+    for (uint8_t i = 0; i < num_slots && target < 0; i++) {
+      if (slots[i].file_index == empty && slots[i].frame != nullptr && slots[i].capacity >= data_bytes) target = i;
+    }
+    for (uint8_t i = 0; i < num_slots && target < 0; i++) {
+      if (slots[i].file_index == empty) target = i;
+    }
+    if (target < 0) target = findVictim(-1);
+    if (target < 0) {
+      Serial.println(F("Image cache: all images pinned"));
+      return nullptr;
+    }
+  }
+  slots[target].file_index = empty;
+
+  if (slots[target].frame == nullptr || slots[target].capacity < data_bytes) {
+    release(target);
+
+    size_t required = sizeof(ImageFrame) + data_bytes;
+    uint32_t caps = in_psram ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ImageFrame *frame = nullptr;
+    while (true) {
+      if (fits(required) || used == 0) {
+        frame = (ImageFrame*)heap_caps_malloc(required, caps);
+        if (frame != nullptr) break;
+      }
+      int8_t victim = findVictim(target);
+      if (victim < 0) break;
+      release(victim);
+    }
+    if (frame == nullptr) {
+      Serial.println(F("Image cache: out of memory"));
+      return nullptr;
+    }
+    slots[target].frame = frame;
+    slots[target].capacity = data_bytes;
+    used += required;
+  }
+
+  slots[target].file_index = file_index;
+  slots[target].last_used = ++use_counter;
+  slots[target].frame->pixels = (uint8_t*)(slots[target].frame + 1);
+  return slots[target].frame;
+}
+
+// Stay within the budget, and don't starve the network stacks when using internal RAM.
+// Reserved frames are not allocated yet, so they still count against the free heap.
+bool ImageCache::fits(size_t required) {
+  if (used + reserved + required > budget) return false;
+  if (in_psram || used + reserved == 0) return true;
+  return heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT) >= required + reserved + IMAGE_CACHE_HEAP_RESERVE;
+}
+
+ImageFrame* ImageCache::allocate(size_t data_bytes) {
+  uint32_t caps = in_psram ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  ImageFrame *frame = (ImageFrame*)heap_caps_malloc(sizeof(ImageFrame) + data_bytes, caps);
+  if (frame != nullptr) frame->pixels = (uint8_t*)(frame + 1);
+  return frame;
+}
+
+void ImageCache::discard(ImageFrame *frame) {
+  heap_caps_free(frame);
+}
+
+bool ImageCache::reserve(size_t data_bytes) {
+  size_t required = sizeof(ImageFrame) + data_bytes;
+  while (!fits(required)) {
+    int8_t victim = findVictim(-1);
+    if (victim < 0) return false;
+    release(victim);
+  }
+  reserved += required;
+  return true;
+}
+
+void ImageCache::unreserve(size_t data_bytes) {
+  size_t required = sizeof(ImageFrame) + data_bytes;
+  reserved = (reserved > required) ? reserved - required : 0;
+}
+
+ImageFrame* ImageCache::adopt(uint16_t file_index, ImageFrame *frame, size_t data_bytes) {
+  if (num_slots == 0) {
+    discard(frame);
+    return nullptr;
+  }
+  invalidate(file_index);
+
+  // A free entry, its old buffer is not needed; otherwise the least recently used one.
+  int8_t target = -1;
+  for (uint8_t i = 0; i < num_slots && target < 0; i++) {
+    if (slots[i].file_index == empty) target = i;
+  }
+  if (target < 0) target = findVictim(-1);
+  if (target < 0) {
+    // Every entry is pinned
+    discard(frame);
+    return nullptr;
+  }
+  release(target);
+
+  slots[target].frame = frame;
+  slots[target].capacity = data_bytes;
+  slots[target].file_index = file_index;
+  slots[target].last_used = ++use_counter;
+  used += sizeof(ImageFrame) + data_bytes;
+
+  // The frame is already allocated; make up for it if the cache is over its budget now.
+  while (used + reserved > budget) {
+    int8_t victim = findVictim(target);
+    if (victim < 0) break;
+    release(victim);
+  }
+  return frame;
+}
+
+void ImageCache::invalidate(uint16_t file_index) {
+  int8_t i = findSlot(file_index);
+  if (i >= 0) {
+    slots[i].file_index = empty;
+    slots[i].pinned = false;
+  }
+}
+
+void ImageCache::invalidateAll() {
+  for (uint8_t i = 0; i < num_slots; i++) {
+    slots[i].file_index = empty;
+    slots[i].pinned = false;
+  }
+}
+
+void ImageCache::pin(uint16_t file_index) {
+  int8_t i = findSlot(file_index);
+  if (i >= 0) slots[i].pinned = true;
+}
+
+void ImageCache::unpinAll() {
+  for (uint8_t i = 0; i < num_slots; i++) {
+    slots[i].pinned = false;
+  }
+}
+
+size_t ImageCache::getPinnedBytes() const {
+  size_t pinned = 0;
+  for (uint8_t i = 0; i < num_slots; i++) {
+    if (slots[i].pinned) pinned += sizeof(ImageFrame) + slots[i].capacity;
+  }
+  return pinned;
+}
+
+void ImageCache::printStats() {
+  uint32_t total = hits + misses;
+  Serial.print("Image cache hits/misses: ");
+  Serial.print(hits);
+  Serial.print("/");
+  Serial.print(misses);
+  if (total > 0) {
+    Serial.print(" (");
+    Serial.print((hits * 100) / total);
+    Serial.print("% hit rate)");
+  }
+  Serial.print(", ");
+  Serial.print(used);
+  Serial.println(" bytes used");
+}
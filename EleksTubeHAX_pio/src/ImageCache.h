@@ -0,0 +1,93 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include "GLOBAL_DEFINES.h"
+#include "ImageFrame.h"
+
+/*
+ * Small LRU cache of decoded clock face images, keyed by file index (face * 10 + digit, backgrounds of layered faces see TFTs::backgroundIndex()).
+ * Entries are sized to the decoded frame, so indexed (paletted) faces take a half or
+ * a quarter of a full RGB565 frame and more of them fit into the same byte budget.
+ * Memory is taken from PSRAM when the board has it, otherwise from the internal heap.
+ *
+ * Hit/miss counters only count lookup(), which is what DrawImage() uses, so they
+ * tell how often a digit had to be decoded while the display was waiting for it.
+ *
+ * Images decoded on the decode task (DecodeWorker) are not written into the cache: the task decodes
+ * into memory from allocate() and the loop hands the finished frame over with adopt(). The loop
+ * reserve()s the memory for each such frame before requesting it, so the frames on their way count
+ * against the budget and the heap reserve too. Everything else must only be called from the loop task.
+ */
+class ImageCache : public FrameAllocator {
+public:
+  ImageCache() : num_slots(0), budget(0), used(0), reserved(0), use_counter(0), in_psram(false), hits(0), misses(0) {}
+  ~ImageCache() { end(); }
+
+  const static uint16_t empty = 0xFFFF;
+
+  // Sets up max_slots entries sharing budget_bytes. Memory is allocated when images are decoded.
+  uint8_t begin(uint8_t max_slots, size_t budget_bytes);
+  void end();
+  bool isAllocated() const      { return num_slots > 0; }
+  uint8_t getNumSlots() const   { return num_slots; }
+  size_t getUsedBytes() const   { return used; }
+  bool isInPsram() const        { return in_psram; }
+
+  // Returns the frame holding file_index, or nullptr. Counts a hit or a miss and marks the entry as recently used.
+  ImageFrame* lookup(uint16_t file_index);
+  // Same as lookup(), but does not touch the statistics or the LRU order.
+  ImageFrame* peek(uint16_t file_index);
+  bool contains(uint16_t file_index) { return peek(file_index) != nullptr; }
+  // Returns a frame with room for data_bytes of pixels to decode file_index into,
+  // evicting least recently used images until it fits. nullptr if out of memory.
+  ImageFrame* acquire(uint16_t file_index, size_t data_bytes) override;
+
+  // Memory for a frame outside of the cache, with the caps of the cache. Safe to call from the decode task.
+  ImageFrame* allocate(size_t data_bytes);
+  void discard(ImageFrame *frame);
+  // Evicts least recently used images until data_bytes more fit next to the images and the reservations
+  // so far, then reserves them for a frame allocate()d on the other task. false if they don't fit.
+  bool reserve(size_t data_bytes);
+  // Ends a reservation, when its frame is adopted or decoding failed.
+  void unreserve(size_t data_bytes);
+  // Takes over a frame from allocate() as file_index. Evicts least recently used images to stay within the budget.
+  ImageFrame* adopt(uint16_t file_index, ImageFrame *frame, size_t data_bytes);
+  void invalidate(uint16_t file_index);
+  void invalidateAll();
+
+  // Pinned images are not evicted until unpinAll(), e.g. while the next clock face is prefetched.
+  void pin(uint16_t file_index);
+  void unpinAll();
+  size_t getPinnedBytes() const;
+  size_t getBudget() const      { return budget; }
+
+  uint32_t getHits() const      { return hits; }
+  uint32_t getMisses() const    { return misses; }
+  void resetStats()             { hits = 0; misses = 0; }
+  void printStats();
+
+private:
+  struct Slot {
+    ImageFrame *frame;
+    size_t   capacity;    // pixel bytes available behind the frame header
+    uint16_t file_index;
+    uint32_t last_used;
+    bool     pinned;
+  };
+
+  Slot slots[IMAGE_CACHE_MAX_SLOTS];
+  uint8_t num_slots;
+  size_t budget, used;
+  size_t reserved;      // for frames being decoded on the other task
+  uint32_t use_counter;
+  bool in_psram;
+
+  uint32_t hits, misses;
+
+  int8_t findSlot(uint16_t file_index);
+  int8_t findVictim(int8_t keep);
+  void release(uint8_t i);
+  bool fits(size_t required);
+};
+
+#endif // IMAGE_CACHE_H
@@ -0,0 +1,401 @@
+#include "ImageDecoder.h"
+#include "RowKernels.h"
+
+// How the rows of RGB images are stored in the file
+enum row_source_t { bgr24, rgb565le };
+
+// Reads the h rows of lineSize bytes and keeps the visible part p in an RGB565 frame of that size.
+// Specialized per source format and cropping: only CROPPED images need the row and column offsets.
+template <row_source_t SOURCE, bool CROPPED>
+static bool copyRows(ImageReader &reader, ImageFrame* frame, const ImageDecoder::Placement &p,
+                     int16_t h, uint32_t lineSize, bool bottomUp) {
+    uint8_t lineBuffer[lineSize];
+    for (int16_t i = 0; i < h; i++) {
+        const uint8_t* line = reader.next(lineBuffer, lineSize);
+        if (line == nullptr) {
+            return false;
+        }
+        int16_t row = bottomUp ? h - 1 - i : i;
+        if (CROPPED) {
+            row -= p.src_y;
+            if (row < 0 || row >= p.height) {
+                if (!bottomUp && row >= p.height) break;  // the rest is cropped too
+                continue;
+            }
+            line += p.src_x * ((SOURCE == bgr24) ? 3 : 2);
+        }
+        uint16_t* dst = (uint16_t*)frame->data() + row * p.width;
+        if (SOURCE == bgr24) {
+            RowKernels::bgr24ToRgb565(line, p.width, dst);
+        }
+        else {
+            memcpy(dst, line, p.width * sizeof(uint16_t));  // little-endian, like the ESP32
+        }
+    }
+    return true;
+}
+
+// Picks the row loop once per image, for an image of w x h pixels
+static bool copyRows(row_source_t source, ImageReader &reader, ImageFrame* frame, const ImageDecoder::Placement &p,
+                     int16_t w, int16_t h, uint32_t lineSize, bool bottomUp) {
+    bool cropped = (p.width != w || p.height != h);
+    if (source == bgr24) {
+        return cropped ? copyRows<bgr24, true>(reader, frame, p, h, lineSize, bottomUp)
+                       : copyRows<bgr24, false>(reader, frame, p, h, lineSize, bottomUp);
+    }
+    return cropped ? copyRows<rgb565le, true>(reader, frame, p, h, lineSize, bottomUp)
+                   : copyRows<rgb565le, false>(reader, frame, p, h, lineSize, bottomUp);
+}
+
+// Offset of a size pixels long image on a display axis of length pixels
+static int16_t anchorOffset(ImageDecoder::anchor_t anchor, int16_t size, int16_t length) {
+    if (anchor == ImageDecoder::anchor_start) return 0;
+    if (anchor == ImageDecoder::anchor_end) return length - size;
+    return (length - size) / 2;
+}
+
+// Visible part of a size pixels long image at pos on a display axis of length pixels
+static void clipAxis(int16_t pos, int16_t size, int16_t length, int16_t &src, int16_t &dst, int16_t &visible) {
+    src = (pos < 0) ? -pos : 0;
+    dst = (pos < 0) ? 0 : pos;
+    visible = (size - src < length - dst) ? size - src : length - dst;
+}
+
+ImageDecoder::Placement ImageDecoder::place(int16_t w, int16_t h) const {
+    // Images larger than the display are cropped, smaller ones keep their size.
+    Placement p;
+    clipAxis(anchorOffset(anchor_x, w, display_width), w, display_width, p.src_x, p.x, p.width);
+    clipAxis(anchorOffset(anchor_y, h, display_height), h, display_height, p.src_y, p.y, p.height);
+    return p;
+}
+
+ImageDecoder::Placement ImageDecoder::placeSprite(int16_t x, int16_t y, int16_t w, int16_t h,
+                                                  int16_t background_w, int16_t background_h) const {
+    Placement p;
+    clipAxis(anchorOffset(anchor_x, background_w, display_width) + x, w, display_width, p.src_x, p.x, p.width);
+    clipAxis(anchorOffset(anchor_y, background_h, display_height) + y, h, display_height, p.src_y, p.y, p.height);
+    return p;
+}
+
+// Where the image being decoded goes: a glyph on its background, anything else at the anchor
+ImageDecoder::Placement ImageDecoder::placeImage(int16_t w, int16_t h) const {
+    if (sprite == nullptr) return place(w, h);
+    return placeSprite(sprite->x, sprite->y, w, h, sprite->background_w, sprite->background_h);
+}
+
+void ImageDecoder::setFrame(ImageFrame* frame, ImageFrame::format_t format, uint8_t bits, const Placement &p) {
+    frame->format = format;
+    frame->bits = bits;
+    frame->x = p.x;
+    frame->y = p.y;
+    frame->width = p.width;
+    frame->height = p.height;
+    frame->src_x = (format == ImageFrame::indexed) ? p.src_x : 0;
+    frame->sprite = (sprite != nullptr);
+}
+
+// Picks the decoder from the magic number at the start of the file.
+bool ImageDecoder::decode(ImageReader &reader, uint16_t file_index) {
+    uint8_t magic[2];
+    if (reader.read(magic, sizeof(magic)) != sizeof(magic)) {
+        return fail("file too short");
+    }
+    uint16_t m = ImageReader::le16(magic);
+    if (m == 0x4D42) { // "BM"
+        return decodeBmp(reader, file_index);
+    }
+    if (m == 0x4B43) { // "CK"
+        return decodeClk(reader, file_index);
+    }
+    if (m == 0x3243) { // "C2"
+        return decodeClk2(reader, file_index);
+    }
+    if (m == 0x5343) { // "CS"
+        return decodeSprite(reader, file_index);
+    }
+    if (m == 0xFFFF) {
+        return fail("Can't open file. Make sure you upload the SPIFFs image with BMPs.");
+    }
+    return fail("Image format not recognized.");
+}
+
+bool ImageDecoder::probe(ImageReader &reader, Info *info) {
+    // Enough for the BMP headers up to the bit depth, the longest of the formats
+    uint8_t header[30];
+    size_t got = reader.read(header, sizeof(header));
+    if (got < 8) return false;
+    Info found;
+    int32_t w, h;
+    switch (ImageReader::le16(header)) {
+    case 0x4D42: // "BM"
+        if (got < 30) return false;
+        w = (int32_t)ImageReader::le32(header + 18);
+        h = (int32_t)ImageReader::le32(header + 22);
+        if (h < 0) h = -h;
+        found.format = format_bmp;
+        found.bits = ImageReader::le16(header + 28);
+        break;
+    case 0x4B43: // "CK"
+        w = ImageReader::le16(header + 2);
+        h = ImageReader::le16(header + 4);
+        found.format = format_clk;
+        found.bits = 16;
+        break;
+    case 0x3243: // "C2"
+        w = ImageReader::le16(header + 4);
+        h = ImageReader::le16(header + 6);
+        found.format = format_clk2;
+        found.bits = (header[3] == CLK2_FORMAT_IDX8) ? 8 : 16;
+        break;
+    case 0x5343: // "CS", followed by a CLK v2 header
+        if (got < 16) return false;
+        w = ImageReader::le16(header + 8);
+        h = ImageReader::le16(header + 10);
+        found.format = format_sprite;
+        found.bits = (header[15] == CLK2_FORMAT_IDX8) ? 8 : 16;
+        break;
+    default:
+        return false;
+    }
+    if (w <= 0 || h <= 0 || w > MAX_IMAGE_SIZE || h > MAX_IMAGE_SIZE) return false;
+    found.width = w;
+    found.height = h;
+    *info = found;
+    return true;
+}
+
+// RGB565 frame holding just the visible part of the image. The border around it is not stored,
+// it is filled in black while pushing.
+ImageFrame* ImageDecoder::acquireRgbFrame(uint16_t file_index, const Placement &p) {
+    ImageFrame* frame = frames.acquire(file_index, uint32_t(p.width) * p.height * sizeof(uint16_t));
+    if (frame == nullptr) {
+        return nullptr;
+    }
+    setFrame(frame, ImageFrame::rgb565, 16, p);
+    frame->stride = p.width * sizeof(uint16_t);
+    return frame;
+}
+
+// CLK: "CK", width, height, then raw little-endian RGB565 rows, top-down.
+bool ImageDecoder::decodeClk(ImageReader &reader, uint16_t file_index) {
+    uint8_t header[4];
+    if (reader.read(header, sizeof(header)) != sizeof(header)) {
+        return fail("truncated or corrupt file");
+    }
+    int16_t w = ImageReader::le16(header);
+    int16_t h = ImageReader::le16(header + 2);
+    if (w <= 0 || h <= 0 || w > MAX_IMAGE_SIZE || h > MAX_IMAGE_SIZE) {
+        return fail("Invalid CLK file");
+    }
+    Placement p = placeImage(w, h);
+
+    // Take the least recently used entry of the cache
+    ImageFrame* frame = acquireRgbFrame(file_index, p);
+    if (frame == nullptr) {
+        return fail("out of memory");
+    }
+    if (!copyRows(rgb565le, reader, frame, p, w, h, w * 2, false)) {
+        return fail("truncated or corrupt file");
+    }
+    return true;
+}
+
+// CLK v2: "C2", version, format, width, height, palette size, RGB565 palette,
+// then top-down rows, each a 16-bit byte count followed by RLE packets (see RowKernels::unpackRow()).
+// Rows are decoded straight into the cached frame; rows cropped off the display are skipped unpacked.
+bool ImageDecoder::decodeClk2(ImageReader &reader, uint16_t file_index) {
+    uint8_t header[8];
+    if (reader.read(header, sizeof(header)) != sizeof(header)) {
+        return fail("truncated or corrupt file");
+    }
+    uint8_t version = header[0];
+    uint8_t format = header[1];
+    int16_t w = ImageReader::le16(header + 2);
+    int16_t h = ImageReader::le16(header + 4);
+    uint16_t paletteSize = ImageReader::le16(header + 6);
+    if (version != CLK2_VERSION || format > CLK2_FORMAT_IDX8 ||
+        w <= 0 || h <= 0 || w > MAX_IMAGE_SIZE || h > MAX_IMAGE_SIZE ||
+        (format == CLK2_FORMAT_IDX8) != (paletteSize > 0) || paletteSize > 256) {
+        return fail("Invalid CLK v2 file");
+    }
+    Placement p = placeImage(w, h);
+    if (p.width <= 0 || p.height <= 0) {
+        return fail("sprite outside of the display");
+    }
+
+    uint8_t bytesPerPixel = (format == CLK2_FORMAT_RGB565) ? 2 : 1;
+    uint16_t maxRowSize = w * bytesPerPixel + (w + 127) / 128;
+    uint8_t rowBuffer[maxRowSize];
+    uint8_t rowSize[2];
+
+    if (format == CLK2_FORMAT_IDX8) {
+        // Indexed rows are kept whole, the frame starts at column src_x
+        ImageFrame* frame = frames.acquire(file_index, uint32_t(w) * p.height);
+        if (frame == nullptr) {
+            return fail("out of memory");
+        }
+        setFrame(frame, ImageFrame::indexed, 8, p);
+        frame->stride = w;
+
+        uint8_t paletteBuffer[256 * 2];
+        const uint8_t* paletteData = reader.next(paletteBuffer, paletteSize * 2);
+        if (paletteData == nullptr) {
+            return fail("truncated or corrupt file");
+        }
+        for (uint16_t i = 0; i < 256; i++) {
+            frame->palette[i] = (i < paletteSize) ? ImageReader::le16(paletteData + i * 2) : 0;
+        }
+
+        for (int16_t row = -p.src_y; row < p.height; row++) {
+            if (reader.read(rowSize, 2) != 2) return fail("truncated or corrupt file");
+            uint16_t len = ImageReader::le16(rowSize);
+            const uint8_t* src = (len <= maxRowSize) ? reader.next(rowBuffer, len) : nullptr;
+            if (src == nullptr) return fail("truncated or corrupt file");
+            if (row < 0) continue;
+            if (!RowKernels::unpackRow<uint8_t>(src, len, frame->data() + row * w, w)) {
+                return fail("truncated or corrupt file");
+            }
+        }
+        return true;
+    }
+
+    ImageFrame* frame = acquireRgbFrame(file_index, p);
+    if (frame == nullptr) {
+        return fail("out of memory");
+    }
+    uint16_t* pixels = (uint16_t*)frame->data();
+
+    // Images wider than the display are unpacked into a line buffer and cropped.
+    bool cropped = (p.width != w);
+    uint16_t lineBuffer[cropped ? w : 1];
+
+    for (int16_t row = -p.src_y; row < p.height; row++) {
+        if (reader.read(rowSize, 2) != 2) return fail("truncated or corrupt file");
+        uint16_t len = ImageReader::le16(rowSize);
+        const uint8_t* src = (len <= maxRowSize) ? reader.next(rowBuffer, len) : nullptr;
+        if (src == nullptr) return fail("truncated or corrupt file");
+        if (row < 0) continue;
+        uint16_t* dst = pixels + row * p.width;
+        if (!RowKernels::unpackRow<uint16_t>(src, len, cropped ? lineBuffer : dst, w)) {
+            return fail("truncated or corrupt file");
+        }
+        if (cropped) {
+            memcpy(dst, lineBuffer + p.src_x, p.width * sizeof(uint16_t));
+        }
+    }
+    return true;
+}
+
+// Glyph sprite of a layered face: the position on the background, then a CLK v2 image placed there.
+bool ImageDecoder::decodeSprite(ImageReader &reader, uint16_t file_index) {
+    uint8_t header[12];
+    if (reader.read(header, sizeof(header)) != sizeof(header)) {
+        return fail("truncated or corrupt file");
+    }
+    SpriteHeader position;
+    position.x = ImageReader::le16(header + 2);
+    position.y = ImageReader::le16(header + 4);
+    position.background_w = ImageReader::le16(header + 6);
+    position.background_h = ImageReader::le16(header + 8);
+    if (header[0] != SPRITE_VERSION || header[10] != 'C' || header[11] != '2' ||
+        position.background_w <= 0 || position.background_h <= 0 ||
+        position.background_w > MAX_IMAGE_SIZE || position.background_h > MAX_IMAGE_SIZE ||
+        position.x < 0 || position.y < 0 || position.x >= position.background_w || position.y >= position.background_h) {
+        return fail("Invalid sprite");
+    }
+    sprite = &position;
+    bool decoded = decodeClk2(reader, file_index);
+    sprite = nullptr;
+    return decoded;
+}
+
+bool ImageDecoder::decodeBmp(ImageReader &reader, uint16_t file_index) {
+    // The rest of the file header and the info header are read in one go. header[0] is file offset 2.
+    uint8_t headerBuffer[52];
+    const uint8_t* header = reader.next(headerBuffer, sizeof(headerBuffer));
+    if (header == nullptr) {
+        return fail("truncated or corrupt file");
+    }
+    uint32_t seekOffset = ImageReader::le32(header + 8);  // start of bitmap
+    uint32_t headerSize = ImageReader::le32(header + 12);
+    int32_t w = (int32_t)ImageReader::le32(header + 16);
+    int32_t h = (int32_t)ImageReader::le32(header + 20);
+    uint16_t bitDepth = ImageReader::le16(header + 26);
+    uint32_t compression = ImageReader::le32(header + 28);
+    uint32_t paletteSize = ImageReader::le32(header + 44);
+
+    // Negative height means rows are stored top-down
+    bool topDown = (h < 0);
+    if (topDown) h = -h;
+
+    if (compression != 0 || (bitDepth != 24 && bitDepth != 1 && bitDepth != 4 && bitDepth != 8) ||
+        w <= 0 || h <= 0 || w > MAX_IMAGE_SIZE || h > MAX_IMAGE_SIZE) {
+        return fail("BMP format not recognized.");
+    }
+
+    // Visible part of the image and where it goes on the display
+    Placement p = placeImage(w, h);
+    uint32_t lineSize = ((bitDepth * w + 31) >> 5) * 4;
+
+    if (bitDepth <= 8) {
+        // Paletted image: keep the pixel indices at their native bit depth, expanded when pushed.
+        if (paletteSize == 0 || paletteSize > (1u << bitDepth)) paletteSize = 1 << bitDepth;
+        uint8_t paletteBuffer[256 * 4];
+        reader.seek(14 + headerSize);
+        const uint8_t* paletteData = reader.next(paletteBuffer, paletteSize * 4);
+        if (paletteData == nullptr) {
+            return fail("truncated or corrupt file");
+        }
+
+        // Memory mapped pixels are used in place, the cache entry then only holds the header and palette.
+        reader.seek(seekOffset);
+        const uint8_t* mapped = reader.map(lineSize * h);
+
+        // Rows are kept whole, the frame starts at column src_x
+        uint16_t stride = ImageFrame::strideFor(w, bitDepth);
+        ImageFrame* frame = frames.acquire(file_index, (mapped != nullptr) ? 0 : uint32_t(stride) * p.height);
+        if (frame == nullptr) {
+            return fail("out of memory");
+        }
+        setFrame(frame, ImageFrame::indexed, bitDepth, p);
+
+        // Palette is converted to RGB565 once; dimming is applied to it at push time.
+        for (uint16_t i = 0; i < 256; i++) {
+            uint32_t c = (i < paletteSize) ? ImageReader::le32(paletteData + i * 4) : 0;
+            frame->palette[i] = ((c >> 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 3) & 0x001F);
+        }
+
+        if (mapped != nullptr) {
+            // First visible row
+            frame->pixels = topDown ? mapped + p.src_y * lineSize : mapped + (h - 1 - p.src_y) * lineSize;
+            frame->stride = topDown ? lineSize : -lineSize;
+            return true;
+        }
+
+        // Visible rows are stored top-down in RAM
+        frame->stride = stride;
+        uint8_t lineBuffer[lineSize];
+        for (int16_t i = 0; i < h; i++) {
+            const uint8_t* line = reader.next(lineBuffer, lineSize);
+            if (line == nullptr) {
+                return fail("truncated or corrupt file");
+            }
+            int16_t row = (topDown ? i : h - 1 - i) - p.src_y;
+            if (row >= 0 && row < p.height) {
+                memcpy(frame->data() + row * stride, line, stride);
+            }
+        }
+    }
+    else {
+        ImageFrame* frame = acquireRgbFrame(file_index, p);
+        if (frame == nullptr) {
+            return fail("out of memory");
+        }
+
+        reader.seek(seekOffset);
+        if (!copyRows(bgr24, reader, frame, p, w, h, lineSize, !topDown)) {
+            return fail("truncated or corrupt file");
+        }
+    }
+    return true;
+}
@@ -0,0 +1,100 @@
+#ifndef IMAGE_DECODER_H
+#define IMAGE_DECODER_H
+
+#include <stdint.h>
+#include <string.h>
+#include "ImageFrame.h"
+#include "ImageReader.h"
+
+// Sanity limit for image width and height
+#ifndef MAX_IMAGE_SIZE
+  #define MAX_IMAGE_SIZE        (512)
+#endif
+
+// CLK v2 files (see Prepare_images/clktool.cpp). Loaded from .clk files like v1, told apart by the magic number.
+#define CLK2_VERSION            (2)
+#define CLK2_FORMAT_RGB565      (0)   // RLE compressed RGB565 pixels
+#define CLK2_FORMAT_IDX8        (1)   // RLE compressed 8 bit palette indices
+
+/*
+ * Layered faces store one background image per face and a tightly cropped glyph sprite per digit
+ * (`clktool layer`, see Prepare_images/clktool.cpp). The background is an ordinary image named after the
+ * face ("/1bg.clk" for face 1, see FaceCatalog.h). A glyph is a CLK v2 file behind a small header that says
+ * where it goes on the background:
+ *   char     magic[2]  "CS"
+ *   uint8_t  version   1
+ *   uint8_t  reserved
+ *   uint16_t x, y      top left corner of the glyph on the background
+ *   uint16_t width, height of the background
+ *   a CLK v2 file, "C2" included
+ * Glyphs decode into frames marked as sprites, placed where they are on the background after it is anchored.
+ */
+#define SPRITE_VERSION          (1)
+
+/*
+ * Decodes BMP (24 bit, 1/4/8 bit paletted), CLK, CLK v2 images and glyph sprites into frames for a display
+ * of the given size. The format is picked from the magic number.
+ * Only the part of the image that is visible on the display is kept, see setAnchor().
+ *
+ * Doesn't depend on Arduino or the display driver, so the same code can be benchmarked on a
+ * development machine (Prepare_images/image_bench.cpp).
+ */
+class ImageDecoder {
+public:
+  // Where an image that doesn't match the display size goes, per axis
+  enum anchor_t : uint8_t { anchor_start, anchor_center, anchor_end };
+
+  enum format_t : uint8_t { format_bmp, format_clk, format_clk2, format_sprite, format_unknown = 255 };
+  // What the header of an image tells. Sprites have the size of their background.
+  struct Info {
+    format_t format;
+    uint8_t  bits;          // per pixel
+    uint16_t width, height;
+  };
+  // Reads just the header of the image in reader. Returns false if the format is not recognized.
+  static bool probe(ImageReader &reader, Info *info);
+
+  // The part of a w x h image that is visible on the display, and where it goes
+  struct Placement {
+    int16_t src_x, src_y;   // first visible column and row of the image
+    int16_t width, height;  // visible size
+    int16_t x, y;           // top left corner on the display
+  };
+
+  ImageDecoder(FrameAllocator &frames_, int16_t display_width_, int16_t display_height_)
+    : frames(frames_), display_width(display_width_), display_height(display_height_),
+      anchor_x(anchor_center), anchor_y(anchor_center), error("") {}
+
+  // Smaller images are placed at the anchor, larger images are cropped around it.
+  void setAnchor(anchor_t x, anchor_t y) { anchor_x = x; anchor_y = y; }
+  Placement place(int16_t w, int16_t h) const;
+  // Placement of a w x h sprite at x, y on a background_w x background_h image, which is placed like any image
+  Placement placeSprite(int16_t x, int16_t y, int16_t w, int16_t h, int16_t background_w, int16_t background_h) const;
+
+  // Decodes the image in reader into a frame for file_index. On failure, getError() tells why.
+  bool decode(ImageReader &reader, uint16_t file_index);
+  const char* getError() const { return error; }
+
+private:
+  FrameAllocator &frames;
+  int16_t display_width, display_height;
+  anchor_t anchor_x, anchor_y;
+  const char *error;
+
+  // Position of the glyph being decoded on its background, see decodeSprite()
+  struct SpriteHeader {
+    int16_t x, y, background_w, background_h;
+  };
+  const SpriteHeader *sprite = nullptr;
+
+  bool fail(const char *message) { error = message; return false; }
+  Placement placeImage(int16_t w, int16_t h) const;
+  void setFrame(ImageFrame* frame, ImageFrame::format_t format, uint8_t bits, const Placement &p);
+  ImageFrame* acquireRgbFrame(uint16_t file_index, const Placement &p);
+  bool decodeBmp(ImageReader &reader, uint16_t file_index);
+  bool decodeClk(ImageReader &reader, uint16_t file_index);
+  bool decodeClk2(ImageReader &reader, uint16_t file_index);
+  bool decodeSprite(ImageReader &reader, uint16_t file_index);
+};
+
+#endif // IMAGE_DECODER_H
@@ -0,0 +1,54 @@
+#ifndef IMAGE_FRAME_H
+#define IMAGE_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A decoded clock face image as kept in the ImageCache.
+ *
+ * A frame only holds the part of the image that is visible on the display, at x, y.
+ * The border around smaller images is not stored, it is filled in black while pushing.
+ *
+ * rgb565 frames hold width x height pixels.
+ * Indexed frames keep the pixel indices of 1/4/8-bit BMPs at their native bit depth
+ * (MSB first inside a byte) together with an undimmed RGB565 palette. Their rows are kept whole,
+ * so an image cropped on the left starts at pixel src_x of a row.
+ * They are expanded line by line while pushing to the display.
+ *
+ * pixels points to the top row. Usually that is the RAM behind this header, but an indexed image
+ * in a memory mapped face partition is used in place: pixels then points into the flash cache and
+ * stride is negative, because BMP rows are stored bottom-up.
+ *
+ * A sprite is the glyph of a layered face: it only covers its own rectangle and is drawn over the
+ * background image of its face (see ImageDecoder.h).
+ */
+struct ImageFrame {
+  enum format_t : uint8_t { rgb565, indexed };
+
+  format_t format;
+  uint8_t  bits;          // bits per pixel: 16 for rgb565, 1, 4 or 8 for indexed
+  bool     sprite;        // drawn over the background of its face instead of black
+  int16_t  x, y;          // top left corner on the display
+  uint16_t width, height; // visible size
+  uint16_t src_x;         // first visible pixel of a row, indexed only
+  int16_t  stride;        // bytes from one row to the next in pixels[]
+  uint16_t palette[256];  // indexed only
+  const uint8_t *pixels;  // top row
+
+  // The RAM right behind this header, inside the same allocation. Decoders write here.
+  uint8_t* data() { return (uint8_t*)(this + 1); }
+  const uint8_t* row(int16_t y) const { return pixels + int32_t(y) * stride; }
+
+  static uint16_t strideFor(uint16_t width, uint8_t bits) { return (uint32_t(width) * bits + 7) / 8; }
+};
+
+// Hands out frames for the decoders to fill (DecodeWorker::Frames on the clock).
+class FrameAllocator {
+public:
+  virtual ~FrameAllocator() {}
+  // A frame with room for data_bytes behind the header, to decode file_index into. nullptr if out of memory.
+  virtual ImageFrame* acquire(uint16_t file_index, size_t data_bytes) = 0;
+};
+
+#endif // IMAGE_FRAME_H
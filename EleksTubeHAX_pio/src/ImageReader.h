@@ -0,0 +1,59 @@
+#ifndef IMAGE_READER_H
+#define IMAGE_READER_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Sequential access to an image file for the decoders, either through the file system
+ * (ImageFile, see ImageStorage.h) or straight from memory mapped flash.
+ *
+ * map() hands out a pointer to the next len bytes when the data is memory mapped, so decoders
+ * can walk the pixels in place. Such pointers stay valid as long as the mapping (for the face
+ * partition: forever), so frames may keep them. map() returns nullptr for files; read() into a buffer then.
+ */
+class ImageReader {
+public:
+  virtual ~ImageReader() {}
+  virtual size_t read(uint8_t *buffer, size_t len) = 0;
+  virtual bool seek(uint32_t pos) = 0;
+  virtual const uint8_t* map(size_t /* len */) { return nullptr; }
+
+  // Pointer to the next len bytes: mapped if possible, otherwise read into buffer. nullptr on a short read.
+  const uint8_t* next(uint8_t *buffer, size_t len) {
+    const uint8_t *p = map(len);
+    if (p != nullptr) return p;
+    return (read(buffer, len) == len) ? buffer : nullptr;
+  }
+
+  // Image files are little-endian
+  static uint16_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+  static uint32_t le32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24); }
+};
+
+class MemoryImageReader : public ImageReader {
+public:
+  MemoryImageReader(const uint8_t *data_, uint32_t size_) : data(data_), size(size_), pos(0) {}
+  size_t read(uint8_t *buffer, size_t len) override {
+    const uint8_t *p = map(len);
+    if (p == nullptr) return 0;
+    memcpy(buffer, p, len);
+    return len;
+  }
+  bool seek(uint32_t pos_) override {
+    if (pos_ > size) return false;
+    pos = pos_;
+    return true;
+  }
+  const uint8_t* map(size_t len) override {
+    if (pos + len > size) return nullptr;
+    const uint8_t *p = data + pos;
+    pos += len;
+    return p;
+  }
+private:
+  const uint8_t *data;
+  uint32_t size, pos;
+};
+
+#endif // IMAGE_READER_H
@@ -0,0 +1,125 @@
+#include "ImageStorage.h"
+
+#ifdef ARDUINO
+#include "SPIFFS.h"
+#include "LittleFS.h"
+
+bool ImageFile::isOpen() const                      { return (bool)file; }
+void ImageFile::close()                             { if (file) file.close(); }
+uint32_t ImageFile::size()                          { return file.size(); }
+size_t ImageFile::read(uint8_t *buffer, size_t len) { return file.read(buffer, len); }
+bool ImageFile::seek(uint32_t pos)                  { return file.seek(base + pos); }
+
+fs::FS& FsImageStorage::fs() {
+  if (type == littlefs) return LittleFS;
+  return SPIFFS;
+}
+
+bool FsImageStorage::begin() {
+  if (type == littlefs) return LittleFS.begin();
+  return SPIFFS.begin();
+}
+
+bool FsImageStorage::exists(const char *path) {
+  fs::File f = fs().open(path, "r");
+  bool Exists = ((f == true) && !f.isDirectory());
+  f.close();
+  return Exists;
+}
+
+bool FsImageStorage::open(const char *path, ImageFile &file) {
+  file.close();
+  file.base = 0;
+  file.file = fs().open(path, "r");
+  if (file.file && file.file.isDirectory()) file.file.close();
+  return file.isOpen();
+}
+
+bool FsImageStorage::list(ListFunction found, void *context) {
+  fs::File root = fs().open("/");
+  if (!root || !root.isDirectory()) return false;
+  for (fs::File f = root.openNextFile(); f; f = root.openNextFile()) {
+    if (f.isDirectory()) continue;
+    const char *name = f.name();
+    const char *slash = strrchr(name, '/');  // older cores return the whole path
+    found(context, (slash != nullptr) ? slash + 1 : name, f.size(), uint32_t(f.getLastWrite()));
+  }
+  return true;
+}
+
+size_t FsImageStorage::usedBytes() {
+  if (type == littlefs) return LittleFS.usedBytes();
+  return SPIFFS.usedBytes();
+}
+
+size_t FsImageStorage::totalBytes() {
+  if (type == littlefs) return LittleFS.totalBytes();
+  return SPIFFS.totalBytes();
+}
+
+#else
+#include <sys/stat.h>
+#include <dirent.h>
+
+bool ImageFile::isOpen() const                      { return file != nullptr; }
+void ImageFile::close()                             { if (file != nullptr) fclose(file); file = nullptr; }
+size_t ImageFile::read(uint8_t *buffer, size_t len) { return (file != nullptr) ? fread(buffer, 1, len, file) : 0; }
+bool ImageFile::seek(uint32_t pos)                  { return file != nullptr && fseek(file, long(base + pos), SEEK_SET) == 0; }
+
+uint32_t ImageFile::size() {
+  struct stat st;
+  return (file != nullptr && fstat(fileno(file), &st) == 0) ? st.st_size : 0;
+}
+
+bool PosixImageStorage::begin() {
+  struct stat st;
+  return stat(root, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool PosixImageStorage::exists(const char *path) {
+  char full[512];
+  fullPath(path, full, sizeof(full));
+  struct stat st;
+  return stat(full, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool PosixImageStorage::open(const char *path, ImageFile &file) {
+  file.close();
+  file.base = 0;
+  if (!exists(path)) return false;
+  char full[512];
+  fullPath(path, full, sizeof(full));
+  file.file = fopen(full, "rb");
+  return file.isOpen();
+}
+
+bool PosixImageStorage::list(ListFunction found, void *context) {
+  DIR *dir = opendir(root);
+  if (dir == nullptr) return false;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    char full[512];
+    snprintf(full, sizeof(full), "%s/%s", root, entry->d_name);
+    struct stat st;
+    if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) found(context, entry->d_name, st.st_size, uint32_t(st.st_mtime));
+  }
+  closedir(dir);
+  return true;
+}
+
+// Sum of the file sizes in the (flat) directory, like usedBytes() of SPIFFS
+size_t PosixImageStorage::usedBytes() {
+  size_t used = 0;
+  DIR *dir = opendir(root);
+  if (dir == nullptr) return 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    char full[512];
+    snprintf(full, sizeof(full), "%s/%s", root, entry->d_name);
+    struct stat st;
+    if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) used += st.st_size;
+  }
+  closedir(dir);
+  return used;
+}
+#endif
@@ -0,0 +1,102 @@
+#ifndef IMAGE_STORAGE_H
+#define IMAGE_STORAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ImageReader.h"
+
+#ifdef ARDUINO
+  #define FS_NO_GLOBALS
+  #include <FS.h>
+#endif
+
+/*
+ * The file system holding the clock faces. TFTs only reads files through this interface, so the
+ * same loading code runs on SPIFFS, on LittleFS and, for benchmarks on a development machine,
+ * on a plain directory (PosixImageStorage, see Prepare_images/image_bench.cpp).
+ */
+
+// An open file. It is also the reader for the decoders; setBase() makes positions relative to
+// an image inside a larger file (face packs).
+class ImageFile : public ImageReader {
+public:
+  ImageFile() : base(0) {}
+  ~ImageFile() { close(); }
+  ImageFile(const ImageFile&) = delete;
+  ImageFile& operator=(const ImageFile&) = delete;
+
+  bool isOpen() const;
+  void close();
+  uint32_t size();
+  void setBase(uint32_t base_) { base = base_; }
+
+  size_t read(uint8_t *buffer, size_t len) override;
+  bool seek(uint32_t pos) override;
+
+private:
+  friend class FsImageStorage;
+  friend class PosixImageStorage;
+#ifdef ARDUINO
+  fs::File file;
+#else
+  FILE *file = nullptr;
+#endif
+  uint32_t base;
+};
+
+class ImageStorage {
+public:
+  virtual ~ImageStorage() {}
+  virtual bool begin() = 0;
+  virtual const char* getName() const = 0;
+  // True if path is a file (not a directory). Paths start with "/".
+  virtual bool exists(const char *path) = 0;
+  virtual bool open(const char *path, ImageFile &file) = 0;
+  // Calls found for every file in the root directory, with its name without the "/", its size and the time it
+  // was last written (0 if the file system doesn't keep it). False if the directory can't be read.
+  typedef void (*ListFunction)(void *context, const char *name, uint32_t size, uint32_t mtime);
+  virtual bool list(ListFunction found, void *context) = 0;
+  virtual size_t usedBytes() = 0;
+  virtual size_t totalBytes() = 0;
+};
+
+#ifdef ARDUINO
+// SPIFFS or LittleFS, both on the partition labelled "spiffs".
+class FsImageStorage : public ImageStorage {
+public:
+  enum type_t { spiffs, littlefs };
+  FsImageStorage(type_t type_) : type(type_) {}
+
+  bool begin() override;
+  const char* getName() const override { return (type == littlefs) ? "LittleFS" : "SPIFFS"; }
+  bool exists(const char *path) override;
+  bool open(const char *path, ImageFile &file) override;
+  bool list(ListFunction found, void *context) override;
+  size_t usedBytes() override;
+  size_t totalBytes() override;
+
+private:
+  type_t type;
+  fs::FS& fs();
+};
+#else
+// A directory on the host: "/10.bmp" is root/10.bmp.
+class PosixImageStorage : public ImageStorage {
+public:
+  PosixImageStorage(const char *root_) : root(root_) {}
+
+  bool begin() override;
+  const char* getName() const override { return "directory"; }
+  bool exists(const char *path) override;
+  bool open(const char *path, ImageFile &file) override;
+  bool list(ListFunction found, void *context) override;
+  size_t usedBytes() override;
+  size_t totalBytes() override { return 0; }
+
+private:
+  const char *root;
+  void fullPath(const char *path, char *buffer, size_t size) { snprintf(buffer, size, "%s%s", root, path); }
+};
+#endif
+
+#endif // IMAGE_STORAGE_H
@@ -0,0 +1,61 @@
+#include "Overlay.h"
+
+bool Overlay::set(TFT_eSPI *tft, const char *text_, uint16_t color_, uint8_t font_) {
+  if (text_ == nullptr || text_[0] == 0) return clear();
+  if (isActive() && color == color_ && font == font_ && strncmp(text, text_, sizeof(text)) == 0) return false;
+
+  int16_t height = tft->fontHeight(font_) + 1;
+  if (sprite != nullptr && (font != font_ || sprite->height() != height)) {
+    sprite->deleteSprite();
+  }
+  if (sprite == nullptr) {
+    sprite = new TFT_eSprite(tft);
+    sprite->setColorDepth(16);
+  }
+  if (!sprite->created() && sprite->createSprite(TFT_WIDTH, height) == nullptr) {
+    Serial.println("Overlay: not enough memory for the text sprite");
+    pixels = nullptr;
+    return false;
+  }
+
+  strncpy(text, text_, sizeof(text) - 1);
+  text[sizeof(text) - 1] = 0;
+  color = color_;
+  font = font_;
+
+  sprite->fillSprite(TFT_BLACK);
+  sprite->setTextColor(color, TFT_BLACK);
+  sprite->drawString(text, 5, 0, font);
+  pixels = (const uint16_t*)sprite->getPointer();
+  area = { 0, uint8_t(TFT_HEIGHT - height), TFT_WIDTH, uint8_t(height) };
+
+#ifdef DEBUG_OUTPUT
+  Serial.print("Overlay: ");
+  Serial.println(text);
+#endif
+  return true;
+}
+
+bool Overlay::clear() {
+  if (!isActive()) return false;
+  pixels = nullptr;
+  text[0] = 0;
+  // Keep the sprite, status texts come back.
+  return true;
+}
+
+void Overlay::compose(int16_t line, int16_t x, int16_t w, const DimLut *lut, uint16_t *dst) const {
+  if (!isActive() || line < area.y || line >= area.y + area.h) return;
+  int16_t from = max(x, int16_t(area.x));
+  int16_t to = min(int16_t(x + w), int16_t(area.x + area.w));
+  if (from >= to) return;
+
+  const uint16_t *src = pixels + (line - area.y) * area.w + (from - area.x);
+  dst += from - x;
+  if (lut == nullptr) {
+    memcpy(dst, src, (to - from) * sizeof(uint16_t));
+  }
+  else {
+    for (int16_t i = 0; i < to - from; i++) dst[i] = lut->apply(RowKernels::swap16(src[i]));
+  }
+}
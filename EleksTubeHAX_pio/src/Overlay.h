@@ -0,0 +1,50 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include "GLOBAL_DEFINES.h"
+#include <TFT_eSPI.h>
+#include "DirtyRects.h"
+#include "RowKernels.h"
+
+#ifndef OVERLAY_TEXT_LENGTH
+  #define OVERLAY_TEXT_LENGTH (24)
+#endif
+
+/*
+ * A line of status text at the bottom of a display (temperature, "NO MQTT !"), on a band of background color.
+ *
+ * The text is rendered once into a sprite when it changes. While the digit image is pushed, compose()
+ * copies the band over the lines going out, so image and text reach the display in one transfer.
+ * Setting the same text again costs nothing.
+ */
+class Overlay {
+public:
+  Overlay() : sprite(nullptr), pixels(nullptr), color(0), font(0) { text[0] = 0; area = { 0, 0, 0, 0 }; }
+
+  // Renders text in font and color. Returns false if the overlay already shows exactly that.
+  bool set(TFT_eSPI *tft, const char *text_, uint16_t color_, uint8_t font_);
+  // Removes the text. Returns false if there was none.
+  bool clear();
+  bool isActive() const { return pixels != nullptr; }
+  // Both show the same pixels (or nothing)
+  bool sameAs(const Overlay &other) const {
+    if (!isActive() || !other.isActive()) return isActive() == other.isActive();
+    return color == other.color && font == other.font && strcmp(text, other.text) == 0;
+  }
+  // The band covered on the display; kept after clear(), for redrawing what was under the text
+  const DirtyRects::Rect& getArea() const { return area; }
+
+  // Copies the band's pixels of display line `line`, columns x..x+w-1, over dst (in the byte order of the SPI bus).
+  // lut dims them like the image, nullptr when undimmed.
+  void compose(int16_t line, int16_t x, int16_t w, const DimLut *lut, uint16_t *dst) const;
+
+private:
+  TFT_eSprite *sprite;
+  const uint16_t *pixels;   // the sprite's buffer: band width x height, byte-swapped like the SPI bus
+  char text[OVERLAY_TEXT_LENGTH];
+  uint16_t color;
+  uint8_t font;
+  DirtyRects::Rect area;
+};
+
+#endif // OVERLAY_H
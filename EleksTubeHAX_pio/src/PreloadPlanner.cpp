@@ -0,0 +1,65 @@
+#include "PreloadPlanner.h"
+#include <Arduino.h>
+
+// millis() wraps around, so deadlines are compared by their difference
+static bool before(uint32_t a, uint32_t b) { return int32_t(a - b) < 0; }
+
+void PreloadPlanner::add(uint16_t file_index, uint32_t deadline) {
+  int8_t queued = find(file_index);
+  if (queued >= 0) {
+    if (!before(deadline, jobs[queued].deadline)) return;
+    remove(queued);
+  }
+
+  // Insert behind all jobs due at the same time or earlier
+  uint8_t i = count;
+  while (i > 0 && before(deadline, jobs[i - 1].deadline)) i--;
+  if (i >= max_jobs) return;
+  if (count == max_jobs) count--;  // the latest job makes room
+  for (uint8_t j = count; j > i; j--) jobs[j] = jobs[j - 1];
+  jobs[i].file_index = file_index;
+  jobs[i].deadline = deadline;
+  count++;
+}
+
+void PreloadPlanner::settle(uint16_t file_index, bool was_loaded) {
+  int8_t i = find(file_index);
+  if (i < 0) return;
+  if (was_loaded) met++;
+  else missed++;
+  remove(i);
+}
+
+void PreloadPlanner::expire(uint32_t now, uint32_t grace_ms) {
+  while (count > 0 && before(jobs[0].deadline + grace_ms, now)) {
+    remove(0);
+  }
+}
+
+int8_t PreloadPlanner::find(uint16_t file_index) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (jobs[i].file_index == file_index) return i;
+  }
+  return -1;
+}
+
+void PreloadPlanner::remove(uint8_t i) {
+  count--;
+  for (; i < count; i++) jobs[i] = jobs[i + 1];
+}
+
+void PreloadPlanner::printStats() {
+  uint32_t total = met + missed;
+  Serial.print("Preload deadlines met/missed: ");
+  Serial.print(met);
+  Serial.print("/");
+  Serial.print(missed);
+  if (total > 0) {
+    Serial.print(" (");
+    Serial.print((met * 100) / total);
+    Serial.print("% met)");
+  }
+  Serial.print(", ");
+  Serial.print(count);
+  Serial.println(" queued");
+}
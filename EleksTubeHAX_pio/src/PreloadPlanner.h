@@ -0,0 +1,52 @@
+#ifndef PRELOAD_PLANNER_H
+#define PRELOAD_PLANNER_H
+
+#include <stdint.h>
+
+/*
+ * Queue of images the displays will need soon, ordered by the time they are needed (millis()).
+ * Filled once per clock tick with the upcoming digit changes (Clock::getNextChanges()),
+ * worked off by TFTs::LoadNextImage() in the idle part of loop().
+ *
+ * A deadline is met if the image was already decoded when its digit was drawn, missed if it
+ * had to be decoded while the display was waiting. Jobs whose digit was never drawn (face changed,
+ * displays off) are dropped without counting.
+ */
+class PreloadPlanner {
+public:
+  PreloadPlanner() : count(0), met(0), missed(0) {}
+
+  const static uint8_t max_jobs = 16;
+
+  struct Job {
+    uint16_t file_index;
+    uint32_t deadline;    // millis() when the image is drawn
+  };
+
+  // Queues file_index for the given deadline. A file already queued keeps the earlier deadline,
+  // jobs with the same deadline stay in the order they were added.
+  void add(uint16_t file_index, uint32_t deadline);
+  void clear()                          { count = 0; }
+  uint8_t getCount() const              { return count; }
+  const Job& getJob(uint8_t i) const    { return jobs[i]; }
+
+  // Called when file_index is drawn. Counts a met or missed deadline if it was queued.
+  void settle(uint16_t file_index, bool was_loaded);
+  // Drops jobs more than grace_ms past their deadline.
+  void expire(uint32_t now, uint32_t grace_ms);
+
+  uint32_t getMet() const               { return met; }
+  uint32_t getMissed() const            { return missed; }
+  void resetStats()                     { met = 0; missed = 0; }
+  void printStats();
+
+private:
+  Job jobs[max_jobs];
+  uint8_t count;
+  uint32_t met, missed;
+
+  int8_t find(uint16_t file_index);
+  void remove(uint8_t i);
+};
+
+#endif // PRELOAD_PLANNER_H
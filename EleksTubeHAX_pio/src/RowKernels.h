@@ -0,0 +1,256 @@
+#ifndef ROW_KERNELS_H
+#define ROW_KERNELS_H
+
+#include <stdint.h>
+#include <string.h>
+#include "ImageFrame.h"
+
+/*
+ * The pixel loops of decoding and pushing images, specialized at compile time.
+ *
+ * Every combination of pixel format / bit depth, dimmed or not, and clipped or not is its own
+ * function without branches in the inner loop. The right one is picked once per image (decoding)
+ * or once per pushed rectangle (selectLineKernel()), instead of deciding for every pixel.
+ * Clipping is worked out once per line: black margins are filled, only the covered span is converted.
+ *
+ * composeSprite() draws the glyph of a layered face over its background line.
+ *
+ * blendLine() mixes two pushed lines for digit transitions, two pixels per 32 bit operation.
+ *
+ * referenceLine() and referenceBlend() are the plain per-pixel versions, kept to benchmark and check
+ * the kernels (TFTs::benchmarkImageStores(), Prepare_images/image_bench.cpp).
+ */
+
+// RGB565 channel lookup tables for one dimming level, already shifted into place and byte-swapped for the SPI bus
+struct DimLut {
+  uint16_t red[32], green[64], blue[32];
+  uint16_t apply(uint16_t c) const { return red[c >> 11] | green[(c >> 5) & 0x3F] | blue[c & 0x1F]; }
+};
+
+// Writes columns x..x+w-1 of display line `line` of a frame to dst, in the byte order of the SPI bus.
+// palette: the frame's palette, dimmed and byte-swapped (indexed frames); lut: dimming (RGB565 frames).
+typedef void (*LineKernel)(const ImageFrame *frame, int16_t line, int16_t x, int16_t w,
+                           const uint16_t *palette, const DimLut &lut, uint16_t *dst);
+
+namespace RowKernels {
+
+inline uint16_t swap16(uint16_t c) { return (c >> 8) | (c << 8); }
+
+// Pixel sx of a row of 1, 4 or 8 bit indices, MSB first
+template <uint8_t BITS> inline uint8_t indexAt(const uint8_t *row, int16_t sx);
+template <> inline uint8_t indexAt<8>(const uint8_t *row, int16_t sx) { return row[sx]; }
+template <> inline uint8_t indexAt<4>(const uint8_t *row, int16_t sx) { return (row[sx >> 1] >> ((sx & 0x01) ? 0 : 4)) & 0x0F; }
+template <> inline uint8_t indexAt<1>(const uint8_t *row, int16_t sx) { return (row[sx >> 3] >> (7 - (sx & 0x07))) & 0x01; }
+
+// count pixels of an indexed row, starting at pixel sx, through the palette
+template <uint8_t BITS>
+inline void expandIndexed(const uint8_t *row, int16_t sx, int16_t count, const uint16_t *palette, uint16_t *dst) {
+  const uint8_t *src = row + sx;
+  for (int16_t i = 0; i < count; i++) dst[i] = palette[src[i]];
+}
+
+// Two pixels per byte
+template <>
+inline void expandIndexed<4>(const uint8_t *row, int16_t sx, int16_t count, const uint16_t *palette, uint16_t *dst) {
+  if (count > 0 && (sx & 0x01)) {
+    *dst++ = palette[row[sx >> 1] & 0x0F];
+    sx++;
+    count--;
+  }
+  const uint8_t *src = row + (sx >> 1);
+  for (; count >= 2; count -= 2) {
+    uint8_t b = *src++;
+    *dst++ = palette[b >> 4];
+    *dst++ = palette[b & 0x0F];
+  }
+  if (count > 0) *dst = palette[*src >> 4];
+}
+
+// Eight pixels per byte, only two colors
+template <>
+inline void expandIndexed<1>(const uint8_t *row, int16_t sx, int16_t count, const uint16_t *palette, uint16_t *dst) {
+  for (; count > 0 && (sx & 0x07); sx++, count--) {
+    *dst++ = palette[indexAt<1>(row, sx)];
+  }
+  const uint16_t c0 = palette[0], c1 = palette[1];
+  const uint8_t *src = row + (sx >> 3);
+  for (; count >= 8; count -= 8) {
+    uint8_t b = *src++;
+    for (int8_t bit = 7; bit >= 0; bit--) *dst++ = ((b >> bit) & 0x01) ? c1 : c0;
+  }
+  for (int16_t i = 0; i < count; i++) *dst++ = ((*src >> (7 - i)) & 0x01) ? c1 : c0;
+}
+
+// RGB565 pixels to the byte order of the SPI bus, through the dimming table or just swapped
+template <bool DIMMED>
+inline void convertRgb565(const uint16_t *src, int16_t count, const DimLut &lut, uint16_t *dst) {
+  for (int16_t i = 0; i < count; i++) dst[i] = DIMMED ? lut.apply(src[i]) : swap16(src[i]);
+}
+
+// 24 bit BMP pixels (B, G, R) to RGB565
+inline void bgr24ToRgb565(const uint8_t *src, int16_t count, uint16_t *dst) {
+  for (int16_t i = 0; i < count; i++, src += 3) {
+    dst[i] = ((src[2] & 0xF8) << 8) | ((src[1] & 0xFC) << 3) | (src[0] >> 3);
+  }
+}
+
+// Expands one row of CLK v2 packets into count pixels. A control byte c < 128 is followed by c+1 literal pixels,
+// c >= 128 by one pixel repeated c-126 times. Returns false on malformed data.
+template <typename T>
+inline bool unpackRow(const uint8_t *src, uint16_t len, T *dst, uint16_t count) {
+  const uint8_t *end = src + len;
+  while (count > 0) {
+    if (src >= end) return false;
+    uint8_t c = *src++;
+    uint16_t run = (c < 128) ? c + 1 : c - 126;
+    if (run > count) return false;
+    if (c < 128) {
+      if (src + run * sizeof(T) > end) return false;
+      memcpy(dst, src, run * sizeof(T));  // little-endian, like the ESP32
+      src += run * sizeof(T);
+    }
+    else {
+      if (src + sizeof(T) > end) return false;
+      T value;
+      memcpy(&value, src, sizeof(T));
+      src += sizeof(T);
+      for (uint16_t i = 0; i < run; i++) dst[i] = value;
+    }
+    dst += run;
+    count -= run;
+  }
+  return true;
+}
+
+// See LineKernel. Without CLIPPED, the image must cover all of the line.
+// Indexed frames don't need DIMMED: their palette is dimmed once per push.
+template <ImageFrame::format_t FORMAT, uint8_t BITS, bool DIMMED, bool CLIPPED>
+void frameLine(const ImageFrame *frame, int16_t line, int16_t x, int16_t w,
+               const uint16_t *palette, const DimLut &lut, uint16_t *dst) {
+  int16_t row = line - frame->y;
+  int16_t sx = x - frame->x;
+  int16_t left = 0, count = w;
+  if (CLIPPED) {
+    if (row < 0 || row >= frame->height || sx >= int16_t(frame->width) || sx + w <= 0) {
+      memset(dst, 0, w * sizeof(uint16_t));
+      return;
+    }
+    if (sx < 0) left = -sx;
+    int16_t end = (sx + w < int16_t(frame->width)) ? sx + w : frame->width;
+    count = end - (sx + left);
+    memset(dst, 0, left * sizeof(uint16_t));
+    memset(dst + left + count, 0, (w - left - count) * sizeof(uint16_t));
+  }
+  const uint8_t *src = frame->row(row);
+  sx += frame->src_x;
+  if (FORMAT == ImageFrame::indexed) {
+    expandIndexed<BITS>(src, sx + left, count, palette, dst + left);
+  }
+  else {
+    convertRgb565<DIMMED>((const uint16_t*)src + sx + left, count, lut, dst + left);
+  }
+}
+
+// True if the image of frame covers the whole rectangle, so the unclipped kernels can be used
+inline bool covers(const ImageFrame *frame, int16_t x, int16_t y, int16_t w, int16_t h) {
+  return x >= frame->x && y >= frame->y &&
+         x + w <= frame->x + int16_t(frame->width) && y + h <= frame->y + int16_t(frame->height);
+}
+
+template <bool CLIPPED>
+inline LineKernel selectLineKernel(const ImageFrame *frame, bool dimmed) {
+  if (frame->format == ImageFrame::indexed) {
+    if (frame->bits == 8) return frameLine<ImageFrame::indexed, 8, false, CLIPPED>;
+    if (frame->bits == 4) return frameLine<ImageFrame::indexed, 4, false, CLIPPED>;
+    return frameLine<ImageFrame::indexed, 1, false, CLIPPED>;
+  }
+  if (dimmed) return frameLine<ImageFrame::rgb565, 16, true, CLIPPED>;
+  return frameLine<ImageFrame::rgb565, 16, false, CLIPPED>;
+}
+
+// The kernel for pushing the rectangle x, y, w, h of frame
+inline LineKernel selectLineKernel(const ImageFrame *frame, bool dimmed, int16_t x, int16_t y, int16_t w, int16_t h) {
+  if (covers(frame, x, y, w, h)) return selectLineKernel<false>(frame, dimmed);
+  return selectLineKernel<true>(frame, dimmed);
+}
+
+// Draws the part of a sprite on display line `line` over dst, which holds columns x..x+w-1 of it.
+// Only the span the sprite covers is written, the rest of dst (the background) is left alone.
+inline void composeSprite(const ImageFrame *sprite, int16_t line, int16_t x, int16_t w,
+                          const uint16_t *palette, const DimLut &lut, bool dimmed, uint16_t *dst) {
+  if (line < sprite->y || line >= sprite->y + int16_t(sprite->height)) return;
+  int16_t first = (x > sprite->x) ? x : sprite->x;
+  int16_t end = (x + w < sprite->x + int16_t(sprite->width)) ? x + w : sprite->x + sprite->width;
+  if (first >= end) return;
+  LineKernel kernel = selectLineKernel<false>(sprite, dimmed);
+  kernel(sprite, line, first, end - first, palette, lut, dst + (first - x));
+}
+
+// Blends two words of two pixels each (byte order of the SPI bus): alpha 0 gives a, 32 gives b.
+// In RGB565 (after swapping the bytes back) the fields of both pixels are split over two words so
+// that every field has 5 free bits above it; then one multiplication scales three fields at once.
+inline uint32_t blend2(uint32_t a, uint32_t b, uint32_t alpha) {
+  a = __builtin_bswap32(a);   // both pixels to RGB565; their order in the word doesn't matter
+  b = __builtin_bswap32(b);
+  const uint32_t mask1 = 0x07C0F83F, mask2 = 0x07E0F81F;
+  uint32_t a1 = (a >> 5) & mask1, a2 = a & mask2;
+  uint32_t b1 = (b >> 5) & mask1, b2 = b & mask2;
+  uint32_t r1 = ((a1 * (32 - alpha) + b1 * alpha) >> 5) & mask1;
+  uint32_t r2 = ((a2 * (32 - alpha) + b2 * alpha) >> 5) & mask2;
+  return __builtin_bswap32((r1 << 5) | r2);
+}
+
+// count pixels of a and b blended into dst (which may be b), alpha 0..32.
+// a, b and dst must be equally aligned: the pairs in between are read and written as 32 bit words.
+inline void blendLine(const uint16_t *a, const uint16_t *b, uint8_t alpha, int16_t count, uint16_t *dst) {
+  if (count > 0 && (uintptr_t(dst) & 0x02)) {
+    *dst++ = blend2(*a++, *b++, alpha);
+    count--;
+  }
+  const uint32_t *a2 = (const uint32_t*)a, *b2 = (const uint32_t*)b;
+  uint32_t *dst2 = (uint32_t*)dst;
+  for (int16_t i = 0; i < count / 2; i++) dst2[i] = blend2(a2[i], b2[i], alpha);
+  if (count & 0x01) dst[count - 1] = blend2(a[count - 1], b[count - 1], alpha);
+}
+
+// Same result as blendLine(), channel by channel.
+inline void referenceBlend(const uint16_t *a, const uint16_t *b, uint8_t alpha, int16_t count, uint16_t *dst) {
+  for (int16_t i = 0; i < count; i++) {
+    uint16_t ca = swap16(a[i]), cb = swap16(b[i]);
+    uint16_t r = ((ca >> 11) * (32 - alpha) + (cb >> 11) * alpha) >> 5;
+    uint16_t g = (((ca >> 5) & 0x3F) * (32 - alpha) + ((cb >> 5) & 0x3F) * alpha) >> 5;
+    uint16_t bl = ((ca & 0x1F) * (32 - alpha) + (cb & 0x1F) * alpha) >> 5;
+    dst[i] = swap16((r << 11) | (g << 5) | bl);
+  }
+}
+
+// Same result as the kernels, deciding everything per pixel.
+inline void referenceLine(const ImageFrame *frame, int16_t line, int16_t x, int16_t w,
+                          const uint16_t *palette, const DimLut &lut, bool dimmed, uint16_t *dst) {
+  int16_t row = line - frame->y;
+  for (int16_t col = 0; col < w; col++) {
+    int16_t sx = x + col - frame->x;
+    if (row < 0 || row >= frame->height || sx < 0 || sx >= frame->width) {
+      dst[col] = 0;
+      continue;
+    }
+    sx += frame->src_x;
+    if (frame->format == ImageFrame::rgb565) {
+      uint16_t c = ((const uint16_t*)frame->row(row))[sx];
+      dst[col] = dimmed ? lut.apply(c) : swap16(c);
+    }
+    else if (frame->bits == 8) {
+      dst[col] = palette[indexAt<8>(frame->row(row), sx)];
+    }
+    else if (frame->bits == 4) {
+      dst[col] = palette[indexAt<4>(frame->row(row), sx)];
+    }
+    else {
+      dst[col] = palette[indexAt<1>(frame->row(row), sx)];
+    }
+  }
+}
+
+} // namespace RowKernels
+
+#endif // ROW_KERNELS_H
@@ -0,0 +1,42 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * Fixed size queue between exactly one producer task and one consumer task, without locks.
+ * The producer only writes head, the consumer only writes tail; an item is complete before
+ * the new head is published (release), and read before the new tail is published.
+ */
+template <typename T, uint8_t SIZE>
+class SpscQueue {
+public:
+  SpscQueue() : head(0), tail(0) {}
+
+  // Producer side. false if the queue is full.
+  bool push(const T &item) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == SIZE) return false;
+    items[h % SIZE] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. false if the queue is empty.
+  bool pop(T &item) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == t) return false;
+    item = items[t % SIZE];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool isEmpty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+private:
+  T items[SIZE];
+  std::atomic<uint32_t> head, tail;
+};
+
+#endif // SPSC_QUEUE_H
@@ -24,6 +24,10 @@ public:
   void save()     { prefs.putBytes(SAVED_CONFIG_NAMESPACE, &config, config_size); }
   bool isLoaded() { return loaded; }
 
+  // Data kept next to the config under its own key, e.g. caches. loadBlob() only reads a blob of exactly size bytes.
+  bool loadBlob(const char *key, void *data, size_t size) { return prefs.getBytesLength(key) == size && prefs.getBytes(key, data, size) == size; }
+  void saveBlob(const char *key, const void *data, size_t size) { prefs.putBytes(key, data, size); }
+
   const static uint8_t str_buffer_size = 32;
 
   struct Config {
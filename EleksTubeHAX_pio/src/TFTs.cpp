@@ -1,33 +1,81 @@
 #include "TFTs.h"
 #include "WiFi_WPS.h"
+#include "esp_heap_caps.h"
+#ifdef SPI_CALIBRATION
+#include "soc/spi_reg.h"
+#endif
+
+#ifdef IMAGE_STORAGE_LITTLEFS
+  #define IMAGE_STORAGE_TYPE FsImageStorage::littlefs
+#else
+  #define IMAGE_STORAGE_TYPE FsImageStorage::spiffs
+#endif
 
-TFTs::TFTs() : TFT_eSPI(), chip_select(), enabled(false), UnpackedImageBuffer(nullptr) {
+TFTs::TFTs() : TFT_eSPI(), chip_select(), enabled(false), image_cache(), decode_frames(image_cache), storage(IMAGE_STORAGE_TYPE), decoder(decode_frames, TFT_WIDTH, TFT_HEIGHT) {
     for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
         digits[digit] = 0;
+        ShownFile[digit] = ImageCache::empty;
+        ShownDimming[digit] = 255;
+        transitions[digit].from = ImageCache::empty;
+    }
+    for (uint8_t i = 0; i < 10; i++) {
+        DiffTable[i].reset();
     }
+    decoder.setAnchor((ImageDecoder::anchor_t)IMAGE_ANCHOR_X, (ImageDecoder::anchor_t)IMAGE_ANCHOR_Y);
+    buildDimmingLut();
 }
 
 TFTs::~TFTs() {
+    waitForPush();
     freeImageBuffer();
+    #ifdef USE_DMA_PUSH
+    heap_caps_free(PushStrips[0]);
+    heap_caps_free(PushStrips[1]);
+    #endif
 }
 
 // Then modify your existing begin() to work with the constructor:
-void TFTs::begin() {
+void TFTs::begin(StoredConfig *stored_config) {
     // Start with all displays selected.
     chip_select.begin();
     chip_select.setAll();
 
     // Turn power on to displays.
     pinMode(TFT_ENABLE_PIN, OUTPUT);
+    #ifdef PANEL_BRIGHTNESS_PWM
+    ledcSetup(PANEL_BRIGHTNESS_PWM_CHANNEL, PANEL_BRIGHTNESS_PWM_FREQ, 8);
+    ledcAttachPin(TFT_ENABLE_PIN, PANEL_BRIGHTNESS_PWM_CHANNEL);
+    #endif
     enableAllDisplays();
     InvalidateImageInBuffer();
 
     // Initialize the super class.
     init();
+    #ifdef PANEL_BRIGHTNESS_DCS
+    applyBrightness(brightness);  // init() reset the controllers
+    #endif
+
+    #ifdef USE_DMA_PUSH
+    // Two strip buffers in DMA capable RAM: one is sent while the other is filled.
+    PushStrips[0] = (uint16_t*)heap_caps_malloc(sizeof(uint16_t) * TFT_WIDTH * PUSH_STRIP_LINES, MALLOC_CAP_DMA);
+    PushStrips[1] = (uint16_t*)heap_caps_malloc(sizeof(uint16_t) * TFT_WIDTH * PUSH_STRIP_LINES, MALLOC_CAP_DMA);
+    dma_ready = (PushStrips[0] != nullptr) && (PushStrips[1] != nullptr) && initDMA();
+    if (!dma_ready) {
+        Serial.println(F("DMA push not available, using blocking transfers"));
+    }
+    #endif
+
+    #ifdef SPI_CALIBRATION
+    setupSpiFrequency(stored_config);
+    #endif
+
+    // Images are read from the memory mapped face partition if there is one
+    use_face_partition = face_partition.begin();
 
-    // Set SPIFFS ready
-    if (!SPIFFS.begin()) {
-        Serial.println("SPIFFS initialization failed!");
+    // Set the file system ready
+    if (!storage.begin()) {
+        Serial.print(storage.getName());
+        Serial.println(" initialization failed!");
         NumberOfClockFaces = 0;
         return;
     }
@@ -37,67 +85,125 @@ void TFTs::begin() {
         Serial.println(F("Warning: Failed to allocate image buffer"));
     }
 
-    NumberOfClockFaces = CountNumberOfClockFaces();
-    loadClockFacesNames();
+    buildFaceCatalog(stored_config);
+
+    #ifdef USE_DECODE_TASK
+    // From here on, the decoder, face pack and storage belong to the decode task. It opens the animations
+    // too; the loop only reads the files they already have open.
+    if (decode_worker.isRunning() || decode_worker.begin(decodeTask, this)) {
+        decode_frames.setStaged(true);
+    }
+    else {
+        Serial.println(F("Decode task not available, decoding on the loop task"));
+    }
+    #endif
 }
 
 void TFTs::reinit() {
+  waitForPush();
+  markAllDirty();
   // Start with all displays selected.
   chip_select.begin();
   chip_select.setAll();
 
   // Turn power on to displays.
   pinMode(TFT_ENABLE_PIN, OUTPUT);
+  #ifdef PANEL_BRIGHTNESS_PWM
+  ledcAttachPin(TFT_ENABLE_PIN, PANEL_BRIGHTNESS_PWM_CHANNEL);
+  #endif
   enableAllDisplays();
 
   // Initialize the super class.
   init();
+  #ifdef PANEL_BRIGHTNESS_DCS
+  applyBrightness(brightness);
+  #endif
+}
+
+void TFTs::enableAllDisplays() {
+  #ifdef PANEL_BRIGHTNESS_PWM
+  ledcWrite(PANEL_BRIGHTNESS_PWM_CHANNEL, brightness);
+  #else
+  digitalWrite(TFT_ENABLE_PIN, HIGH);
+  #endif
+  enabled = true;
+}
+
+void TFTs::disableAllDisplays() {
+  #ifdef PANEL_BRIGHTNESS_PWM
+  ledcWrite(PANEL_BRIGHTNESS_PWM_CHANNEL, 0);
+  #else
+  digitalWrite(TFT_ENABLE_PIN, LOW);
+  #endif
+  enabled = false;
+  markAllDirty();
 }
 
 void TFTs::clear() {
+  waitForPush();
+  markAllDirty();
   // Start with all displays selected.
   chip_select.setAll();
   enableAllDisplays();
 }
 
-void TFTs::loadClockFacesNames() {
-  int8_t i = 0;
-  const char* filename = "/clockfaces.txt";
-  Serial.println("Load clock face's names");
-  fs::File f = SPIFFS.open(filename);
-  if(!f) {
-    Serial.println("SPIFFS clockfaces.txt not found.");
-    return;
+// One listing of the file system (and the face partition) instead of probing for every face.
+// With FACE_CATALOG_CACHE only the listing, as long as the file system stays the same.
+void TFTs::buildFaceCatalog(StoredConfig *stored_config) {
+  uint32_t StartTime = millis();
+  catalog.clear();
+  if (use_face_partition) {
+    for (uint16_t i = 0; i < face_partition.getCount(); i++) {
+      uint16_t file_index = face_partition.getFileIndex(i);
+      const uint8_t* image;
+      uint32_t length;
+      if (face_partition.find(file_index, &image, &length)) catalog.addImage(file_index, image, length);
+    }
+  }
+
+  bool restored = false;
+  #ifdef FACE_CATALOG_CACHE
+  void *block = (stored_config != nullptr) ? malloc(FaceCatalog::getBlockSize()) : nullptr;
+  if (block != nullptr) {
+    restored = stored_config->loadBlob(FACE_CATALOG_KEY, block, FaceCatalog::getBlockSize()) &&
+               catalog.restore(block, FaceCatalog::getBlockSize(), storage);
+    free(block);
+  }
+  #endif
+  if (!restored) {
+    catalog.build(storage);
+    #ifdef FACE_CATALOG_CACHE
+    if (stored_config != nullptr) stored_config->saveBlob(FACE_CATALOG_KEY, catalog.getBlock(), FaceCatalog::getBlockSize());
+    #endif
   }
-  while(f.available() && i<9) {
-      patterns_str[i] = f.readStringUntil('\n');
-      patterns_str[i].replace("\r", "");
-      Serial.println(patterns_str[i]);
-      i++;
+  NumberOfClockFaces = catalog.getCount();
+
+  Serial.print(NumberOfClockFaces);
+  Serial.print(restored ? " clock faces from the saved catalog in (ms): " : " clock faces found in (ms): ");
+  Serial.println(millis() - StartTime);
+  const char* formats[] = { "BMP", "CLK", "CLK v2", "layered" };
+  for (uint8_t face = 1; face <= NumberOfClockFaces; face++) {
+    ImageDecoder::Info info = catalog.getInfo(face);
+    Serial.printf("%u: %s", unsigned(face), catalog.getName(face));
+    if (info.format <= ImageDecoder::format_sprite) {
+      Serial.printf(" (%s, %u bit, %u x %u)", formats[info.format], unsigned(info.bits), unsigned(info.width), unsigned(info.height));
     }
-  f.close();
+    Serial.println();
+  }
 }
 
 
 
 void TFTs::showNoMqttStatus() {
-  chip_select.setSecondsTens();
-  setTextColor(TFT_RED, TFT_BLACK);
-  fillRect(0, TFT_HEIGHT - 27, TFT_WIDTH, 27, TFT_BLACK);
-  setCursor(5, TFT_HEIGHT - 27, 4);
-  print("NO MQTT !");
-  }
+  setOverlay(SECONDS_TENS, "NO MQTT !", TFT_RED, 4);
+}
 
+// Sets the text only; it goes out with the next push of HOURS_ONES.
 void TFTs::showTemperature() { 
   #ifdef ONE_WIRE_BUS_PIN
    if (fTemperature > -30) { // only show if temperature is valid
-      chip_select.setHoursOnes();
-      setTextColor(TFT_CYAN, TFT_BLACK);
-      fillRect(0, TFT_HEIGHT - 17, TFT_WIDTH, 17, TFT_BLACK);
-      setCursor(5, TFT_HEIGHT - 17, 2);  // Font 2. 16 pixel high
-      print("T: ");
-      print(sTemperatureTxt);
-      print(" C");
+      String text = String("T: ") + sTemperatureTxt + " C";
+      overlays[HOURS_ONES].set(this, text.c_str(), TFT_CYAN, 2);  // Font 2. 16 pixel high
    }
 #ifdef DEBUG_OUTPUT
     Serial.println("Temperature to LCD");
@@ -105,17 +211,60 @@ void TFTs::showTemperature() {
   #endif
 }
 
+void TFTs::setOverlay(uint8_t digit, const char *text, uint16_t color, uint8_t font) {
+  if (!overlays[digit].set(this, text, color, font)) return;
+
+  uint16_t file_index = ShownFile[digit];
+  if (file_index == ImageCache::empty || ShownDimming[digit] != dimming || !image_cache.contains(file_index)) {
+    // Blanked, unknown or not cached: redraw all of it.
+    showDigit(digit);
+    return;
+  }
+
+  // Only the text band changes. A cleared overlay keeps its area, the image under it is pushed.
+  DirtyRects band;
+  band.reset();
+  band.valid = true;
+  band.count = 1;
+  band.rects[0] = overlays[digit].getArea();
+
+  waitForPush();
+  chip_select.setDigitMap(0x01 << digit);
+  active_overlay = &overlays[digit];
+  if (!DrawImage(file_index, &band) && draw_deferred) {
+    // The background is still being decoded, the whole display is drawn once it is there.
+    markDirty(digit);
+    draw_pending |= 0x01 << digit;
+  }
+}
+
 void TFTs::setDigit(uint8_t digit, uint8_t value, show_t show) {
   uint8_t old_value = digits[digit];
   digits[digit] = value;
   
   if (show != no && (old_value != value || show == force)) {
+    if (digit == HOURS_ONES) {
+        showTemperature();
+      }
     showDigit(digit);
-  
+  }
+}
 
-    if (digit == HOURS_ONES) {
+// Sets all digits at once, so displays that end up with the same image are updated with a single transfer.
+void TFTs::setDigits(const uint8_t values[NUM_DIGITS], show_t show) {
+  uint8_t map = 0;
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    if (show != no && (digits[digit] != values[digit] || show == force)) {
+      map |= 0x01 << digit;
+    }
+    digits[digit] = values[digit];
+  }
+
+  if (map != 0) {
+    if (map & HOURS_ONES_MAP) {
         showTemperature();
       }
+    showDigits(map);
   }
 }
 
@@ -124,53 +273,680 @@ void TFTs::setDigit(uint8_t digit, uint8_t value, show_t show) {
  */
  
 void TFTs::showDigit(uint8_t digit) {
-  chip_select.setDigit(digit);
+  showDigits(0x01 << digit);
+}
 
-  if (digits[digit] == blanked) {
+/*
+ * Displays the digits in map. Displays that show the same value and would get the same
+ * pixels (full image, or the same dirty rectangles, and the same overlay) are selected together and receive one push.
+ */
+void TFTs::showDigits(uint8_t map) {
+  map = startAnimations(map);
+  map = startTransitions(map);
+  while (map != 0) {
+    uint8_t first = 0;
+    while (!(map & (0x01 << first))) first++;
+
+    uint8_t value = digits[first];
+    uint16_t file_index = (value == blanked) ? ImageCache::empty : current_graphic * 10 + value;
+    const DirtyRects* delta = (value == blanked) ? nullptr : findDelta(first, file_index);
+
+    uint8_t group = 0;
+    for (uint8_t digit = first; digit < NUM_DIGITS; digit++) {
+      if ((map & (0x01 << digit)) && digits[digit] == value && overlays[digit].sameAs(overlays[first]) &&
+          (value == blanked || findDelta(digit, file_index) == delta)) {
+        group |= 0x01 << digit;
+      }
+    }
+    map &= ~group;
+    showDigitGroup(group, file_index, delta);
+  }
+}
+
+void TFTs::showDigitGroup(uint8_t group, uint16_t file_index, const DirtyRects* delta) {
+  // The previous group may still be receiving its image.
+  waitForPush();
+  chip_select.setDigitMap(group);
+
+#ifdef DEBUG_OUTPUT
+  Serial.print("Digit map 0x");
+  Serial.print(group, HEX);
+  Serial.print(delta != nullptr ? ": delta push" : ": full push");
+#endif
+
+  bool drawn = false;
+  draw_pending &= ~group;
+  uint8_t first = 0;
+  while (!(group & (0x01 << first))) first++;
+  active_overlay = &overlays[first];
+  if (file_index == ImageCache::empty) {
+    startPush();
     fillScreen(TFT_BLACK);
+    endWrite();
+    drawOverlay(overlays[first]);
   }
   else {
-    uint8_t file_index = current_graphic * 10 + digits[digit];
-    DrawImage(file_index);
-    
-    uint8_t NextNumber = digits[SECONDS_ONES] + 1;
-    if (NextNumber > 9) NextNumber = 0; // pre-load only seconds, because they are drawn first
-    NextFileRequired = current_graphic * 10 + NextNumber;
+    preloader.settle(file_index, image_cache.contains(file_index));
+    drawn = DrawImage(file_index, delta);
+    // Until the decode task has the image, the displays keep what they show.
+    if (draw_deferred) draw_pending |= group;
+  }
+
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    if (!(group & (0x01 << digit))) continue;
+    transitions[digit].from = ImageCache::empty;
+    stopAnimation(digit);
+    if (drawn) {
+      ShownFile[digit] = file_index;
+      ShownDimming[digit] = dimming;
+    }
+    else {
+      markDirty(digit);
+    }
   }
 }
 
+// Starts a transition on the displays of map that change from one cached image to another of the same
+// clock face. Returns the displays that still have to be drawn directly.
+uint8_t TFTs::startTransitions(uint8_t map) {
+  if (transition == transition_none) return map;
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    if (!(map & (0x01 << digit)) || digits[digit] == blanked) continue;
+    uint16_t to = current_graphic * 10 + digits[digit];
+    // A digit that changes again during its transition continues from the image it was heading to.
+    uint16_t from = (transitions[digit].from != ImageCache::empty) ? transitions[digit].to : ShownFile[digit];
+    if (from == ImageCache::empty || from == to || from / 10 != to / 10 || ShownDimming[digit] != dimming) continue;
+    // Nothing is decoded here: without both images (and the background of a glyph) the digit is drawn directly.
+    if (!image_cache.contains(from) || !image_cache.contains(to)) continue;
+    const ImageFrame* to_frame = image_cache.lookup(to);
+    if (to_frame->sprite && !image_cache.contains(backgroundIndex(to / 10))) continue;
+    preloader.settle(to, true);
+
+    Transition &t = transitions[digit];
+    t.from = from;
+    t.to = to;
+    t.start = t.last_frame = millis();
+    t.frames = 0;
+    markDirty(digit);
+    map &= ~(0x01 << digit);
+  }
+  return map;
+}
+
+// Draws the displays that waited for the decode task, once it has their images or gave up on them.
+void TFTs::loopPendingDigits() {
+#ifdef USE_DECODE_TASK
+  if (draw_pending == 0) return;
+  collectDecodedImages();
+  uint8_t ready = 0;
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    if (!(draw_pending & (0x01 << digit))) continue;
+    uint16_t file_index = current_graphic * 10 + digits[digit];
+    if (digits[digit] == blanked ||
+        (!isDecodePending(file_index) && !isDecodePending(backgroundIndex(current_graphic)))) {
+      ready |= 0x01 << digit;
+    }
+  }
+  draw_pending &= ~ready;
+  if (ready != 0) showDigits(ready);
+#endif
+}
+
+void TFTs::loopTransitions() {
+  uint32_t now = millis();
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    Transition &t = transitions[digit];
+    if (t.from == ImageCache::empty) continue;
+    uint32_t elapsed = now - t.start;
+    const ImageFrame* from = image_cache.peek(t.from);
+    const ImageFrame* to = image_cache.peek(t.to);
+    const ImageFrame* background = image_cache.peek(backgroundIndex(t.to / 10));
+    bool layered = (from != nullptr && from->sprite) || (to != nullptr && to->sprite);
+    if (elapsed >= TRANSITION_MS || from == nullptr || to == nullptr || (layered && background == nullptr)) {
+      finishTransition(digit);
+      continue;
+    }
+    if (now - t.last_frame < 1000 / TRANSITION_FPS) continue;
+    t.last_frame = now;
+    t.frames++;
+    pushTransitionFrame(digit, from, to, layered ? background : nullptr, transition, elapsed);
+  }
+}
+
+uint32_t TFTs::getFrameWait() {
+  uint32_t wait = 0xFFFFFFFF;
+  uint32_t now = millis();
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    const Transition &t = transitions[digit];
+    if (t.from != ImageCache::empty) {
+      uint32_t since = now - t.last_frame;
+      uint32_t due = (since < 1000 / TRANSITION_FPS) ? 1000 / TRANSITION_FPS - since : 0;
+      if (due < wait) wait = due;
+    }
+    const Animation &a = animations[digit];
+    if (a.state == animation_playing) {
+      uint32_t due = (int32_t(a.due - now) > 0) ? a.due - now : 0;
+      if (due < wait) wait = due;
+    }
+    else if (a.state == animation_requested || a.state == animation_opened || a.state == animation_failed) {
+      wait = 0;
+    }
+  }
+  return wait;
+}
+
+// Ends with a push of the new image, so the display is in a known state for delta pushes again.
+void TFTs::finishTransition(uint8_t digit) {
+  Transition &t = transitions[digit];
+#ifdef DEBUG_OUTPUT
+  uint32_t elapsed = millis() - t.start;
+  Serial.print("Transition of digit ");
+  Serial.print(digit);
+  Serial.print(": ");
+  Serial.print(t.frames);
+  Serial.print(" frames in ");
+  Serial.print(elapsed);
+  Serial.print(" ms, fps: ");
+  Serial.println(elapsed > 0 ? t.frames * 1000 / elapsed : 0);
+#endif
+  uint16_t file_index = t.to;
+  t.from = ImageCache::empty;
+  showDigitGroup(0x01 << digit, file_index, nullptr);
+}
+
+// Starts playing the animations of the displays in map whose new value has one, with its first frame as soon as
+// the file is open. Until then the display keeps what it shows. Returns the displays that still have to be drawn.
+uint8_t TFTs::startAnimations(uint8_t map) {
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    if (!(map & (0x01 << digit)) || !isAnimated(current_graphic, digits[digit])) continue;
+    uint16_t file_index = current_graphic * 10 + digits[digit];
+    Animation &a = animations[digit];
+    transitions[digit].from = ImageCache::empty;
+    markDirty(digit);
+    // A redraw of the same digit just continues the animation.
+    if (a.file_index != file_index) {
+      a.file_index = file_index;
+      // An open still out with the decode task is redone when it comes back
+      if (a.state != animation_opening) openAnimation(digit);
+    }
+    if (a.state == animation_opened) {
+      a.state = animation_playing;
+      a.frame = 0;
+    }
+    if (a.state == animation_failed) continue;
+    if (a.state == animation_playing) {
+      a.due = millis();
+      if (!pushAnimationFrame(digit)) continue;
+    }
+    map &= ~(0x01 << digit);
+  }
+  return map;
+}
+
+// Opens the animation of a display: with the decode task running it is requested there and taken over by
+// loopAnimations(), otherwise opened right away.
+void TFTs::openAnimation(uint8_t digit) {
+  Animation &a = animations[digit];
+  #ifdef USE_DECODE_TASK
+  if (decode_worker.isRunning()) {
+    // If the queue is full, loopAnimations() tries again
+    a.state = animation_requested;
+    if (decode_outstanding + animations_opening < DECODE_QUEUE_LENGTH && decode_worker.request(a.file_index, digit)) {
+      a.state = animation_opening;
+      animations_opening++;
+    }
+    return;
+  }
+  #endif
+  a.state = a.stream.open(storage, a.file_index, decoder) ? animation_opened : animation_failed;
+  if (a.state == animation_failed) {
+    Serial.print("Animation ");
+    Serial.print(a.file_index);
+    Serial.print(": ");
+    Serial.println(a.stream.getError());
+  }
+}
+
+void TFTs::stopAnimation(uint8_t digit) {
+  Animation &a = animations[digit];
+  a.file_index = ImageCache::empty;
+  // The decode task still has the stream; it is closed when the result comes back.
+  if (a.state == animation_opening) return;
+  a.stream.close();
+  a.state = animation_off;
+}
+
+// Frames that are due go out until ANIMATION_BUDGET_MS is used up; the displays left over are served
+// first next time. A frame due more than an interval ago is dropped, so animations keep their speed.
+// Animations opened by the decode task start here, with their first frame.
+void TFTs::loopAnimations() {
+  #ifdef USE_DECODE_TASK
+  if (decode_worker.isRunning()) collectDecodedImages();
+  #endif
+  uint32_t start = millis();
+  for (uint8_t i = 0; i < NUM_DIGITS; i++) {
+    uint8_t digit = (animation_next + i) % NUM_DIGITS;
+    Animation &a = animations[digit];
+    if (a.state == animation_requested) openAnimation(digit);
+    if (a.state == animation_failed) {
+      // The still image instead
+      showDigitGroup(0x01 << digit, current_graphic * 10 + digits[digit], nullptr);
+      continue;
+    }
+    if (a.state == animation_opened) {
+      a.state = animation_playing;
+      a.frame = 0;
+      a.due = millis();
+    }
+    if (a.state != animation_playing) continue;
+    uint32_t now = millis();
+    if (int32_t(now - a.due) < 0) continue;
+    if (now - start >= ANIMATION_BUDGET_MS) {
+      animation_next = digit;
+      return;
+    }
+    uint16_t interval = a.stream.getFrameMs();
+    uint32_t late = (now - a.due) / interval;
+    a.frame += late;
+    a.due += late * interval;
+    animation_dropped += late;
+    if (!pushAnimationFrame(digit)) {
+      // Corrupt file: fall back to the still image
+      showDigitGroup(0x01 << digit, current_graphic * 10 + digits[digit], nullptr);
+    }
+  }
+}
+
+// Pushes the current frame of a display's animation, unpacking one line at a time.
+bool TFTs::pushAnimationFrame(uint8_t digit) {
+  Animation &a = animations[digit];
+  bool ok = a.stream.beginFrame(a.frame);
+  if (ok) {
+    uint16_t palette[256];
+    pushLines(digit, [&](int16_t line, uint16_t* dst) {
+      const ImageFrame* row = ok ? a.stream.line(line) : nullptr;
+      if (row == nullptr) {
+        ok = false;
+        memset(dst, 0, TFT_WIDTH * sizeof(uint16_t));
+        return;
+      }
+      if (line == 0) dimPalette(row, palette);
+      LineKernel kernel = RowKernels::selectLineKernel(row, dimming < 255, 0, line, TFT_WIDTH, 1);
+      kernel(row, line, 0, TFT_WIDTH, palette, dim_lut, dst);
+    });
+  }
+  if (!ok) {
+    Serial.print("Animation ");
+    Serial.print(a.stream.getFileIndex());
+    Serial.print(": ");
+    Serial.println(a.stream.getError());
+    stopAnimation(digit);
+    return false;
+  }
+  a.frame++;
+  a.due += a.stream.getFrameMs();
+  animation_frames++;
+  return true;
+}
+
+void TFTs::printAnimationStats() {
+  uint32_t memory = 0;
+  uint8_t playing = 0;
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    if (animations[digit].state != animation_playing) continue;
+    memory += animations[digit].stream.getMemory();
+    playing++;
+  }
+  if (playing == 0 && animation_frames == 0) return;
+  Serial.print("Animations: ");
+  Serial.print(playing);
+  Serial.print(" playing (");
+  Serial.print(memory);
+  Serial.print(" bytes), ");
+  Serial.print(animation_frames);
+  Serial.print(" frames pushed, ");
+  Serial.print(animation_dropped);
+  Serial.println(" dropped");
+}
+
+void TFTs::preload(uint8_t value, uint32_t deadline) {
+  if (value == blanked || isAnimated(current_graphic, value)) return;
+  preloader.add(current_graphic * 10 + value, deadline);
+}
+
+// Loads the queued image with the earliest deadline that is not decoded yet.
+// With the decode task, it is only requested here and collected on one of the next calls.
 void TFTs::LoadNextImage() {
-  if (NextFileRequired != FileInBuffer) {
+  preloader.expire(millis(), PRELOAD_GRACE_MS);
+#ifdef USE_DECODE_TASK
+  if (decode_worker.isRunning()) collectDecodedImages();
+#endif
+  if (switch_face != 0) {
+    // A face switch goes first
+    if (prefetchFace()) finishFaceSwitch();
+    return;
+  }
+  for (uint8_t i = 0; i < preloader.getCount(); i++) {
+    uint16_t file_index = preloader.getJob(i).file_index;
+    if (file_index / 10 != current_graphic) continue;
+    // A glyph of a layered face is drawn over the background, which has to be loaded too
+    if (image_cache.contains(file_index)) file_index = backgroundFor(file_index);
+    if (file_index == ImageCache::empty || image_cache.contains(file_index)) continue;
+#ifdef USE_DECODE_TASK
+    if (isDecodePending(file_index)) continue;
+#endif
+#ifdef DEBUG_OUTPUT
+    Serial.print("Preload img ");
+    Serial.print(file_index);
+    Serial.print(", due in (ms): ");
+    Serial.println(int32_t(preloader.getJob(i).deadline - millis()));
+#endif
+    prefetchImage(file_index);
+    return;
+  }
+  // Nothing to preload, keep the diff table up to date (after a clock face change).
+  UpdateDiffTable();
+}
+
+void TFTs::switchFace(uint8_t face) {
+  if (face == current_graphic) {
+    if (switch_face != 0) image_cache.unpinAll();
+    switch_face = 0;
+    return;
+  }
+  if (face == switch_face) return;
+  if (switch_face != 0) image_cache.unpinAll();
+  switch_face = face;
+  switch_start = millis();
+}
+
+// One step of prefetching the images the displays will show with the new face.
+// Returns true when the switch can be done: all of them are decoded, or there is no room for more, or it takes too long.
+// Prefetched images are pinned, so preloads for the old face don't evict them.
+bool TFTs::prefetchFace() {
+  bool ready = true;
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    if (digits[digit] == blanked || isAnimated(switch_face, digits[digit])) continue;
+    uint16_t file_index = switch_face * 10 + digits[digit];
+    if (image_cache.contains(file_index)) {
+      image_cache.pin(file_index);
+      // Glyphs of a layered face need the background as well
+      file_index = backgroundFor(file_index);
+      if (file_index == ImageCache::empty) continue;
+      if (image_cache.contains(file_index)) {
+        image_cache.pin(file_index);
+        continue;
+      }
+    }
+    #ifdef USE_DECODE_TASK
+    if (isDecodePending(file_index)) {
+      ready = false;
+      continue;
+    }
+    #endif
+    // Keep room for a full screen image of the old face, which is still shown until the switch.
+    size_t frame_bytes = sizeof(ImageFrame) + TFT_WIDTH * TFT_HEIGHT * sizeof(uint16_t);
+    if (image_cache.getPinnedBytes() + 2 * frame_bytes > image_cache.getBudget()) continue;
+    if (!prefetchImage(file_index)) continue;  // can't be loaded, nothing to wait for
+    if (image_cache.contains(file_index)) {
+      image_cache.pin(file_index);
+    }
+    else {
+      ready = false;
+    }
+    break;  // one request per loop
+  }
+  return ready || millis() - switch_start > FACE_SWITCH_TIMEOUT_MS;
+}
+
+// Shows the new face on all displays at once. Digits with a prefetched image go out back to back.
+void TFTs::finishFaceSwitch() {
+  uint8_t ready = 0, needed = 0;
+  for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+    if (digits[digit] == blanked) continue;
+    needed++;
+    if (image_cache.contains(switch_face * 10 + digits[digit])) ready++;
+  }
+  uint32_t prefetched = millis();
+
+  current_graphic = switch_face;
+  switch_face = 0;
+  showAllDigits();
+  waitForPush();
+  image_cache.unpinAll();
+
+  Serial.print("Face switch to ");
+  Serial.print(current_graphic);
+  Serial.print(": ");
+  Serial.print(millis() - switch_start);
+  Serial.print(" ms (prefetch ");
+  Serial.print(prefetched - switch_start);
+  Serial.print(" ms, flip ");
+  Serial.print(millis() - prefetched);
+  Serial.print(" ms), ");
+  Serial.print(ready);
+  Serial.print("/");
+  Serial.print(needed);
+  Serial.println(" digits prefetched");
+}
+
+// The previous image can be updated in place if the display shows digit n of the current face
+// at the current dimming, and digit n+1 is requested. On layered faces any other digit can follow as well.
+const DirtyRects* TFTs::findDelta(uint8_t digit, uint16_t file_index) {
+  uint16_t shown = ShownFile[digit];
+  if (shown == ImageCache::empty || ShownDimming[digit] != dimming) return nullptr;
+  if (DiffTableFace != current_graphic || shown / 10 != current_graphic) return nullptr;
+  uint8_t from = shown % 10;
+  if ((from + 1) % 10 != file_index % 10 || !DiffTable[from].valid) return glyphDelta(shown, file_index);
+  return &DiffTable[from];
+}
+
+// Between two glyphs of a layered face only their rectangles change: the old one is covered by
+// the background again and the new one is drawn. Both must be cached, their frames tell where they are.
+const DirtyRects* TFTs::glyphDelta(uint16_t shown, uint16_t file_index) {
+  if (shown == file_index || shown / 10 != file_index / 10) return nullptr;
+  const ImageFrame* a = image_cache.peek(shown);
+  const ImageFrame* b = image_cache.peek(file_index);
+  if (a == nullptr || b == nullptr || !a->sprite || !b->sprite) return nullptr;
+
+  // Rebuilt for each request; all displays grouped into one push request the same digit
+  DirtyRects &d = GlyphDelta[shown % 10];
+  d.begin();
+  for (int16_t line = 0; line < TFT_HEIGHT; line++) {
+    int16_t first = -1, last = -1;
+    for (const ImageFrame* glyph : { a, b }) {
+      if (line < glyph->y || line >= glyph->y + int16_t(glyph->height)) continue;
+      if (first < 0 || glyph->x < first) first = glyph->x;
+      if (glyph->x + int16_t(glyph->width) - 1 > last) last = glyph->x + glyph->width - 1;
+    }
+    d.addRow(line, first, last);
+  }
+  d.end(TFT_WIDTH, TFT_HEIGHT);
+  return &d;
+}
+
+void TFTs::buildDiffTable() {
+#ifdef DEBUG_OUTPUT
+  uint32_t StartTime = millis();
+#endif
+  while (UpdateDiffTable()) {}
 #ifdef DEBUG_OUTPUT
-    Serial.println("Preload next img");
+  Serial.print("Diff table built in (ms): ");
+  Serial.println(millis() - StartTime);
 #endif
-    LoadImageIntoBuffer(NextFileRequired);
+}
+
+// Does one step of work on the diff table: loads one image, or compares two loaded ones.
+// Returns false when the table is complete.
+bool TFTs::UpdateDiffTable() {
+  if (DiffTableFace != current_graphic) {
+    for (uint8_t i = 0; i < 10; i++) {
+      DiffTable[i].reset();
+    }
+    DiffTableFace = current_graphic;
+  }
+
+  uint8_t from = 0;
+  while (from < 10 && DiffTable[from].valid) from++;
+  if (from == 10) return false;
+
+  uint16_t from_index = DiffTableFace * 10 + from;
+  uint16_t to_index = DiffTableFace * 10 + (from + 1) % 10;
+  DirtyRects &d = DiffTable[from];
+
+  if (!image_cache.contains(from_index)) {
+    if (!prefetchImage(from_index)) { d.begin(); d.full = true; d.valid = true; }
+    return true;
+  }
+  if (!image_cache.contains(to_index)) {
+    if (!prefetchImage(to_index)) { d.begin(); d.full = true; d.valid = true; }
+    return true;
+  }
+  ImageFrame* a = image_cache.peek(from_index);
+  ImageFrame* b = image_cache.peek(to_index);
+  // Glyphs of a layered face are compared as drawn, over their background
+  ImageFrame* background = nullptr;
+  if (a->sprite || b->sprite) {
+    uint16_t background_index = backgroundIndex(DiffTableFace);
+    if (!image_cache.contains(background_index)) {
+      if (!prefetchImage(background_index)) { d.begin(); d.full = true; d.valid = true; }
+      return true;
+    }
+    background = image_cache.peek(background_index);
+  }
+
+  // Both lines in the byte order of the SPI bus, whatever the formats of the two images
+  uint16_t palette_a[256], palette_b[256], palette_background[256];
+  busPalette(a, palette_a);
+  busPalette(b, palette_b);
+  if (background != nullptr) busPalette(background, palette_background);
+  uint16_t line_a[TFT_WIDTH], line_b[TFT_WIDTH];
+  d.begin();
+  for (int16_t line = 0; line < TFT_HEIGHT; line++) {
+    readLine(a, background, line, palette_a, palette_background, line_a);
+    readLine(b, background, line, palette_b, palette_background, line_b);
+    int16_t first = -1, last = -1;
+    for (int16_t col = 0; col < TFT_WIDTH; col++) {
+      if (line_a[col] != line_b[col]) {
+        if (first < 0) first = col;
+        last = col;
+      }
+    }
+    d.addRow(line, first, last);
+  }
+  d.end(TFT_WIDTH, TFT_HEIGHT);
+
+#ifdef DEBUG_OUTPUT
+  Serial.print("Diff ");
+  Serial.print(from);
+  Serial.print(" -> ");
+  Serial.print((from + 1) % 10);
+  Serial.print(": ");
+  Serial.print(d.count);
+  Serial.print(" rects, ");
+  Serial.print(d.area());
+  Serial.println(d.full ? " pixels, full push" : " pixels");
+#endif
+  return true;
+}
+
+// One undimmed display line of a frame, for comparing images.
+// Images smaller than the display come with their black border, glyphs with their background.
+void TFTs::readLine(const ImageFrame* frame, const ImageFrame* background, int16_t line,
+                    const uint16_t* palette, const uint16_t* background_palette, uint16_t* dst) {
+  if (frame->sprite && background != nullptr) {
+    readLine(background, nullptr, line, background_palette, nullptr, dst);
+    RowKernels::composeSprite(frame, line, 0, TFT_WIDTH, palette, dim_lut, false, dst);
+    return;
+  }
+  LineKernel kernel = RowKernels::selectLineKernel(frame, false, 0, line, TFT_WIDTH, 1);
+  kernel(frame, line, 0, TFT_WIDTH, palette, dim_lut, dst);
+}
+
+// The undimmed palette of an indexed frame, byte-swapped like the undimmed RGB565 kernels
+void TFTs::busPalette(const ImageFrame* frame, uint16_t* palette) {
+  if (frame->format != ImageFrame::indexed) return;
+  uint16_t colors = 1 << frame->bits;
+  for (uint16_t i = 0; i < colors; i++) {
+    palette[i] = RowKernels::swap16(frame->palette[i]);
   }
 }
 
-void TFTs::InvalidateImageInBuffer() { // force reload from Flash with new dimming settings
-  FileInBuffer=255; // invalid, always load first image
+void TFTs::InvalidateImageInBuffer() { // force reload from Flash
+  image_cache.invalidateAll();
 }
 
-bool TFTs::FileExists(const char* path) {
-    fs::File f = SPIFFS.open(path, "r");
-    bool Exists = ((f == true) && !f.isDirectory());
-    f.close();
-    return Exists;
+void TFTs::setDimming(uint8_t dimming_) {
+  if (dimming_ == dimming) return;
+  dimming = dimming_;
+  buildDimmingLut();
+}
+
+void TFTs::setBrightness(uint8_t level, uint16_t ramp_ms) {
+  #if defined(PANEL_BRIGHTNESS_PWM) || defined(PANEL_BRIGHTNESS_DCS)
+  brightness_from = brightness;
+  brightness_to = level;
+  ramp_start = millis();
+  ramp_length = ramp_ms;
+  loopBrightness();
+  #else
+  brightness_to = level;
+  if (level == dimming) return;
+  setDimming(level);
+  showAllDigits();
+  #endif
+}
+
+void TFTs::loopBrightness() {
+  if (brightness == brightness_to) return;
+  uint32_t elapsed = millis() - ramp_start;
+  uint8_t level = brightness_to;
+  if (elapsed < ramp_length) {
+    level = brightness_from + (int32_t(brightness_to) - brightness_from) * int32_t(elapsed) / ramp_length;
+  }
+  if (level != brightness) {
+    brightness = level;
+    applyBrightness(level);
+  }
+}
+
+// Sets the brightness of the panels. The pixels and the cached images are not touched.
+void TFTs::applyBrightness(uint8_t level) {
+  #if defined(PANEL_BRIGHTNESS_PWM)
+  if (enabled) ledcWrite(PANEL_BRIGHTNESS_PWM_CHANNEL, level);
+  #elif defined(PANEL_BRIGHTNESS_DCS)
+  // ST7789 WRCTRLD (0x53): brightness control and backlight on, WRDISBV (0x51): brightness
+  waitForPush();
+  chip_select.setAll();
+  writecommand(0x53);
+  writedata(0x24);
+  writecommand(0x51);
+  writedata(level);
+  #endif
+}
+
+// Entries are stored byte-swapped, so a looked up color can go straight to the SPI bus.
+void TFTs::buildDimmingLut() {
+  for (uint8_t i = 0; i < 64; i++) {
+    uint8_t level = (dimming == 255) ? i : (i * dimming) >> 8;
+    if (i < 32) {
+      dim_lut.red[i]  = RowKernels::swap16(level << 11);
+      dim_lut.blue[i] = RowKernels::swap16(level);
+    }
+    dim_lut.green[i] = RowKernels::swap16(level << 5);
+  }
 }
 
 // These BMP functions are stolen directly from the TFT_SPIFFS_BMP example in the TFT_eSPI library.
 // Unfortunately, they aren't part of the library itself, so I had to copy them.
 // I've modified DrawImage to buffer the whole image at once instead of doing it line-by-line.
+// Decoded images are kept in a small LRU cache, so digits shown recently don't need to be decoded again.
 
 
 bool TFTs::allocateImageBuffer() {
-    freeImageBuffer();  // Free any existing buffer
-    
-    size_t required_size = TFT_WIDTH * TFT_HEIGHT * sizeof(uint16_t);
-    
-    UnpackedImageBuffer = (uint16_t*)malloc(required_size);
-    if (UnpackedImageBuffer == nullptr) {
+    size_t budget = psramFound() ? IMAGE_CACHE_BYTES_PSRAM : IMAGE_CACHE_BYTES;
+
+    if (image_cache.begin(IMAGE_CACHE_MAX_SLOTS, budget) == 0) {
         Serial.println(F("Failed to allocate image buffer"));
         return false;
     }
@@ -179,234 +955,493 @@ bool TFTs::allocateImageBuffer() {
 }
 
 void TFTs::freeImageBuffer() {
-    if (UnpackedImageBuffer != nullptr) {
-        free(UnpackedImageBuffer);
-        UnpackedImageBuffer = nullptr;
-    }
+    image_cache.end();
 }
 
 
 
-int8_t TFTs::CountNumberOfClockFaces() {
-  int8_t i, found;
-  char filename[10];
+// Decodes file_index into decode_frames. Runs on the decode task while it is running,
+// so it must only use the decoder, the face pack and the storage, which the loop leaves alone then
+// (and the catalog, which doesn't change after begin()).
+bool TFTs::decodeImage(uint16_t file_index) {
+    uint32_t StartTime = millis();
+    char filename[16];
+    FaceCatalog::fileName(file_index, filename);
+    uint8_t face = FaceCatalog::faceOf(file_index);
 
-  Serial.print("Searching for BMP clock files... ");
-  found = 0;
-  for (i=1; i < 10; i++) {
-    sprintf(filename, "/%d.bmp", i*10); // search for files 10.bmp, 20.bmp,...
-    if (!FileExists(filename)) {
-      found = i-1;
-      break;
+    #ifdef DEBUG_OUTPUT
+    Serial.print("Loading: ");
+    Serial.println(filename);
+    #endif
+    
+    bool loaded;
+    const uint8_t* data;
+    uint32_t length;
+    if (use_face_partition && face_partition.find(file_index, &data, &length)) {
+        // Decoded straight from the memory mapped flash
+        MemoryImageReader reader(data, length);
+        loaded = decoder.decode(reader, file_index);
     }
-  }
-  Serial.print(found);
-  Serial.println(" fonts found.");
-  return found;
+    else if (catalog.hasPack(face) && face_pack.open(storage, face) &&
+             face_pack.select(FaceCatalog::isBackground(file_index) ? FacePack::background : file_index % 10)) {
+        // Seek to the digit inside the open face pack
+        loaded = decoder.decode(face_pack.getFile(), file_index);
+    }
+    else {
+        ImageFile bmpFS;
+        if (!storage.open(filename, bmpFS)) {
+            Serial.print("File not found: ");
+            Serial.println(filename);
+            return false;
+        }
+        loaded = decoder.decode(bmpFS, file_index);
+        bmpFS.close();
+    }
+
+    if (!loaded) {
+        Serial.print("Failed to load: ");
+        Serial.print(filename);
+        Serial.print(": ");
+        Serial.println(decoder.getError());
+    }
+
+    #ifdef DEBUG_OUTPUT
+    Serial.print("img load time: ");
+    Serial.println(millis() - StartTime);
+    #endif
+
+    return loaded;
 }
 
-bool TFTs::LoadImageIntoBuffer(uint8_t file_index) {
+// Decodes file_index into the cache. With the decode task running, this waits for it: only for the benchmarks,
+// drawing goes through requireImage().
+bool TFTs::LoadImageIntoBuffer(uint16_t file_index) {
     if (!isBufferAllocated() && !allocateImageBuffer()) {
         return false;
     }
 
-    uint32_t StartTime = millis();
-    fs::File bmpFS;
-    char filename[10];
-    
-    #ifdef USE_CLK_FILES
-    sprintf(filename, "/%d.clk", file_index);
-    #else
-    sprintf(filename, "/%d.bmp", file_index);
+    #ifdef USE_DECODE_TASK
+    if (decode_worker.isRunning()) {
+        uint32_t StartTime = millis();
+        bool requested = false;
+        while (true) {
+            if (!requested) requested = requestImage(file_index);
+            if (requested && !isDecodePending(file_index)) break;
+            if (millis() - StartTime > DECODE_TIMEOUT_MS) {
+                Serial.print("Decode timed out: ");
+                Serial.println(file_index);
+                return false;
+            }
+            delay(1);
+            collectDecodedImages();
+        }
+        if (decode_failed == file_index) decode_failed = ImageCache::empty;
+        return image_cache.contains(file_index);
+    }
     #endif
 
+    bool loaded = decodeImage(file_index);
+    if (!loaded) {
+        image_cache.invalidate(file_index);
+    }
+
     #ifdef DEBUG_OUTPUT
-    Serial.print("Loading: ");
-    Serial.println(filename);
+    ImageFrame* frame = image_cache.peek(file_index);
+    if (frame != nullptr) {
+        Serial.print(" image W, H, BPP: ");
+        Serial.print(frame->width); Serial.print(", "); 
+        Serial.print(frame->height); Serial.print(", "); 
+        Serial.println(frame->bits);
+        Serial.print(" offset x, y: ");
+        Serial.print(frame->x); Serial.print(", "); 
+        Serial.println(frame->y);
+    }
     #endif
-    
-    bmpFS = SPIFFS.open(filename, "r");
-    if (!bmpFS) {
-        Serial.print("File not found: ");
-        Serial.println(filename);
-        return false;
+
+    return loaded;
+}
+
+// Starts loading file_index without waiting for it, if it is not cached yet. Without the decode task it is
+// loaded right away. Returns false if it can't be loaded.
+bool TFTs::prefetchImage(uint16_t file_index) {
+    #ifdef USE_DECODE_TASK
+    if (decode_worker.isRunning()) {
+        collectDecodedImages();
+        if (image_cache.contains(file_index) || isDecodePending(file_index)) return true;
+        if (decode_failed == file_index) {
+            decode_failed = ImageCache::empty;
+            return false;
+        }
+        requestImage(file_index);  // if the queue is full, the next call tries again
+        return true;
     }
+    #endif
+    return image_cache.contains(file_index) || LoadImageIntoBuffer(file_index);
+}
 
-    // Clear buffer
-    memset(UnpackedImageBuffer, 0, TFT_WIDTH * TFT_HEIGHT * sizeof(uint16_t));
+// true if file_index is in the cache. Without the decode task it is loaded right away. With it, it is
+// requested and draw_deferred is set, unless decoding failed; nothing waits for it.
+bool TFTs::requireImage(uint16_t file_index) {
+    if (!prefetchImage(file_index)) return false;
+    if (image_cache.contains(file_index)) return true;
+    draw_deferred = true;
+    return false;
+}
 
-    #ifdef USE_CLK_FILES
-    // CLK file handling
-    uint16_t magic = read16(bmpFS);
-    if (magic != 0x4B43) { // "CK" header
-        Serial.println("Invalid CLK file");
-        bmpFS.close();
+#ifdef USE_DECODE_TASK
+void TFTs::decodeTask(void* context, const DecodeWorker::Request &request, DecodeWorker::Result &result) {
+    TFTs* tfts = (TFTs*)context;
+    result.file_index = request.file_index;
+    result.animation = request.animation;
+    result.frame = nullptr;
+    if (request.animation != DecodeWorker::no_animation) {
+        result.ok = tfts->animations[request.animation].stream.open(tfts->storage, request.file_index, tfts->decoder);
+        return;
+    }
+    result.ok = tfts->decodeImage(request.file_index);
+    if (result.ok) {
+        result.frame = tfts->decode_frames.take(&result.data_bytes);
+    }
+    else {
+        tfts->decode_frames.discard();
+    }
+}
+
+// Queues file_index for the decode task, unless it is already on its way. false if the queue is full.
+bool TFTs::requestImage(uint16_t file_index) {
+    if (isDecodePending(file_index)) return true;
+    if (decode_outstanding + animations_opening >= DECODE_QUEUE_LENGTH) return false;
+    // The frame is allocated on the other core, which can't evict images. Room for a full screen image
+    // is reserved here until the result is collected.
+    if (!image_cache.reserve(decode_frame_bytes)) return false;
+    if (!decode_worker.request(file_index)) {
+        image_cache.unreserve(decode_frame_bytes);
         return false;
     }
+    decode_pending[decode_outstanding++] = file_index;
+    return true;
+}
 
-    int16_t w = read16(bmpFS);
-    int16_t h = read16(bmpFS);
-    int16_t x = (TFT_WIDTH - w) / 2;
-    int16_t y = (TFT_HEIGHT - h) / 2;
+bool TFTs::isDecodePending(uint16_t file_index) {
+    for (uint8_t i = 0; i < decode_outstanding; i++) {
+        if (decode_pending[i] == file_index) return true;
+    }
+    return false;
+}
 
-    uint8_t lineBuffer[w * 2];
-    
-    for (int16_t row = 0; row < h; row++) {
-        bmpFS.read(lineBuffer, sizeof(lineBuffer));
-        
-        for (int16_t col = 0; col < w; col++) {
-            uint16_t color;
-            if (dimming == 255) {
-                color = (lineBuffer[col*2+1] << 8) | (lineBuffer[col*2]);
-            } else {
-                uint8_t PixM = lineBuffer[col*2+1];
-                uint8_t PixL = lineBuffer[col*2];
-                uint16_t r = ((PixM & 0xF8) * dimming) >> 8;
-                uint16_t g = ((((PixM << 5) | (PixL >> 3)) & 0xFC) * dimming) >> 8;
-                uint16_t b = (((PixL << 3) & 0xF8) * dimming) >> 8;
-                color = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+// Moves the frames finished by the decode task into the cache, and hands opened animations back to the loop.
+void TFTs::collectDecodedImages() {
+    DecodeWorker::Result result;
+    while (decode_worker.poll(result)) {
+        if (result.animation != DecodeWorker::no_animation) {
+            Animation &a = animations[result.animation];
+            animations_opening--;
+            if (a.file_index != result.file_index) {
+                // Stopped or changed while it was opened
+                a.stream.close();
+                a.state = (a.file_index != ImageCache::empty) ? animation_requested : animation_off;
+                continue;
             }
-            // Convert 2D coordinates to 1D array index
-            int32_t bufferIndex = (row + y) * TFT_WIDTH + (col + x);
-            if (bufferIndex >= 0 && bufferIndex < TFT_WIDTH * TFT_HEIGHT) {
-                UnpackedImageBuffer[bufferIndex] = color;
+            a.state = result.ok ? animation_opened : animation_failed;
+            if (!result.ok) {
+                Serial.print("Animation ");
+                Serial.print(a.file_index);
+                Serial.print(": ");
+                Serial.println(a.stream.getError());
             }
+            continue;
+        }
+        for (uint8_t i = 0; i < decode_outstanding; i++) {
+            if (decode_pending[i] != result.file_index) continue;
+            decode_pending[i] = decode_pending[--decode_outstanding];
+            break;
+        }
+        image_cache.unreserve(decode_frame_bytes);
+        if (result.frame == nullptr) {
+            decode_failed = result.file_index;
+            continue;
         }
+        image_cache.adopt(result.file_index, result.frame, result.data_bytes);
+        #ifdef DEBUG_OUTPUT
+        Serial.print("Decoded on task: ");
+        Serial.print(result.file_index);
+        Serial.print(", W, H, BPP: ");
+        Serial.print(result.frame->width); Serial.print(", "); 
+        Serial.print(result.frame->height); Serial.print(", "); 
+        Serial.println(result.frame->bits);
+        #endif
     }
+}
+#endif
 
-    #else
-    // BMP file handling
-    uint16_t magic = read16(bmpFS);
-    if (magic == 0xFFFF) {
-        Serial.print("Can't open file. Make sure you upload the SPIFFs image with BMPs: ");
-        Serial.println(filename);
-        bmpFS.close();
-        return false;
-    }
-    
-    if (magic != 0x4D42) {
-        Serial.print("File not a BMP. Magic: ");
-        Serial.println(magic);
-        bmpFS.close();
-        return false;
+#ifdef IMAGE_BENCHMARK
+// Decodes all digits of the current clock face from the file system, then from the face partition (if there is one),
+// and prints the average time per image. Then times expanding the images for a full screen push with the
+// row kernels against the per-pixel loop (RowKernels.h). Turn off DEBUG_OUTPUT for clean numbers.
+void TFTs::benchmarkImageStores() {
+    for (uint8_t pass = 0; pass < 2; pass++) {
+        use_face_partition = (pass == 1);
+        if (use_face_partition && !face_partition.isMapped()) {
+            Serial.println("Benchmark: no face partition");
+            break;
+        }
+        uint32_t total = 0;
+        uint8_t loaded = 0;
+        for (uint8_t digit = 0; digit < 10; digit++) {
+            uint16_t file_index = current_graphic * 10 + digit;
+            image_cache.invalidate(file_index);
+            uint32_t start = micros();
+            if (LoadImageIntoBuffer(file_index)) {
+                total += micros() - start;
+                loaded++;
+            }
+        }
+        Serial.print("Benchmark ");
+        Serial.print(use_face_partition ? "face partition" : storage.getName());
+        Serial.print(": ");
+        Serial.print(loaded);
+        Serial.print(" images, avg us per image: ");
+        Serial.println(loaded > 0 ? total / loaded : 0);
     }
 
-    read32(bmpFS); // filesize
-    read32(bmpFS); // reserved
-    uint32_t seekOffset = read32(bmpFS); // start of bitmap
-    uint32_t headerSize = read32(bmpFS);
-    int16_t w = read32(bmpFS);
-    int16_t h = read32(bmpFS);
-    read16(bmpFS); // color planes
-    uint16_t bitDepth = read16(bmpFS);
+    for (uint8_t dimmed = 0; dimmed < 2; dimmed++) {
+        uint32_t kernel_us = 0, reference_us = 0;
+        uint8_t count = 0;
+        for (uint8_t digit = 0; digit < 10; digit++) {
+            const ImageFrame* frame = image_cache.peek(current_graphic * 10 + digit);
+            if (frame == nullptr) continue;
+            uint16_t palette[256];
+            dimPalette(frame, palette);
+
+            uint32_t start = micros();
+            LineKernel kernel = RowKernels::selectLineKernel(frame, dimmed, 0, 0, TFT_WIDTH, TFT_HEIGHT);
+            for (int16_t line = 0; line < TFT_HEIGHT; line++) {
+                kernel(frame, line, 0, TFT_WIDTH, palette, dim_lut, PushStrip + (line % PUSH_STRIP_LINES) * TFT_WIDTH);
+            }
+            kernel_us += micros() - start;
 
-    // Center image on display
-    int16_t x = (TFT_WIDTH - w) / 2;
-    int16_t y = (TFT_HEIGHT - h) / 2;
+            start = micros();
+            for (int16_t line = 0; line < TFT_HEIGHT; line++) {
+                RowKernels::referenceLine(frame, line, 0, TFT_WIDTH, palette, dim_lut, dimmed, PushStrip + (line % PUSH_STRIP_LINES) * TFT_WIDTH);
+            }
+            reference_us += micros() - start;
+            count++;
+        }
+        if (count == 0) break;
+        Serial.print(dimmed ? "Benchmark push dimmed, " : "Benchmark push undimmed, ");
+        Serial.print("avg us per image: per pixel ");
+        Serial.print(reference_us / count);
+        Serial.print(", kernels ");
+        Serial.println(kernel_us / count);
+    }
 
-    #ifdef DEBUG_OUTPUT
-    Serial.print(" image W, H, BPP: ");
-    Serial.print(w); Serial.print(", "); 
-    Serial.print(h); Serial.print(", "); 
-    Serial.println(bitDepth);
-    Serial.print(" dimming: ");
-    Serial.println(dimming);
-    Serial.print(" offset x, y: ");
-    Serial.print(x); Serial.print(", "); 
-    Serial.println(y);
-    #endif
+    use_face_partition = face_partition.isMapped();
+    image_cache.invalidateAll();
+}
 
-    if (read32(bmpFS) != 0 || (bitDepth != 24 && bitDepth != 1 && bitDepth != 4 && bitDepth != 8)) {
-        Serial.println("BMP format not recognized.");
-        bmpFS.close();
-        return false;
+// Transitions of the seconds ones display from 0 to 1, frames pushed back to back: the highest frame rate
+// one changing display can reach. Also times the blend kernel against the per-channel blend.
+void TFTs::benchmarkTransitions() {
+    uint16_t from_index = current_graphic * 10, to_index = from_index + 1;
+    if (!LoadImageIntoBuffer(from_index) || !LoadImageIntoBuffer(to_index) ||
+        image_cache.peek(from_index) == nullptr || image_cache.peek(to_index) == nullptr) {
+        Serial.println("Benchmark: images for the transition not loaded");
+        return;
+    }
+    const ImageFrame* from = image_cache.peek(from_index);
+    const ImageFrame* to = image_cache.peek(to_index);
+    uint16_t background_index = backgroundIndex(current_graphic);
+    bool layered = from->sprite || to->sprite;
+    const ImageFrame* background = (layered && LoadImageIntoBuffer(background_index)) ? image_cache.peek(background_index) : nullptr;
+    from = image_cache.peek(from_index);
+    to = image_cache.peek(to_index);
+    if (from == nullptr || to == nullptr) {
+        Serial.println("Benchmark: images for the transition not loaded");
+        return;
     }
 
-    // Handle color palette for low bit depth images
-    uint32_t palette[256];
-    uint32_t paletteSize = 0;
-    if (bitDepth <= 8) {
-        read32(bmpFS); read32(bmpFS); read32(bmpFS); // skip size, w/h resolution
-        paletteSize = read32(bmpFS);
-        if (paletteSize == 0) paletteSize = pow(2, bitDepth);
-        bmpFS.seek(14 + headerSize);
-        for (uint16_t i = 0; i < paletteSize; i++) {
-            palette[i] = read32(bmpFS);
+    uint32_t start = micros();
+    for (int16_t line = 0; line < TFT_HEIGHT; line++) {
+        RowKernels::blendLine(TransitionLine, PushStrip, line % 33, TFT_WIDTH, PushStrip);
+    }
+    uint32_t kernel_us = micros() - start;
+    start = micros();
+    for (int16_t line = 0; line < TFT_HEIGHT; line++) {
+        RowKernels::referenceBlend(TransitionLine, PushStrip, line % 33, TFT_WIDTH, PushStrip);
+    }
+    uint32_t reference_us = micros() - start;
+    Serial.print("Benchmark blend, us per image: per channel ");
+    Serial.print(reference_us);
+    Serial.print(", 2 pixel kernel ");
+    Serial.println(kernel_us);
+
+    const transition_t types[] = { transition_crossfade, transition_slide };
+    for (transition_t type : types) {
+        uint16_t frames = 0;
+        start = millis();
+        uint32_t elapsed;
+        while ((elapsed = millis() - start) < TRANSITION_MS) {
+            pushTransitionFrame(SECONDS_ONES, from, to, background, type, elapsed);
+            frames++;
         }
+        waitForPush();
+        elapsed = millis() - start;
+        Serial.print(type == transition_slide ? "Benchmark slide: " : "Benchmark crossfade: ");
+        Serial.print(frames);
+        Serial.print(" frames in ");
+        Serial.print(elapsed);
+        Serial.print(" ms, fps: ");
+        Serial.println(frames * 1000 / elapsed);
     }
+    markDirty(SECONDS_ONES);
+}
+#endif
 
-    bmpFS.seek(seekOffset);
-
-    uint32_t lineSize = ((bitDepth * w + 31) >> 5) * 4;
-    uint8_t lineBuffer[lineSize];
+#ifdef SPI_CALIBRATION
+// The ESP32 SPI peripheral divides this clock by a whole number
+#define SPI_SOURCE_CLOCK (80000000UL)
+
+void TFTs::setSpiFrequency(uint32_t frequency) {
+    waitForPush();
+    spi_frequency = frequency;
+    spi_clock_div = spiFrequencyToClockDiv(frequency);
+    #ifdef USE_DMA_PUSH
+    // initDMA() adds the DMA device at SPI_FREQUENCY, other clocks push blocking
+    bool dma = (frequency == SPI_FREQUENCY) && (PushStrips[0] != nullptr) && (PushStrips[1] != nullptr);
+    if (dma != dma_ready) {
+        if (dma_ready) deInitDMA();
+        dma_ready = dma && initDMA();
+    }
+    #endif
+}
 
-    // Read bottom-up BMP
-    for (int16_t row = h - 1; row >= 0; row--) {
-        bmpFS.read(lineBuffer, sizeof(lineBuffer));
-        uint8_t* bptr = lineBuffer;
+// The clock saved by an earlier calibration, or a new calibration if there is none (or SPI_CALIBRATE_AT_BOOT).
+// A calibration without result isn't saved, so it runs again at the next boot.
+void TFTs::setupSpiFrequency(StoredConfig *stored_config) {
+    uint32_t frequency = 0;
+    #ifndef SPI_CALIBRATE_AT_BOOT
+    if (stored_config != nullptr && stored_config->loadBlob(SPI_CALIBRATION_KEY, &frequency, sizeof(frequency)) &&
+        frequency >= SPI_CALIBRATION_MIN && frequency <= SPI_CALIBRATION_MAX) {
+        setSpiFrequency(frequency);
+        Serial.printf("SPI clock %u Hz (calibrated)\n", unsigned(frequency));
+        return;
+    }
+    #endif
+    frequency = calibrateSpi();
+    if (frequency == 0) {
+        Serial.println(F("SPI calibration: no clock passed the readback, using the default"));
+        setSpiFrequency(SPI_FREQUENCY_DEFAULT);
+        return;
+    }
+    setSpiFrequency(frequency);
+    if (stored_config != nullptr) stored_config->saveBlob(SPI_CALIBRATION_KEY, &frequency, sizeof(frequency));
+    Serial.printf("SPI clock %u Hz (calibrated now)\n", unsigned(frequency));
+}
 
-        for (int16_t col = 0; col < w; col++) {
-            uint8_t r, g, b;
-            
-            if (bitDepth == 24) {
-                b = *bptr++;
-                g = *bptr++;
-                r = *bptr++;
-            } else {
-                uint32_t c = 0;
-                if (bitDepth == 8) {
-                    c = palette[*bptr++];
-                }
-                else if (bitDepth == 4) {
-                    c = palette[(*bptr >> ((col & 0x01) ? 0 : 4)) & 0x0F];
-                    if (col & 0x01) bptr++;
-                }
-                else { // bitDepth == 1
-                    c = palette[(*bptr >> (7 - (col & 0x07))) & 0x01];
-                    if ((col & 0x07) == 0x07) bptr++;
+// Checkerboards that toggle every bit from one pixel to the next, then noise. RGB565 as read back.
+static uint16_t testPattern(uint8_t pattern, int16_t x, int16_t y) {
+    bool odd = (x + y) & 1;
+    if (pattern == 0) return odd ? 0xAAAA : 0x5555;
+    if (pattern == 1) return odd ? 0xFFFF : 0x0000;
+    uint32_t h = (uint32_t(x) * 2654435761UL) ^ (uint32_t(y) * 40503UL) ^ (pattern * 0x9E3779B9UL);
+    h ^= h >> 15;
+    h *= 2246822519UL;
+    h ^= h >> 13;
+    return uint16_t(h);
+}
+const static uint8_t test_patterns = 3;
+
+uint32_t TFTs::calibrateSpi() {
+    waitForPush();
+    uint32_t highest = 0;       // fastest stable clock
+    uint32_t below = 0;         // the stable step before it
+    const uint16_t pushes = SPI_CALIBRATION_ROUNDS * test_patterns * NUM_DIGITS;
+    Serial.println(F("SPI calibration, full frame push per display:"));
+    for (uint8_t divider = SPI_SOURCE_CLOCK / SPI_CALIBRATION_MIN; divider >= 1; divider--) {
+        uint32_t frequency = SPI_SOURCE_CLOCK / divider;
+        if (frequency > SPI_CALIBRATION_MAX) break;
+        setSpiFrequency(frequency);
+
+        uint32_t push_us = 0;
+        uint8_t failed = 0;     // bit per display
+        for (uint8_t round = 0; round < SPI_CALIBRATION_ROUNDS; round++) {
+            for (uint8_t pattern = 0; pattern < test_patterns; pattern++) {
+                for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+                    chip_select.setDigit(digit);
+                    push_us += pushTestPattern(pattern);
+                    if (!checkTestPattern(pattern)) failed |= 0x01 << digit;
                 }
-                b = c;
-                g = c >> 8;
-                r = c >> 16;
             }
+        }
+        Serial.printf("  %2u.%02u MHz: %6u us", unsigned(frequency / 1000000), unsigned(frequency / 10000 % 100), unsigned(push_us / pushes));
+        if (failed == 0) {
+            Serial.println(", stable");
+            below = highest;
+            highest = frequency;
+            continue;
+        }
+        Serial.print(", readback failed on displays");
+        for (uint8_t digit = 0; digit < NUM_DIGITS; digit++) {
+            if (failed & (0x01 << digit)) Serial.printf(" %u", digit);
+        }
+        Serial.println();
+        // Faster clocks won't do better
+        break;
+    }
 
-            uint16_t color = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
-            if (dimming < 255) {
-                // Apply dimming
-                r = (((color >> 11) & 0x1F) * dimming) >> 8;
-                g = (((color >> 5) & 0x3F) * dimming) >> 8;
-                b = ((color & 0x1F) * dimming) >> 8;
-                color = (r << 11) | (g << 5) | b;
-            }
+    chip_select.setAll();
+    fillScreen(TFT_BLACK);
+    markAllDirty();
+    // One step below the limit, unless only the slowest step passed
+    return below != 0 ? below : highest;
+}
 
-            // Convert 2D coordinates to 1D array index
-            int32_t bufferIndex = (row + y) * TFT_WIDTH + (col + x);
-            if (bufferIndex >= 0 && bufferIndex < TFT_WIDTH * TFT_HEIGHT) {
-                UnpackedImageBuffer[bufferIndex] = color;
+// Returns the time spent pushing, without filling the strips.
+uint32_t TFTs::pushTestPattern(uint8_t pattern) {
+    uint32_t busy_us = 0;
+    bool oldSwapBytes = getSwapBytes();
+    setSwapBytes(false);
+    startPush();
+    for (int16_t y = 0; y < TFT_HEIGHT; y += PUSH_STRIP_LINES) {
+        int16_t lines = min(int16_t(PUSH_STRIP_LINES), int16_t(TFT_HEIGHT - y));
+        uint16_t* dst = PushStrip;
+        for (int16_t line = y; line < y + lines; line++) {
+            for (int16_t x = 0; x < TFT_WIDTH; x++) {
+                uint16_t color = testPattern(pattern, x, line);
+                *dst++ = (color >> 8) | (color << 8);   // the strips hold the bytes in display order
             }
         }
+        uint32_t start = micros();
+        pushImage(0, y, TFT_WIDTH, lines, PushStrip);
+        busy_us += micros() - start;
     }
-    #endif
-
-    FileInBuffer = file_index;
-    bmpFS.close();
-
-    #ifdef DEBUG_OUTPUT
-    Serial.print("img load time: ");
-    Serial.println(millis() - StartTime);
-    #endif
+    endWrite();
+    setSwapBytes(oldSwapBytes);
+    return busy_us;
+}
 
+// Reads back the first, the middle and the last line, pixel by pixel
+bool TFTs::checkTestPattern(uint8_t pattern) {
+    const int16_t lines[] = { 0, TFT_HEIGHT / 2, TFT_HEIGHT - 1 };
+    for (int16_t y : lines) {
+        for (int16_t x = 0; x < TFT_WIDTH; x++) {
+            if (readPixel(x, y) != testPattern(pattern, x, y)) return false;
+        }
+    }
     return true;
 }
+#endif
 
 // Modify DrawImage to use 1D array
-void TFTs::DrawImage(uint8_t file_index) {
+// With a delta, only its rectangles are pushed; the display must still show the image the delta starts from.
+bool TFTs::DrawImage(uint16_t file_index, const DirtyRects* delta) {
     if (!isBufferAllocated()) {
         if (!allocateImageBuffer()) {
-            return;
+            return false;
         }
     }
 
+    draw_deferred = false;
     uint32_t StartTime = millis();
     #ifdef DEBUG_OUTPUT
     Serial.println("");  
@@ -414,55 +1449,306 @@ void TFTs::DrawImage(uint8_t file_index) {
     Serial.println(file_index);  
     #endif  
 
-    if (file_index != FileInBuffer) {
+    ImageFrame* frame = image_cache.lookup(file_index);
+    if (frame == nullptr) {
         #ifdef DEBUG_OUTPUT
         Serial.println("Not preloaded; loading now...");  
         #endif  
-        LoadImageIntoBuffer(file_index);
+        if (!requireImage(file_index)) {
+            return false;
+        }
+        frame = image_cache.peek(file_index);
+    }
+
+    // A glyph of a layered face goes over its background. Without one, it is drawn on black.
+    const ImageFrame* background = nullptr;
+    if (frame->sprite) {
+        uint16_t background_index = backgroundIndex(file_index / 10);
+        background = image_cache.lookup(background_index);
+        if (background == nullptr && requireImage(background_index)) {
+            background = image_cache.peek(background_index);
+        }
+        if (draw_deferred) return false;
+        // Loading the background may have evicted the glyph
+        frame = image_cache.peek(file_index);
+        if (frame == nullptr) {
+            if (!requireImage(file_index)) return false;
+            frame = image_cache.peek(file_index);
+            background = image_cache.peek(background_index);
+        }
+    }
+
+    if (background != nullptr) {
+        active_glyph = frame;
+        dimPalette(frame, GlyphPalette);
+        pushFrame(background, delta);
+        active_glyph = nullptr;
+    }
+    else {
+        pushFrame(frame, delta);
     }
-    
-    bool oldSwapBytes = getSwapBytes();
-    setSwapBytes(true);
-    pushImage(0, 0, TFT_WIDTH, TFT_HEIGHT, UnpackedImageBuffer);
-    setSwapBytes(oldSwapBytes);
 
     #ifdef DEBUG_OUTPUT
     Serial.print("img transfer time: ");  
     Serial.println(millis() - StartTime);  
+    image_cache.printStats();
+    preloader.printStats();
+    chip_select.printStats();
+    #endif
+    return true;
+}
+
+// The file index of the background a cached image is drawn over, ImageCache::empty if it is not a glyph
+uint16_t TFTs::backgroundFor(uint16_t file_index) {
+    const ImageFrame* frame = image_cache.peek(file_index);
+    return (frame != nullptr && frame->sprite) ? backgroundIndex(file_index / 10) : ImageCache::empty;
+}
+
+void TFTs::pushFrame(const ImageFrame* frame, const DirtyRects* delta) {
+    const DirtyRects::Rect full_screen = { 0, 0, TFT_WIDTH, TFT_HEIGHT };
+    const DirtyRects::Rect* rects = &full_screen;
+    uint8_t count = 1;
+    if (delta != nullptr && !delta->full) {
+        rects = delta->rects;
+        count = delta->count;
+    }
+
+    #ifdef USE_DMA_PUSH
+    if (dma_ready) {
+        pushFrameDMA(frame, rects, count);
+        return;
+    }
+    #endif
+    if (rects == &full_screen && frame->format == ImageFrame::rgb565 && dimming == 255 &&
+        (active_overlay == nullptr || !active_overlay->isActive()) && active_glyph == nullptr &&
+        RowKernels::covers(frame, 0, 0, TFT_WIDTH, TFT_HEIGHT)) {
+        bool oldSwapBytes = getSwapBytes();
+        setSwapBytes(true);
+        startPush();
+        pushImage(0, 0, TFT_WIDTH, TFT_HEIGHT, (uint16_t*)frame->row(0));
+        endWrite();
+        setSwapBytes(oldSwapBytes);
+    } else {
+        pushFrameInStrips(frame, rects, count);
+    }
+}
+
+// Fills a strip with lines y..y+lines-1 of the columns of area, already byte-swapped for the SPI bus.
+// Indexed frames are expanded through the palette (dimmed by the caller), RGB565 frames are dimmed
+// through the lookup table. The kernel is picked once per rectangle, see RowKernels.h.
+// The glyph of a layered face is drawn over its background (the frame), and the overlay of the selected
+// displays goes on top, so image and text leave in the same transfer.
+void TFTs::fillStrip(LineKernel kernel, const ImageFrame* frame, const DirtyRects::Rect &area, int16_t y, int16_t lines, const uint16_t* palette, uint16_t* dst) {
+    const DimLut* lut = (dimming < 255) ? &dim_lut : nullptr;
+    for (int16_t line = 0; line < lines; line++, dst += area.w) {
+        kernel(frame, y + line, area.x, area.w, palette, dim_lut, dst);
+        if (active_glyph != nullptr) {
+            RowKernels::composeSprite(active_glyph, y + line, area.x, area.w, GlyphPalette, dim_lut, dimming < 255, dst);
+        }
+        if (active_overlay != nullptr) active_overlay->compose(y + line, area.x, area.w, lut, dst);
+    }
+}
+
+// The overlay on a blanked display
+void TFTs::drawOverlay(const Overlay &overlay) {
+    if (!overlay.isActive()) return;
+    const DirtyRects::Rect &area = overlay.getArea();
+    const DimLut* lut = (dimming < 255) ? &dim_lut : nullptr;
+    bool oldSwapBytes = getSwapBytes();
+    setSwapBytes(false);
+    startPush();
+    for (int16_t y = area.y; y < area.y + area.h; y++) {
+        overlay.compose(y, area.x, area.w, lut, PushStrip);
+        pushImage(area.x, y, area.w, 1, PushStrip);
+    }
+    endWrite();
+    setSwapBytes(oldSwapBytes);
+}
+
+// Number of lines of a rectangle that fit into one strip buffer.
+static int16_t stripLines(const DirtyRects::Rect &area) {
+    int16_t lines = (TFT_WIDTH * PUSH_STRIP_LINES) / area.w;
+    return (lines < area.h) ? lines : area.h;
+}
+
+void TFTs::dimPalette(const ImageFrame* frame, uint16_t* palette) {
+    if (frame->format != ImageFrame::indexed) return;
+    uint16_t colors = 1 << frame->bits;
+    for (uint16_t i = 0; i < colors; i++) {
+        palette[i] = dim_lut.apply(frame->palette[i]);
+    }
+}
+
+// The library opens the transaction at SPI_FREQUENCY. A calibrated clock goes straight into the clock register of
+// the bus: SPIClass::setFrequency() would wait for the lock the open transaction holds.
+void TFTs::startPush() {
+    startWrite();
+    #ifdef SPI_CALIBRATION
+    if (spi_frequency != SPI_FREQUENCY) WRITE_PERI_REG(SPI_CLOCK_REG(SPI_PORT), spi_clock_div);
     #endif
 }
 
+// Blocking push of the given rectangles of a frame. The cached frame stays untouched.
+void TFTs::pushFrameInStrips(const ImageFrame* frame, const DirtyRects::Rect* rects, uint8_t count) {
+    uint16_t palette[256];
+    dimPalette(frame, palette);
 
-// These read 16- and 32-bit types from the SD card file.
-// BMP data is stored little-endian, Arduino is little-endian too.
-// May need to reverse subscript order if porting elsewhere.
+    bool oldSwapBytes = getSwapBytes();
+    setSwapBytes(false);
+    startPush();
+    for (uint8_t r = 0; r < count; r++) {
+        const DirtyRects::Rect &area = rects[r];
+        LineKernel kernel = RowKernels::selectLineKernel(frame, dimming < 255, area.x, area.y, area.w, area.h);
+        int16_t strip = stripLines(area);
+        for (int16_t y = area.y; y < area.y + area.h; y += strip) {
+            int16_t lines = min(strip, int16_t(area.y + area.h - y));
+            fillStrip(kernel, frame, area, y, lines, palette, PushStrip);
+            pushImage(area.x, y, area.w, lines, PushStrip);
+        }
+    }
+    endWrite();
+    setSwapBytes(oldSwapBytes);
+}
+
+#ifdef USE_DMA_PUSH
+// Sends the rectangles of a frame strip by strip with DMA. While one strip buffer is on the bus, the next
+// strip is expanded into the other one. Returns as soon as the last strip is queued; waitForPush() is the fence.
+void TFTs::pushFrameDMA(const ImageFrame* frame, const DirtyRects::Rect* rects, uint8_t count) {
+    if (count == 0) return;
+    uint16_t palette[256];
+    dimPalette(frame, palette);
 
-uint16_t TFTs::read16(fs::File &f) {
-  uint16_t result;
-  ((uint8_t *)&result)[0] = f.read(); // LSB
-  ((uint8_t *)&result)[1] = f.read(); // MSB
-  return result;
+    bool oldSwapBytes = getSwapBytes();
+    setSwapBytes(false);
+    startPush();
+    uint8_t buffer = 0;
+    for (uint8_t r = 0; r < count; r++) {
+        const DirtyRects::Rect &area = rects[r];
+        if (r > 0) dmaWait(); // the address window must not change under a running transfer
+        setAddrWindow(area.x, area.y, area.w, area.h);
+        LineKernel kernel = RowKernels::selectLineKernel(frame, dimming < 255, area.x, area.y, area.w, area.h);
+        int16_t strip = stripLines(area);
+        for (int16_t y = area.y; y < area.y + area.h; y += strip) {
+            int16_t lines = min(strip, int16_t(area.y + area.h - y));
+            // pushPixelsDMA() waits for the previous strip, so this buffer (sent two strips ago) is free.
+            fillStrip(kernel, frame, area, y, lines, palette, PushStrips[buffer]);
+            pushPixelsDMA(PushStrips[buffer], lines * area.w);
+            buffer ^= 1;
+        }
+    }
+    setSwapBytes(oldSwapBytes);
+    dma_pending = true;
 }
+#endif
 
-uint32_t TFTs::read32(fs::File &f) {
-  uint32_t result;
-  ((uint8_t *)&result)[0] = f.read(); // LSB
-  ((uint8_t *)&result)[1] = f.read();
-  ((uint8_t *)&result)[2] = f.read();
-  ((uint8_t *)&result)[3] = f.read(); // MSB
-  return result;
+// Pushes a full screen to one display in strips, with DMA if available. fill(line, dst) writes a display line
+// in the byte order of the SPI bus; the display's overlay goes on top.
+template <typename F>
+void TFTs::pushLines(uint8_t digit, F fill) {
+    waitForPush();
+    chip_select.setDigitMap(0x01 << digit);
+    active_overlay = &overlays[digit];
+    const DimLut* lut = (dimming < 255) ? &dim_lut : nullptr;
+
+    #ifdef USE_DMA_PUSH
+    bool dma = dma_ready;
+    uint8_t buffer = 0;
+    #endif
+    bool oldSwapBytes = getSwapBytes();
+    setSwapBytes(false);
+    startPush();
+    #ifdef USE_DMA_PUSH
+    if (dma) setAddrWindow(0, 0, TFT_WIDTH, TFT_HEIGHT);
+    #endif
+    for (int16_t y = 0; y < TFT_HEIGHT; y += PUSH_STRIP_LINES) {
+        int16_t lines = min(int16_t(PUSH_STRIP_LINES), int16_t(TFT_HEIGHT - y));
+        uint16_t* strip = PushStrip;
+        #ifdef USE_DMA_PUSH
+        if (dma) strip = PushStrips[buffer];
+        #endif
+        uint16_t* dst = strip;
+        for (int16_t line = y; line < y + lines; line++, dst += TFT_WIDTH) {
+            fill(line, dst);
+            active_overlay->compose(line, 0, TFT_WIDTH, lut, dst);
+        }
+        #ifdef USE_DMA_PUSH
+        if (dma) {
+            pushPixelsDMA(strip, lines * TFT_WIDTH);
+            buffer ^= 1;
+            continue;
+        }
+        #endif
+        pushImage(0, y, TFT_WIDTH, lines, strip);
+    }
+    setSwapBytes(oldSwapBytes);
+    #ifdef USE_DMA_PUSH
+    if (dma) {
+        dma_pending = true;
+        return;
+    }
+    #endif
+    endWrite();
+}
+
+// One frame of a transition on a display, elapsed ms into it. Glyphs of layered faces are drawn over background.
+// Crossfade: both images are expanded line by line and blended. Slide: the lines come from either image.
+void TFTs::pushTransitionFrame(uint8_t digit, const ImageFrame* from, const ImageFrame* to, const ImageFrame* background,
+                               transition_t type, uint32_t elapsed) {
+    uint16_t from_palette[256], to_palette[256], background_palette[256];
+    dimPalette(from, from_palette);
+    dimPalette(to, to_palette);
+    bool dimmed = dimming < 255;
+    LineKernel from_kernel = RowKernels::selectLineKernel(from, dimmed, 0, 0, TFT_WIDTH, TFT_HEIGHT);
+    LineKernel to_kernel = RowKernels::selectLineKernel(to, dimmed, 0, 0, TFT_WIDTH, TFT_HEIGHT);
+    LineKernel background_kernel = nullptr;
+    if (background != nullptr) {
+        dimPalette(background, background_palette);
+        background_kernel = RowKernels::selectLineKernel(background, dimmed, 0, 0, TFT_WIDTH, TFT_HEIGHT);
+    }
+    uint8_t alpha = elapsed * 32 / TRANSITION_MS;
+    int16_t offset = elapsed * TFT_HEIGHT / TRANSITION_MS;
+
+    auto imageLine = [&](const ImageFrame* frame, LineKernel kernel, const uint16_t* palette, int16_t line, uint16_t* dst) {
+        if (frame->sprite && background != nullptr) {
+            background_kernel(background, line, 0, TFT_WIDTH, background_palette, dim_lut, dst);
+            RowKernels::composeSprite(frame, line, 0, TFT_WIDTH, palette, dim_lut, dimmed, dst);
+        }
+        else {
+            kernel(frame, line, 0, TFT_WIDTH, palette, dim_lut, dst);
+        }
+    };
+
+    pushLines(digit, [&](int16_t line, uint16_t* dst) {
+        if (type == transition_slide) {
+            int16_t source = line + offset;
+            if (source < TFT_HEIGHT) imageLine(from, from_kernel, from_palette, source, dst);
+            else imageLine(to, to_kernel, to_palette, source - TFT_HEIGHT, dst);
+        }
+        else {
+            uint16_t* old_line = TransitionLine + ((uintptr_t(dst) & 0x02) ? 1 : 0);
+            imageLine(to, to_kernel, to_palette, line, dst);
+            imageLine(from, from_kernel, from_palette, line, old_line);
+            RowKernels::blendLine(old_line, dst, alpha, TFT_WIDTH, dst);
+        }
+    });
+}
+
+void TFTs::waitForPush() {
+    #ifdef USE_DMA_PUSH
+    if (dma_pending) {
+        dmaWait();
+        endWrite();
+        dma_pending = false;
+    }
+    #endif
 }
 
 String TFTs::clockFaceToName(uint8_t clockFace) {
-  return patterns_str[clockFace -1];
+  return String(catalog.getName(clockFace));
 }
 
+// Face 1 if there is no face with this name
 uint8_t TFTs::nameToClockFace(String name) {
-  for(int i=0; i<9; i++) {
-    if(patterns_str[i] == name) {
-      return i+1;
-    }
-  }
-  return 1;
+  uint8_t face = catalog.find(name.c_str());
+  return (face != 0) ? face : 1;
 }
-//// END STOLEN CODE
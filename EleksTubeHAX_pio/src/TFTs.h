@@ -3,13 +3,22 @@
 
 #include "GLOBAL_DEFINES.h"
 
-// Call up the SPIFFS FLASH filing system this is part of the ESP Core
-#define FS_NO_GLOBALS
-#include <FS.h>
-#include "SPIFFS.h"  // For ESP32 only
-
 #include <TFT_eSPI.h>
 #include "ChipSelect.h"
+#include "ImageCache.h"
+#include "DirtyRects.h"
+#include "ImageReader.h"
+#include "ImageDecoder.h"
+#include "RowKernels.h"
+#include "ImageStorage.h"  // SPIFFS or LittleFS
+#include "FacePartition.h"
+#include "FacePack.h"
+#include "FaceCatalog.h"
+#include "StoredConfig.h"
+#include "PreloadPlanner.h"
+#include "DecodeWorker.h"
+#include "Overlay.h"
+#include "AnimationStream.h"
 
 class TFTs : public TFT_eSPI {
 public:
@@ -21,38 +30,103 @@ public:
   // A digit of 0xFF means blank the screen.
   const static uint8_t blanked = 255;
 
-  uint8_t dimming = 255; // amount of dimming graphics
   uint8_t current_graphic = 1;
+  // Changes current_graphic to face without a visible wipe: the images of the digits shown are decoded
+  // first (in LoadNextImage()), then all displays are redrawn at once. Returns right away.
+  void switchFace(uint8_t face);
+  bool isSwitchingFace() { return switch_face != 0; }
+  // The face that is shown, or will be once the switch is done
+  uint8_t getTargetFace() { return (switch_face != 0) ? switch_face : current_graphic; }
   
-  void begin();
+  // The face catalog is kept in stored_config (FACE_CATALOG_CACHE); without it, it is built at every boot.
+  void begin(StoredConfig *stored_config = nullptr);
   void reinit();
   void clear();
   void showNoWifiStatus();
   void showNoMqttStatus();
   void showTemperature();
+  // Status text at the bottom of a display, pushed together with its digit image. nullptr or "" removes it.
+  // Only the text band is sent when the text changes; setting the same text again does nothing.
+  void setOverlay(uint8_t digit, const char *text, uint16_t color = TFT_WHITE, uint8_t font = 2);
 
   void setDigit(uint8_t digit, uint8_t value, show_t show=yes);
+  void setDigits(const uint8_t values[NUM_DIGITS], show_t show=yes);
   uint8_t getDigit(uint8_t digit) { return digits[digit]; }
 
-  void showAllDigits() { for (uint8_t digit=0; digit < NUM_DIGITS; digit++) showDigit(digit); }
+  // How a changing digit is drawn, see DIGIT_TRANSITION
+  enum transition_t { transition_none, transition_crossfade, transition_slide };
+  void setTransition(transition_t transition_) { transition = transition_; }
+  transition_t getTransition() { return transition; }
+  // Draws the displays whose images the decode task didn't have yet when they changed. Call from loop().
+  void loopPendingDigits();
+  // Pushes the next frames of running transitions. Call from loop().
+  void loopTransitions();
+  // Pushes the frames of animated digits that are due, see ANIMATION_BUDGET_MS. Call from loop().
+  void loopAnimations();
+  // Milliseconds until a transition or animation frame is due, 0xFFFFFFFF if none is running
+  uint32_t getFrameWait();
+
+  void showAllDigits() { showDigits(0x3F); }
   void showDigit(uint8_t digit);
+  void showDigits(uint8_t map);
 
   // Controls the power to all displays
-  void enableAllDisplays() { digitalWrite(TFT_ENABLE_PIN, HIGH); enabled = true; }
-  void disableAllDisplays() { digitalWrite(TFT_ENABLE_PIN, LOW); enabled = false; }
+  void enableAllDisplays();
+  void disableAllDisplays();
   void toggleAllDisplays() { if (enabled) disableAllDisplays(); else enableAllDisplays(); }
   bool isEnabled() { return enabled; }
 
   ChipSelect chip_select;
 
+  // Consecutive digit images are pushed as dirty rectangles when the display still shows the previous one.
+  // Call markDirty() after drawing to a display directly, so its next image is pushed in full.
+  void markDirty(uint8_t digit) { ShownFile[digit] = ImageCache::empty; }
+  void markAllDirty() { for (uint8_t digit=0; digit < NUM_DIGITS; digit++) markDirty(digit); }
+  // Precomputes the changed areas between digit N and N+1 of the current clock face.
+  void buildDiffTable();
+
+  // Faces 1..NumberOfClockFaces, see FaceCatalog.h
   uint8_t NumberOfClockFaces = 0;
+  // Queues the image for value on the current clock face, to be drawn at millis() deadline.
+  void preload(uint8_t value, uint32_t deadline);
+  // Idle work: decodes the next queued image, or updates the diff table.
   void LoadNextImage();
-  void InvalidateImageInBuffer(); // force reload from Flash with new dimming settings
+  void InvalidateImageInBuffer(); // force reload from Flash
+
+  // Dimming is applied while pushing to the displays, cached images stay undimmed.
+  // Changing it only rebuilds a lookup table; redraw (show=force) to apply it to the displays.
+  void setDimming(uint8_t dimming_);
+  uint8_t getDimming() { return dimming; }
+
+  // Brightness of all displays, 255 = full. With a panel control (PANEL_BRIGHTNESS_PWM or _DCS) it ramps there
+  // in ramp_ms and the images are left alone; otherwise it sets the dimming and redraws all displays at once.
+  void setBrightness(uint8_t level, uint16_t ramp_ms = BRIGHTNESS_RAMP_MS);
+  uint8_t getBrightness() { return brightness_to; }
+  // Steps a running brightness ramp. Call from loop().
+  void loopBrightness();
+
+  // Images are pushed with DMA (USE_DMA_PUSH) and setDigit() returns while the transfer is still running.
+  // Waits until it is finished. Must be called before changing the chip select or drawing directly to the displays.
+  void waitForPush();
   
   // Memory management methods
   bool allocateImageBuffer();
   void freeImageBuffer();
-  bool isBufferAllocated() const { return UnpackedImageBuffer != nullptr; }
+  bool isBufferAllocated() const { return image_cache.isAllocated(); }
+  void printCacheStats() { image_cache.printStats(); preloader.printStats(); printAnimationStats(); chip_select.printStats(); }
+
+  #ifdef IMAGE_BENCHMARK
+  void benchmarkImageStores();
+  void benchmarkTransitions();
+  #endif
+
+  #ifdef SPI_CALIBRATION
+  // Sets the SPI clock of the pushes started with startPush(). Pushes use DMA only at SPI_FREQUENCY.
+  void setSpiFrequency(uint32_t frequency);
+  // Finds one step below the fastest SPI clock every display keeps up with (see SPI_CALIBRATION), 0 if none.
+  // Leaves the clock at the last step tried and the displays black.
+  uint32_t calibrateSpi();
+  #endif
 
   String clockFaceToName(uint8_t clockFace);
   uint8_t nameToClockFace(String name);
@@ -61,21 +135,139 @@ private:
   uint8_t digits[NUM_DIGITS];
   bool enabled;
 
-  bool FileExists(const char* path);
-  int8_t CountNumberOfClockFaces();
-  bool LoadImageIntoBuffer(uint8_t file_index);
-  void DrawImage(uint8_t file_index);
-  uint16_t read16(fs::File &f);
-  uint32_t read32(fs::File &f);
-
-  // Change to dynamic allocation
-  uint16_t* UnpackedImageBuffer = nullptr;  // Will be allocated as needed
-  size_t bufferSize = 0;  // Track allocated size
-  uint8_t FileInBuffer = 255; // invalid, always load first image
-  uint8_t NextFileRequired = 0;
-
-  String patterns_str[9] = {"1", "2", "3", "4", "5", "6", "7", "8", "9"};
-  void loadClockFacesNames();
+  uint8_t dimming = 255; // amount of dimming graphics, 255 = full brightness
+  // RGB565 channel lookup tables for the current dimming, already shifted into place and byte-swapped
+  DimLut dim_lut;
+  uint16_t PushStrip[TFT_WIDTH * PUSH_STRIP_LINES];
+  void buildDimmingLut();
+
+  uint8_t brightness = 255, brightness_from = 255, brightness_to = 255;
+  uint32_t ramp_start = 0;
+  uint16_t ramp_length = 0;
+  void applyBrightness(uint8_t level);
+  void dimPalette(const ImageFrame* frame, uint16_t* palette);
+  Overlay overlays[NUM_DIGITS];
+  const Overlay* active_overlay = nullptr;   // of the displays selected for the push
+  void drawOverlay(const Overlay &overlay);
+  // Glyph of a layered face pushed over the frame (its background), with its dimmed palette
+  const ImageFrame* active_glyph = nullptr;
+  uint16_t GlyphPalette[256];
+  void fillStrip(LineKernel kernel, const ImageFrame* frame, const DirtyRects::Rect &area, int16_t y, int16_t lines, const uint16_t* palette, uint16_t* dst);
+  void pushFrame(const ImageFrame* frame, const DirtyRects* delta);
+  void pushFrameInStrips(const ImageFrame* frame, const DirtyRects::Rect* rects, uint8_t count);
+  // startWrite() at the clock set with setSpiFrequency(); all pushes of TFTs start here, endWrite() ends them
+  void startPush();
+
+  #ifdef USE_DMA_PUSH
+  uint16_t* PushStrips[2] = { nullptr, nullptr };
+  bool dma_ready = false;
+  bool dma_pending = false;
+  void pushFrameDMA(const ImageFrame* frame, const DirtyRects::Rect* rects, uint8_t count);
+  #endif
+
+  // What each display shows right now (ImageCache::empty if unknown), to decide on delta pushes
+  uint16_t ShownFile[NUM_DIGITS];
+  uint8_t ShownDimming[NUM_DIGITS];
+  // DiffTable[n] holds the changes from digit n to digit n+1 (9 to 0) of clock face DiffTableFace
+  DirtyRects DiffTable[10];
+  uint8_t DiffTableFace = 0;
+  // GlyphDelta[n]: the glyph rectangles of digit n and the digit requested last, on a layered face
+  DirtyRects GlyphDelta[10];
+  const DirtyRects* glyphDelta(uint16_t shown, uint16_t file_index);
+
+  // A running transition of a display from image `from` to image `to`; from is ImageCache::empty if none
+  struct Transition {
+    uint16_t from, to;
+    uint32_t start, last_frame;
+    uint16_t frames;
+  };
+  Transition transitions[NUM_DIGITS];
+  transition_t transition = DIGIT_TRANSITION;
+  alignas(4) uint16_t TransitionLine[TFT_WIDTH + 1];   // a line of the old image, +1 to match the alignment of the strip line
+  uint8_t startTransitions(uint8_t map);
+  void finishTransition(uint8_t digit);
+  void pushTransitionFrame(uint8_t digit, const ImageFrame* from, const ImageFrame* to, const ImageFrame* background,
+                           transition_t type, uint32_t elapsed);
+  template <typename F> void pushLines(uint8_t digit, F fill);
+
+  // Animated digits, streamed from the file system while they are shown. The file is opened on the decode
+  // task: from animation_opening until the result is collected the stream belongs to it.
+  enum animation_state_t : uint8_t {
+    animation_off, animation_requested, animation_opening, animation_opened, animation_failed, animation_playing
+  };
+  struct Animation {
+    AnimationStream stream;
+    uint16_t file_index = ImageCache::empty;  // the animation the display should play
+    animation_state_t state = animation_off;
+    uint32_t frame;     // of the playback, pushed next
+    uint32_t due;       // millis() when it is due
+  };
+  Animation animations[NUM_DIGITS];
+  uint8_t animation_next = 0;     // display served first by the next loopAnimations()
+  uint8_t animations_opening = 0; // open requests out with the decode task
+  uint32_t animation_frames = 0, animation_dropped = 0;
+  bool isAnimated(uint8_t face, uint8_t value) { return value < 10 && (catalog.getAnimated(face) & (0x01 << value)); }
+  uint8_t startAnimations(uint8_t map);
+  void openAnimation(uint8_t digit);
+  bool pushAnimationFrame(uint8_t digit);
+  void stopAnimation(uint8_t digit);
+  void printAnimationStats();
+
+  #ifdef SPI_CALIBRATION
+  uint32_t spi_frequency = SPI_FREQUENCY;
+  uint32_t spi_clock_div = 0;   // clock register value for spi_frequency
+  void setupSpiFrequency(StoredConfig *stored_config);
+  uint32_t pushTestPattern(uint8_t pattern);
+  bool checkTestPattern(uint8_t pattern);
+  #endif
+
+  uint8_t switch_face = 0;      // face being prefetched for switchFace(), 0 if none
+  uint32_t switch_start = 0;
+  bool prefetchFace();
+  void finishFaceSwitch();
+  const DirtyRects* findDelta(uint8_t digit, uint16_t file_index);
+  bool UpdateDiffTable();
+  void readLine(const ImageFrame* frame, const ImageFrame* background, int16_t line,
+                const uint16_t* palette, const uint16_t* background_palette, uint16_t* dst);
+  void busPalette(const ImageFrame* frame, uint16_t* palette);
+
+  bool decodeImage(uint16_t file_index);
+  bool LoadImageIntoBuffer(uint16_t file_index);
+  bool prefetchImage(uint16_t file_index);
+  bool requireImage(uint16_t file_index);
+  bool draw_deferred = false;   // the last DrawImage() waits for the decode task
+  uint8_t draw_pending = 0;     // displays to draw once the decode task has their images
+  bool use_face_partition = false;
+  FacePack face_pack;         // pack of the last loaded face, kept open
+  bool DrawImage(uint16_t file_index, const DirtyRects* delta = nullptr);
+
+  // Layered faces: the digits are glyph sprites (ImageDecoder.h) over the background of the face
+  static uint16_t backgroundIndex(uint8_t face) { return FaceCatalog::backgroundIndex(face); }
+  uint16_t backgroundFor(uint16_t file_index);
+  // A file_index of ImageCache::empty blanks the displays
+  void showDigitGroup(uint8_t group, uint16_t file_index, const DirtyRects* delta);
+
+  // Decoded images, allocated in allocateImageBuffer()
+  ImageCache image_cache;
+  DecodeWorker::Frames decode_frames;
+  FsImageStorage storage;
+  ImageDecoder decoder;
+  PreloadPlanner preloader;
+
+  #ifdef USE_DECODE_TASK
+  DecodeWorker decode_worker;
+  uint16_t decode_pending[DECODE_QUEUE_LENGTH];   // file indices requested and not collected yet
+  uint8_t decode_outstanding = 0;
+  uint16_t decode_failed = ImageCache::empty;
+  const static size_t decode_frame_bytes = TFT_WIDTH * TFT_HEIGHT * sizeof(uint16_t);   // reserved per request
+  static void decodeTask(void* context, const DecodeWorker::Request &request, DecodeWorker::Result &result);
+  bool requestImage(uint16_t file_index);
+  bool isDecodePending(uint16_t file_index);
+  void collectDecodedImages();
+  #endif
+
+  FaceCatalog catalog;
+  void buildFaceCatalog(StoredConfig *stored_config);
 };
 
 extern TFTs tfts;
@@ -6,12 +6,14 @@
  */
 
 #include <stdint.h>
+#include <atomic>
 #include "GLOBAL_DEFINES.h"
 #include "Backlights.h"
 #include "TFTs.h"
 #include "Clock.h"
 #include "StoredConfig.h"
 #include "WiFi_WPS.h"
+#include "BootProfiler.h"
 #include "esp_wifi.h" 
 #include "BluetoothSerial.h"
 #include "esp_bt_main.h"
@@ -59,25 +61,52 @@ const unsigned long BT_CHECK_INTERVAL = 100; // Check every 5 seconds
 
 // Helper function, defined below.
 void updateClockDisplay(TFTs::show_t show=TFTs::yes);
+void planPreloads(void);
+void updateNightMode(void);
 void setupMenu(void);
 void UpdateDstEveryNight(void);
+void switchToBluetooth(void);
 void callback(esp_spp_cb_event_t event, esp_spp_cb_param_t *param);
 
+BootProfiler  boot_profile("Boot");
+// Loop task only: the boot task (FAST_BOOT) still has to be finished
+bool          boot_task_running = false;
+#ifdef FAST_BOOT
+// Set by the boot task, the results before boot_task_done
+bool          boot_ntp_ok     = false;
+time_t        boot_ntp_time   = 0;
+uint32_t      boot_ntp_millis = 0;
+std::atomic<bool> boot_task_done(false);
+void bootNetwork(void);
+void bootTask(void *param);
+void finishBoot(void);
+#endif
+
 void setup() {
   Serial.begin(115200);
+#ifndef FAST_BOOT
   delay(500);  // Waiting for serial monitor to catch up.
+#endif
   Serial.println("");
   Serial.println(FIRMWARE_VERSION);
   Serial.println(F("In setup()."));  
 
+  boot_profile.phase("config");
   stored_config.begin();
   stored_config.load();
 
+  boot_profile.phase("backlights");
   backlights.begin(&stored_config.config.backlights);
 
   // Setup the displays (TFTs) initaly and show bootup message(s)
-  tfts.begin();  // and count number of clock faces available
+  boot_profile.phase("displays+faces");
+  tfts.begin(&stored_config);  // and count number of clock faces available
   tfts.fillScreen(TFT_BLACK);
+#ifdef FAST_BOOT
+  // The time comes from the RTC, NTP follows on the boot task.
+  boot_profile.phase("clock");
+  uclock.begin(&stored_config.config.uclock, true);
+#else
   tfts.setTextColor(TFT_WHITE, TFT_BLACK);
   tfts.setCursor(0, 0, 2);  // Font 2. 16 pixel high
   tfts.println(F("Begin Setup..."));
@@ -85,6 +114,7 @@ void setup() {
   tfts.println(F("WiFi Start"));
   WiFi.mode(WIFI_STA);
 
+  boot_profile.phase("network wait");
   tfts.println(F("Waiting for network."));
   // wait for a bit before querying NTP
   for (uint8_t ndx=0; ndx < 5; ndx++) {
@@ -94,9 +124,12 @@ void setup() {
   tfts.println("");
 
   // Setup clock and sync time
+  boot_profile.phase("clock");
   tfts.println(F("Clock Start"));
   uclock.begin(&stored_config.config.uclock);
+#endif
 
+  boot_profile.phase("diff table");
   if (uclock.getActiveGraphicIdx() > tfts.NumberOfClockFaces) {
     uclock.setActiveGraphicIdx(tfts.NumberOfClockFaces);
     Serial.println(F("Last selected index of clock face is larger than currently available number of image sets."));
@@ -106,8 +139,28 @@ void setup() {
     Serial.println(F("Last selected index of clock face is less than 1."));
   }
   tfts.current_graphic = uclock.getActiveGraphicIdx();
+#ifdef IMAGE_BENCHMARK
+  tfts.benchmarkImageStores();
+  tfts.benchmarkTransitions();
+#endif
+  tfts.buildDiffTable();
 
   SerialBT.register_callback(callback);
+#ifdef FAST_BOOT
+  boot_profile.phase("first digits");
+  uclock.loop();
+  updateClockDisplay(TFTs::force);
+  tfts.waitForPush();
+  if (uclock.isTimeValid()) BootProfiler::digitsShown("RTC");
+
+  boot_profile.phase("boot task");
+  boot_task_running = true;
+  if (xTaskCreatePinnedToCore(bootTask, "boot", BOOT_TASK_STACK, nullptr, BOOT_TASK_PRIORITY, nullptr, 0) != pdPASS) {
+    Serial.println(F("Boot task not started, starting the network here."));
+    bootNetwork();
+  }
+#else
+  boot_profile.phase("bluetooth");
       // Configure Bluetooth parameters
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
     bt_cfg.mode = ESP_BT_MODE_CLASSIC_BT;
@@ -130,26 +183,76 @@ void setup() {
   tfts.println("Wrapping up...");
 
   // Leave boot up messages on screen for a few seconds.
+  boot_profile.phase("messages");
   for (uint8_t ndx=0; ndx < 10; ndx++) {
     tfts.print(".");
     delay(200);
   }
   // Start up the clock displays.
+  boot_profile.phase("first digits");
   tfts.fillScreen(TFT_BLACK);
   uclock.loop();
   updateClockDisplay(TFTs::force);
+  tfts.waitForPush();
+  if (Clock::hasNtpTime()) BootProfiler::timeConfirmed(0);
+  if (uclock.isTimeValid()) BootProfiler::digitsShown(Clock::hasNtpTime() ? "NTP" : "RTC");
+#endif
+  boot_profile.finish();
   Serial.println(F("Setup finished."));
 }
 
+#ifdef FAST_BOOT
+// NTP and Bluetooth, on the boot task while loop() already shows the time from the RTC.
+// The results are taken over by finishBoot() on the loop task.
+void bootNetwork() {
+  BootProfiler profile("Boot task");
+  profile.phase("ntp");
+  boot_ntp_ok = Clock::queryNtp(boot_ntp_time);
+  boot_ntp_millis = millis();
+  profile.phase("bluetooth");
+  switchToBluetooth();
+  profile.finish();
+  boot_task_done = true;
+}
+
+void bootTask(void *param) {
+  bootNetwork();
+  vTaskDelete(nullptr);
+}
+
+// Once the boot task is done: sets the NTP time, starts the hourly sync and redraws the digits that were off.
+void finishBoot() {
+  if (!boot_task_running || !boot_task_done) return;
+  boot_task_running = false;
+  if (boot_ntp_ok) {
+    time_t ntp_now = boot_ntp_time + (millis() - boot_ntp_millis) / 1000;
+    if (uclock.isTimeValid()) BootProfiler::timeConfirmed(int32_t(ntp_now - now()));
+    else BootProfiler::timeConfirmed(INT32_MAX);
+    setTime(ntp_now);
+  }
+  uclock.startSync();
+  uclock.loop();
+  updateClockDisplay();
+  tfts.waitForPush();
+  if (uclock.isTimeValid()) BootProfiler::digitsShown(boot_ntp_ok ? "NTP" : "RTC");
+}
+#endif
+
 void loop() {
 
   uint32_t millis_at_top = millis();
+#ifdef FAST_BOOT
+  finishBoot();
+#endif
   // Do all the maintenance work
   //WifiReconnect(); // if not connected attempt to reconnect
   backlights.loop();
   uclock.loop();
+  updateNightMode();
+  tfts.loopBrightness();
 
-    if (SerialBT.available()) {
+    // Bluetooth is started by the boot task with FAST_BOOT
+    if (!boot_task_running && SerialBT.available()) {
         String message = SerialBT.readStringUntil('\n');  // Read until newline
         int16_t value = (int16_t)message.toInt();
         backlights.adjustColorPhase(value);
@@ -161,24 +264,33 @@ void loop() {
     }
 
 
+  // A new clock face is prefetched in the idle time below, then shown on all displays at once.
+  if (uclock.getActiveGraphicIdx() != tfts.getTargetFace()) {
+    tfts.switchFace(uclock.getActiveGraphicIdx());
+  }
+
   // Update the clock.
   updateClockDisplay();
+  tfts.loopPendingDigits();
+  tfts.loopTransitions();
+  tfts.loopAnimations();
+  planPreloads();
   
   UpdateDstEveryNight();
 
   uint32_t time_in_loop = millis() - millis_at_top;
   if (time_in_loop < 20) {
-    // we have free time, spend it for loading next image into buffer
+    // we have free time, spend it for loading the next images into the cache
     tfts.LoadNextImage();
 
     // we still have extra time
     time_in_loop = millis() - millis_at_top;
     if (time_in_loop < 20) {
       
-      // Sleep for up to 20ms, less if we've spent time doing stuff above.
+      // Sleep for up to 20ms, less if we've spent time doing stuff above or a transition or animation frame is due.
       time_in_loop = millis() - millis_at_top;
       if (time_in_loop < 20) {
-        delay(20 - time_in_loop);
+        delay(min(20 - time_in_loop, tfts.getFrameWait()));
       }
     }
   }
@@ -193,6 +305,8 @@ void loop() {
 
 
 void setupMenu() {
+  tfts.waitForPush();
+  tfts.markDirty(HOURS_TENS);
   tfts.chip_select.setHoursTens();
   tfts.setTextColor(TFT_WHITE, TFT_BLACK);
   tfts.fillRect(0, 120, 135, 120, TFT_BLACK);
@@ -211,6 +325,15 @@ bool isNightTime(uint8_t current_hour) {
 }
 
 
+// Dims the displays between NIGHT_TIME and DAY_TIME. The first call after boot doesn't ramp.
+void updateNightMode() {
+  static int8_t night = -1;
+  bool is_night = isNightTime(uclock.getHour24());
+  if (night == is_night) return;
+  tfts.setBrightness(is_night ? TFT_DIMMED_INTENSITY : 255, (night < 0) ? 0 : BRIGHTNESS_RAMP_MS);
+  night = is_night;
+}
+
 void UpdateDstEveryNight() {
   uint8_t currentDay = uclock.getDay();
   // This `DstNeedsUpdate` is True between 3:00:05 and 3:00:59. Has almost one minute of time slot to fetch updates, incl. eventual retries.
@@ -224,13 +347,28 @@ void UpdateDstEveryNight() {
 }
 
 void updateClockDisplay(TFTs::show_t show) {
-  // refresh starting on seconds
-  tfts.setDigit(SECONDS_ONES, uclock.getSecondsOnes(), show);
-  tfts.setDigit(SECONDS_TENS, uclock.getSecondsTens(), show);
-  tfts.setDigit(MINUTES_ONES, uclock.getMinutesOnes(), show);
-  tfts.setDigit(MINUTES_TENS, uclock.getMinutesTens(), show);
-  tfts.setDigit(HOURS_ONES, uclock.getHoursOnes(), show);
-  tfts.setDigit(HOURS_TENS, uclock.getHoursTens(), show);
+  // All digits are handed over at once, so equal digits (11:11:11) are sent to their displays in one transfer.
+  uint8_t values[NUM_DIGITS];
+  uclock.getDigitsAt(uclock.local_time, values);
+  tfts.setDigits(values, show);
+}
+
+// Once per tick, queues the images of the digits that change within PRELOAD_HORIZON_S,
+// with the time they will be drawn. The seconds come first, they are drawn first.
+void planPreloads() {
+  static time_t planned = 0;
+  if (uclock.local_time == planned) return;
+  planned = uclock.local_time;
+
+  Clock::DigitChange changes[NUM_DIGITS];
+  uclock.getNextChanges(PRELOAD_HORIZON_S, changes);
+  const uint8_t order[NUM_DIGITS] = { SECONDS_ONES, SECONDS_TENS, MINUTES_ONES, MINUTES_TENS, HOURS_ONES, HOURS_TENS };
+  for (uint8_t i = 0; i < NUM_DIGITS; i++) {
+    const Clock::DigitChange &change = changes[order[i]];
+    if (change.seconds > 0) {
+      tfts.preload(change.value, uclock.getTickMillis() + change.seconds * 1000);
+    }
+  }
 }
 
 
@@ -0,0 +1,707 @@
+/*
+ * clktool - host side helper for preparing clock face images.
+ *
+ * Build:
+ *   g++ -O2 -std=c++11 -o clktool clktool.cpp
+ *
+ * Commands:
+ *   clktool encode [--rgb565] <image.bmp...>
+ *     Converts BMP files (32/24 bit or 1/4/8 bit paletted) into compressed CLK v2 files next to them (10.bmp -> 10.clk).
+ *     Images with at most 256 colors are stored as 8 bit palette indices, others as RGB565;
+ *     --rgb565 forces the latter. Every file is decoded again and compared before it is written.
+ *
+ *   clktool pack <output.face> <name> <image files...>
+ *     Packs the ten digit images of a clock face into one file for SPIFFS (see EleksTubeHAX_pio/src/FacePack.h).
+ *     The digit is the last digit of the file name (10.clk -> 0). Name the output after the face number:
+ *       clktool pack ../data/1.face "Nixie Tube" 1?.clk
+ *     The background of a layered face is named after the face (1bg.clk).
+ *
+ *   clktool layer [--rgb565] <face> <digit images.bmp...>
+ *     Turns the digit images of a face into a layered face (see EleksTubeHAX_pio/src/ImageDecoder.h): one
+ *     background, the most common color of every pixel over all digits, and per digit a glyph sprite, the
+ *     smallest rectangle that differs from the background. Writes <face>bg.clk and <face>0.clk ... <face>9.clk
+ *     next to the first image, replacing the digit files of the face. Every digit is put together again and
+ *     compared with the original before anything is written:
+ *       clktool layer 1 1?.bmp && clktool pack ../data/1.face "Nixie Tube" 1bg.clk 1?.clk
+ *
+ *   clktool animate [--rgb565] <output.ani> <frame ms> <idle frames.bmp...> [--change <change frames.bmp...>]
+ *     Builds an animated digit (see EleksTubeHAX_pio/src/AnimationStream.h): the idle frames loop while the
+ *     digit is shown, the change frames play once when it appears. All frames must have the same size.
+ *     Name the output after the file index of the digit: 10.ani replaces 10.bmp of face 1.
+ *
+ *   clktool partition <output.bin> <image files...>
+ *     Packs BMP/CLK files into an image for the "faces" flash partition
+ *     (see EleksTubeHAX_pio/partition_noOta_2Mapp_1Mfaces_1Mspiffs.csv and src/FacePartition.h).
+ *     The file index is taken from the file name: 10.bmp -> 10, the background 1bg.clk -> 0x8001.
+ *     Flash it to the partition offset, e.g.:
+ *       cd EleksTubeHAX_pio/data
+ *       clktool partition ../faces.bin *.bmp
+ *       esptool.py --chip esp32 write_flash 0x1F0000 ../faces.bin
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+static bool readFile(const char *path, std::vector<uint8_t> &out) {
+  FILE *f = fopen(path, "rb");
+  if (f == nullptr) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  out.resize(size > 0 ? size : 0);
+  bool ok = out.empty() || fread(out.data(), 1, out.size(), f) == out.size();
+  fclose(f);
+  if (!ok) fprintf(stderr, "Can't read %s\n", path);
+  return ok;
+}
+
+static bool writeFile(const char *path, const std::vector<uint8_t> &data) {
+  FILE *f = fopen(path, "wb");
+  if (f == nullptr) {
+    fprintf(stderr, "Can't create %s\n", path);
+    return false;
+  }
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  fclose(f);
+  if (!ok) fprintf(stderr, "Can't write %s\n", path);
+  return ok;
+}
+
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t(get16(p + 2)) << 16); }
+
+static void put16(std::vector<uint8_t> &v, size_t pos, uint16_t x) {
+  v[pos] = x & 0xFF;
+  v[pos + 1] = x >> 8;
+}
+
+static void put32(std::vector<uint8_t> &v, size_t pos, uint32_t x) {
+  put16(v, pos, x & 0xFFFF);
+  put16(v, pos + 2, x >> 16);
+}
+
+static void append16(std::vector<uint8_t> &v, uint16_t x) {
+  v.push_back(x & 0xFF);
+  v.push_back(x >> 8);
+}
+
+static uint16_t rgb565(uint8_t r, uint8_t g, uint8_t b) {
+  return ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+}
+
+// A BMP converted to RGB565, rows top-down.
+struct Image {
+  int width = 0, height = 0;
+  std::vector<uint16_t> pixels;
+};
+
+static bool loadBmp(const char *path, Image &img) {
+  std::vector<uint8_t> file;
+  if (!readFile(path, file)) return false;
+  if (file.size() < 54 || file[0] != 'B' || file[1] != 'M') {
+    fprintf(stderr, "%s: not a BMP file\n", path);
+    return false;
+  }
+  uint32_t data_offset = get32(&file[10]);
+  uint32_t header_size = get32(&file[14]);
+  int32_t w = (int32_t)get32(&file[18]);
+  int32_t h = (int32_t)get32(&file[22]);
+  uint16_t bits = get16(&file[28]);
+  uint32_t compression = get32(&file[30]);
+  uint32_t palette_size = get32(&file[46]);
+  bool top_down = h < 0;
+  if (top_down) h = -h;
+  // 32 bit images from editors usually come as BI_BITFIELDS with the standard BGRA masks.
+  bool bgra = (bits == 32 && (compression == 0 || compression == 3));
+  if ((compression != 0 && !bgra) || (bits != 32 && bits != 24 && bits != 8 && bits != 4 && bits != 1) || w <= 0 || h <= 0 || w > 512 || h > 512) {
+    fprintf(stderr, "%s: unsupported BMP (%d x %d, %u bit, compression %u)\n", path, w, h, bits, compression);
+    return false;
+  }
+  if (bits <= 8 && (palette_size == 0 || palette_size > (1u << bits))) palette_size = 1u << bits;
+
+  uint32_t line_size = ((bits * w + 31) / 32) * 4;
+  if (data_offset + line_size * h > file.size() || (bits <= 8 && 14 + header_size + palette_size * 4 > file.size())) {
+    fprintf(stderr, "%s: truncated BMP\n", path);
+    return false;
+  }
+  uint16_t palette[256] = {0};
+  for (uint32_t i = 0; bits <= 8 && i < palette_size; i++) {
+    const uint8_t *c = &file[14 + header_size + i * 4];
+    palette[i] = rgb565(c[2], c[1], c[0]);
+  }
+
+  img.width = w;
+  img.height = h;
+  img.pixels.resize(w * h);
+  for (int row = 0; row < h; row++) {
+    const uint8_t *line = &file[data_offset + line_size * (top_down ? row : h - 1 - row)];
+    for (int col = 0; col < w; col++) {
+      uint16_t color;
+      if (bits == 32) {
+        color = rgb565(line[col * 4 + 2], line[col * 4 + 1], line[col * 4]);
+      } else if (bits == 24) {
+        color = rgb565(line[col * 3 + 2], line[col * 3 + 1], line[col * 3]);
+      } else {
+        uint32_t bit = col * bits;
+        uint8_t index = (line[bit / 8] >> (8 - bits - bit % 8)) & ((1 << bits) - 1);
+        color = palette[index];
+      }
+      img.pixels[row * w + col] = color;
+    }
+  }
+  return true;
+}
+
+// CLK v2 row packets: control byte c < 128 -> c+1 literal pixels follow, c >= 128 -> one pixel repeated c-126 times.
+// Must match RowKernels::unpackRow() in EleksTubeHAX_pio/src/RowKernels.h.
+template <typename T>
+static void packRow(const T *src, int count, std::vector<uint8_t> &out) {
+  // A repeat packet pays off from 2 pixels for RGB565, from 3 for 8 bit indices.
+  const int min_run = (sizeof(T) == 2) ? 2 : 3;
+  auto emit = [&](const T *p, int n) {
+    for (int i = 0; i < n; i++) {
+      out.push_back(p[i] & 0xFF);
+      if (sizeof(T) == 2) out.push_back(p[i] >> 8);
+    }
+  };
+  int literal_start = 0, i = 0;
+  auto flushLiteral = [&](int end) {
+    while (literal_start < end) {
+      int n = std::min(end - literal_start, 128);
+      out.push_back(n - 1);
+      emit(src + literal_start, n);
+      literal_start += n;
+    }
+  };
+  while (i < count) {
+    int run = 1;
+    while (i + run < count && run < 129 && src[i + run] == src[i]) run++;
+    if (run >= min_run) {
+      flushLiteral(i);
+      out.push_back(run + 126);
+      emit(src + i, 1);
+      i += run;
+      literal_start = i;
+    } else {
+      i += run;
+    }
+  }
+  flushLiteral(count);
+}
+
+template <typename T>
+static bool unpackRow(const uint8_t *src, size_t len, T *dst, int count) {
+  const uint8_t *end = src + len;
+  while (count > 0) {
+    if (src >= end) return false;
+    uint8_t c = *src++;
+    int run = (c < 128) ? c + 1 : c - 126;
+    int n = (c < 128) ? run : 1;
+    if (run > count || src + n * sizeof(T) > end) return false;
+    for (int i = 0; i < run; i++) {
+      const uint8_t *p = src + ((c < 128) ? i : 0) * sizeof(T);
+      dst[i] = (sizeof(T) == 2) ? get16(p) : p[0];
+    }
+    src += n * sizeof(T);
+    dst += run;
+    count -= run;
+  }
+  return src == end;
+}
+
+// Decodes a CLK v2 file back to RGB565, to check the encoder.
+static bool decodeClk2(const std::vector<uint8_t> &clk, Image &img) {
+  if (clk.size() < 10 || clk[0] != 'C' || clk[1] != '2') return false;
+  uint8_t format = clk[3];
+  img.width = get16(&clk[4]);
+  img.height = get16(&clk[6]);
+  uint16_t palette_size = get16(&clk[8]);
+  size_t pos = 10 + palette_size * 2;
+  if (pos > clk.size()) return false;
+  img.pixels.resize(img.width * img.height);
+  std::vector<uint8_t> indices(img.width);
+  for (int row = 0; row < img.height; row++) {
+    if (pos + 2 > clk.size()) return false;
+    uint16_t len = get16(&clk[pos]);
+    pos += 2;
+    if (pos + len > clk.size()) return false;
+    uint16_t *dst = &img.pixels[row * img.width];
+    if (format == 0) {
+      if (!unpackRow<uint16_t>(&clk[pos], len, dst, img.width)) return false;
+    } else {
+      if (!unpackRow<uint8_t>(&clk[pos], len, indices.data(), img.width)) return false;
+      for (int col = 0; col < img.width; col++) {
+        if (indices[col] >= palette_size) return false;
+        dst[col] = get16(&clk[10 + indices[col] * 2]);
+      }
+    }
+    pos += len;
+  }
+  return pos == clk.size();
+}
+
+// The colors of pixels, sorted, or none if there are more than 256.
+static std::vector<uint16_t> findPalette(const std::vector<uint16_t> &pixels) {
+  std::vector<uint16_t> palette;
+  for (uint16_t color : pixels) {
+    if (std::find(palette.begin(), palette.end(), color) != palette.end()) continue;
+    if (palette.size() == 256) return std::vector<uint16_t>();
+    palette.push_back(color);
+  }
+  // Most frequent colors don't matter for RLE, but a sorted palette makes the output reproducible.
+  std::sort(palette.begin(), palette.end());
+  return palette;
+}
+
+// CLK v2 rows: indices into palette, or RGB565 if it is empty.
+static void appendRows(const Image &img, const std::vector<uint16_t> &palette, std::vector<uint8_t> &out) {
+  std::vector<uint8_t> indices(img.width);
+  std::vector<uint8_t> packed;
+  for (int row = 0; row < img.height; row++) {
+    const uint16_t *line = &img.pixels[row * img.width];
+    packed.clear();
+    if (!palette.empty()) {
+      for (int col = 0; col < img.width; col++) {
+        indices[col] = std::lower_bound(palette.begin(), palette.end(), line[col]) - palette.begin();
+      }
+      packRow<uint8_t>(indices.data(), img.width, packed);
+    } else {
+      packRow<uint16_t>(line, img.width, packed);
+    }
+    append16(out, packed.size());
+    out.insert(out.end(), packed.begin(), packed.end());
+  }
+}
+
+static std::vector<uint8_t> encodeClk2(const Image &img, bool force_rgb565) {
+  std::vector<uint16_t> palette;
+  if (!force_rgb565) palette = findPalette(img.pixels);
+  bool indexed = !palette.empty();
+
+  std::vector<uint8_t> out = {'C', '2', 2, uint8_t(indexed ? 1 : 0)};
+  append16(out, img.width);
+  append16(out, img.height);
+  append16(out, palette.size());
+  for (uint16_t color : palette) append16(out, color);
+  appendRows(img, palette, out);
+  return out;
+}
+
+static int cmdEncode(int argc, char **argv) {
+  bool force_rgb565 = false;
+  int converted = 0;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--rgb565") == 0) {
+      force_rgb565 = true;
+      continue;
+    }
+    Image img, check;
+    if (!loadBmp(argv[i], img)) return 1;
+    std::vector<uint8_t> clk = encodeClk2(img, force_rgb565);
+    if (!decodeClk2(clk, check) || check.pixels != img.pixels) {
+      fprintf(stderr, "%s: encoded image does not decode to the original\n", argv[i]);
+      return 1;
+    }
+    std::string out_path = argv[i];
+    size_t dot = out_path.find_last_of('.');
+    size_t slash = out_path.find_last_of("/\\");
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) out_path.erase(dot);
+    out_path += ".clk";
+    if (!writeFile(out_path.c_str(), clk)) return 1;
+    printf("%s: %d x %d, %s, %zu bytes (raw RGB565: %d)\n", out_path.c_str(), img.width, img.height,
+           clk[3] ? "8 bit palette" : "RGB565", clk.size(), img.width * img.height * 2);
+    converted++;
+  }
+  if (converted == 0) {
+    fprintf(stderr, "usage: clktool encode [--rgb565] <image.bmp...>\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Decodes frame index of an animation back to RGB565, to check the encoder.
+static bool decodeAnimationFrame(const std::vector<uint8_t> &ani, int index, Image &img) {
+  uint8_t format = ani[3];
+  img.width = get16(&ani[4]);
+  img.height = get16(&ani[6]);
+  uint16_t palette_size = get16(&ani[8]);
+  size_t pos = get32(&ani[16 + palette_size * 2 + index * 4]);
+  img.pixels.resize(img.width * img.height);
+  std::vector<uint8_t> indices(img.width);
+  for (int row = 0; row < img.height; row++) {
+    if (pos + 2 > ani.size()) return false;
+    uint16_t len = get16(&ani[pos]);
+    pos += 2;
+    if (pos + len > ani.size()) return false;
+    uint16_t *dst = &img.pixels[row * img.width];
+    if (format == 0) {
+      if (!unpackRow<uint16_t>(&ani[pos], len, dst, img.width)) return false;
+    } else {
+      if (!unpackRow<uint8_t>(&ani[pos], len, indices.data(), img.width)) return false;
+      for (int col = 0; col < img.width; col++) {
+        if (indices[col] >= palette_size) return false;
+        dst[col] = get16(&ani[16 + indices[col] * 2]);
+      }
+    }
+    pos += len;
+  }
+  return true;
+}
+
+static int cmdAnimate(int argc, char **argv) {
+  bool force_rgb565 = (argc > 0 && strcmp(argv[0], "--rgb565") == 0);
+  if (force_rgb565) {
+    argc--;
+    argv++;
+  }
+  std::vector<Image> idle, change;
+  int frame_ms = (argc >= 2) ? atoi(argv[1]) : 0;
+  bool changing = false;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--change") == 0) {
+      changing = true;
+      continue;
+    }
+    Image img;
+    if (!loadBmp(argv[i], img)) return 1;
+    (changing ? change : idle).push_back(img);
+  }
+  if (idle.empty() || frame_ms <= 0 || frame_ms > 65535) {
+    fprintf(stderr, "usage: clktool animate [--rgb565] <output.ani> <frame ms> <idle frames.bmp...> [--change <change frames.bmp...>]\n");
+    return 1;
+  }
+
+  // Change frames first, as in the file
+  std::vector<Image> frames(change);
+  frames.insert(frames.end(), idle.begin(), idle.end());
+  std::vector<uint16_t> all_pixels;
+  for (const Image &img : frames) {
+    if (img.width != frames[0].width || img.height != frames[0].height) {
+      fprintf(stderr, "All frames must be %d x %d\n", frames[0].width, frames[0].height);
+      return 1;
+    }
+    all_pixels.insert(all_pixels.end(), img.pixels.begin(), img.pixels.end());
+  }
+  std::vector<uint16_t> palette;
+  if (!force_rgb565) palette = findPalette(all_pixels);
+
+  std::vector<uint8_t> out = {'C', 'A', 1, uint8_t(palette.empty() ? 0 : 1)};
+  append16(out, frames[0].width);
+  append16(out, frames[0].height);
+  append16(out, palette.size());
+  append16(out, frame_ms);
+  append16(out, change.size());
+  append16(out, idle.size());
+  for (uint16_t color : palette) append16(out, color);
+  size_t offsets = out.size();
+  out.resize(out.size() + frames.size() * 4);
+  for (size_t i = 0; i < frames.size(); i++) {
+    put32(out, offsets + i * 4, out.size());
+    appendRows(frames[i], palette, out);
+  }
+
+  for (size_t i = 0; i < frames.size(); i++) {
+    Image check;
+    if (!decodeAnimationFrame(out, i, check) || check.pixels != frames[i].pixels) {
+      fprintf(stderr, "%s: frame %zu does not decode to the original\n", argv[0], i);
+      return 1;
+    }
+  }
+  if (!writeFile(argv[0], out)) return 1;
+  printf("%s: %d x %d, %s, %zu change + %zu idle frames every %d ms, %zu bytes (%zu per frame)\n", argv[0],
+         frames[0].width, frames[0].height, palette.empty() ? "RGB565" : "8 bit palette",
+         change.size(), idle.size(), frame_ms, out.size(), out.size() / frames.size());
+  return 0;
+}
+
+// Backgrounds of layered faces are kept apart from the digits (FaceCatalog.h)
+static const int background_bit = 0x8000;
+
+// "some/dir/42.bmp" -> 42, the background "some/dir/4bg.clk" -> background_bit | 4, or -1 if the name is not a number.
+static int fileIndexFromName(const std::string &path) {
+  size_t slash = path.find_last_of("/\\");
+  std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+  size_t dot = name.find('.');
+  if (dot != std::string::npos) name = name.substr(0, dot);
+  bool background = name.size() > 2 && name.compare(name.size() - 2, 2, "bg") == 0;
+  if (background) name.resize(name.size() - 2);
+  if (name.empty() || name.size() > 5 || name.find_first_not_of("0123456789") != std::string::npos) return -1;
+  int number = atoi(name.c_str());
+  if (background) return (number >= 1 && number <= 255) ? background_bit | number : -1;
+  return (number < background_bit) ? number : -1;
+}
+
+// Format byte of a face pack entry, from the magic number of the file.
+static int imageFormat(const std::vector<uint8_t> &data) {
+  if (data.size() < 2) return -1;
+  if (data[0] == 'B' && data[1] == 'M') return 0;
+  if (data[0] == 'C' && data[1] == 'K') return 1;
+  if (data[0] == 'C' && data[1] == '2') return 2;
+  if (data[0] == 'C' && data[1] == 'S') return 3;
+  return -1;
+}
+
+// Glyph sprite of a layered face: "CS" header with its position on the background, then a CLK v2 image.
+static std::vector<uint8_t> encodeSprite(const Image &glyph, int x, int y, const Image &background, bool force_rgb565) {
+  std::vector<uint8_t> out = {'C', 'S', 1, 0};
+  append16(out, x);
+  append16(out, y);
+  append16(out, background.width);
+  append16(out, background.height);
+  std::vector<uint8_t> clk = encodeClk2(glyph, force_rgb565);
+  out.insert(out.end(), clk.begin(), clk.end());
+  return out;
+}
+
+static int cmdLayer(int argc, char **argv) {
+  bool force_rgb565 = (argc > 0 && strcmp(argv[0], "--rgb565") == 0);
+  if (force_rgb565) {
+    argc--;
+    argv++;
+  }
+  int face = (argc >= 2) ? atoi(argv[0]) : 0;
+  if (face < 1 || face > 255) {
+    fprintf(stderr, "usage: clktool layer [--rgb565] <face> <digit images.bmp...>\n");
+    return 1;
+  }
+  Image digits[10];
+  int count = 0;
+  size_t original_bytes = 0;
+  for (int i = 1; i < argc; i++) {
+    int file_index = fileIndexFromName(argv[i]);
+    if (file_index < 0 || (file_index & background_bit)) {
+      fprintf(stderr, "Skipping %s: file name is not a digit number\n", argv[i]);
+      continue;
+    }
+    Image &img = digits[file_index % 10];
+    if (!img.pixels.empty()) {
+      fprintf(stderr, "%s: digit %d given twice\n", argv[i], file_index % 10);
+      return 1;
+    }
+    std::vector<uint8_t> file;
+    if (!loadBmp(argv[i], img) || !readFile(argv[i], file)) return 1;
+    original_bytes += file.size();
+    count++;
+  }
+  const Image *first = nullptr;
+  for (const Image &img : digits) {
+    if (img.pixels.empty()) continue;
+    if (first == nullptr) first = &img;
+    if (img.width != first->width || img.height != first->height) {
+      fprintf(stderr, "All digits must be %d x %d\n", first->width, first->height);
+      return 1;
+    }
+  }
+  if (count < 2) {
+    fprintf(stderr, "A layered face needs at least two digits\n");
+    return 1;
+  }
+
+  // Background: the color most digits have at each pixel
+  Image background;
+  background.width = first->width;
+  background.height = first->height;
+  background.pixels.resize(first->pixels.size());
+  for (size_t p = 0; p < background.pixels.size(); p++) {
+    int best_votes = 0;
+    for (const Image &a : digits) {
+      if (a.pixels.empty()) continue;
+      int votes = 0;
+      for (const Image &b : digits) votes += (!b.pixels.empty() && b.pixels[p] == a.pixels[p]);
+      if (votes > best_votes) {
+        best_votes = votes;
+        background.pixels[p] = a.pixels[p];
+      }
+    }
+  }
+
+  std::string dir = argv[1];
+  size_t slash = dir.find_last_of("/\\");
+  dir = (slash == std::string::npos) ? "" : dir.substr(0, slash + 1);
+  std::vector<std::pair<std::string, std::vector<uint8_t>>> outputs;
+  Image check;
+  std::vector<uint8_t> clk = encodeClk2(background, force_rgb565);
+  if (!decodeClk2(clk, check) || check.pixels != background.pixels) {
+    fprintf(stderr, "Background does not decode to the original\n");
+    return 1;
+  }
+  outputs.push_back(std::make_pair(dir + std::to_string(face) + "bg.clk", clk));
+
+  for (int digit = 0; digit < 10; digit++) {
+    const Image &img = digits[digit];
+    if (img.pixels.empty()) continue;
+    // Smallest rectangle that differs from the background; a digit that doesn't gets one background pixel
+    int x0 = img.width, y0 = img.height, x1 = -1, y1 = -1;
+    for (int y = 0; y < img.height; y++) {
+      for (int x = 0; x < img.width; x++) {
+        if (img.pixels[y * img.width + x] == background.pixels[y * img.width + x]) continue;
+        x0 = std::min(x0, x);
+        y0 = std::min(y0, y);
+        x1 = std::max(x1, x);
+        y1 = std::max(y1, y);
+      }
+    }
+    if (x1 < 0) x0 = y0 = x1 = y1 = 0;
+    Image glyph;
+    glyph.width = x1 - x0 + 1;
+    glyph.height = y1 - y0 + 1;
+    for (int y = y0; y <= y1; y++) {
+      glyph.pixels.insert(glyph.pixels.end(), img.pixels.begin() + y * img.width + x0, img.pixels.begin() + y * img.width + x1 + 1);
+    }
+    std::vector<uint8_t> sprite = encodeSprite(glyph, x0, y0, background, force_rgb565);
+
+    // The glyph decoded again and drawn over the background must give the digit back
+    std::vector<uint8_t> inner(sprite.begin() + 12, sprite.end());
+    Image composed = background;
+    if (!decodeClk2(inner, check) || check.width != glyph.width || check.height != glyph.height) {
+      fprintf(stderr, "Digit %d: glyph does not decode\n", digit);
+      return 1;
+    }
+    for (int y = 0; y < check.height; y++) {
+      std::copy(check.pixels.begin() + y * check.width, check.pixels.begin() + (y + 1) * check.width,
+                composed.pixels.begin() + (y0 + y) * img.width + x0);
+    }
+    if (composed.pixels != img.pixels) {
+      fprintf(stderr, "Digit %d: glyph over the background does not give the original\n", digit);
+      return 1;
+    }
+    printf("digit %d: glyph %d x %d at %d, %d, %zu bytes\n", digit, glyph.width, glyph.height, x0, y0, sprite.size());
+    outputs.push_back(std::make_pair(dir + std::to_string(face * 10 + digit) + ".clk", sprite));
+  }
+
+  size_t layered_bytes = 0;
+  for (const auto &output : outputs) {
+    if (!writeFile(output.first.c_str(), output.second)) return 1;
+    layered_bytes += output.second.size();
+  }
+  printf("%s: background %d x %d, %zu bytes; %d digits: %zu bytes layered, %zu bytes before (%.1fx smaller)\n",
+         outputs[0].first.c_str(), background.width, background.height, outputs[0].second.size(), count,
+         layered_bytes, original_bytes, double(original_bytes) / layered_bytes);
+  return 0;
+}
+
+static int cmdPack(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: clktool pack <output.face> <name> <image files...>\n");
+    return 1;
+  }
+  if (strlen(argv[1]) > 32) {
+    fprintf(stderr, "Name is longer than 32 characters\n");
+    return 1;
+  }
+  // Digits 0..9, then the background of a layered face
+  std::vector<uint8_t> images[11];
+  for (int i = 2; i < argc; i++) {
+    int file_index = fileIndexFromName(argv[i]);
+    if (file_index < 0) {
+      fprintf(stderr, "Skipping %s: file name is not a number\n", argv[i]);
+      continue;
+    }
+    int entry = (file_index & background_bit) ? 10 : file_index % 10;
+    std::vector<uint8_t> &data = images[entry];
+    if (!data.empty()) {
+      fprintf(stderr, "%s: %s given twice\n", argv[i], (entry == 10) ? "background" : "digit");
+      return 1;
+    }
+    if (!readFile(argv[i], data)) return 1;
+    if (imageFormat(data) < 0) {
+      fprintf(stderr, "%s: not a BMP or CLK file\n", argv[i]);
+      return 1;
+    }
+  }
+
+  // Header with the name, index of 10 entries (11 with a background), then the images 4-byte aligned.
+  const size_t header_size = 40, entry_size = 12;
+  int entries = images[10].empty() ? 10 : 11;
+  std::vector<uint8_t> out(header_size + entries * entry_size, 0);
+  memcpy(out.data(), "FACE", 4);
+  out[4] = 1;
+  out[5] = entries;
+  memcpy(&out[8], argv[1], strlen(argv[1]));
+  int digits = 0;
+  for (int digit = 0; digit < entries; digit++) {
+    size_t entry = header_size + digit * entry_size;
+    if (images[digit].empty()) {
+      fprintf(stderr, "Warning: no image for digit %d\n", digit);
+      out[entry + 8] = 255;
+      continue;
+    }
+    out.resize((out.size() + 3) & ~size_t(3), 0);
+    put32(out, entry, out.size());
+    put32(out, entry + 4, images[digit].size());
+    out[entry + 8] = imageFormat(images[digit]);
+    out.insert(out.end(), images[digit].begin(), images[digit].end());
+    if (digit < 10) digits++;
+  }
+
+  if (!writeFile(argv[0], out)) return 1;
+  printf("%s: \"%s\", %d digits%s, %zu bytes\n", argv[0], argv[1], digits, (entries == 11) ? " and a background" : "", out.size());
+  return 0;
+}
+
+static int cmdPartition(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: clktool partition <output.bin> <image files...>\n");
+    return 1;
+  }
+  struct Input {
+    int file_index;
+    std::vector<uint8_t> data;
+  };
+  std::vector<Input> inputs;
+  for (int i = 1; i < argc; i++) {
+    Input in;
+    in.file_index = fileIndexFromName(argv[i]);
+    if (in.file_index < 0 || in.file_index > 0xFFFF) {
+      fprintf(stderr, "Skipping %s: file name is not a number\n", argv[i]);
+      continue;
+    }
+    if (!readFile(argv[i], in.data)) return 1;
+    inputs.push_back(in);
+  }
+  std::sort(inputs.begin(), inputs.end(), [](const Input &a, const Input &b) { return a.file_index < b.file_index; });
+
+  // Header, entry table, then the files 4-byte aligned.
+  const size_t entry_size = 12;
+  std::vector<uint8_t> out(8 + inputs.size() * entry_size, 0);
+  memcpy(out.data(), "TTFP", 4);
+  put16(out, 4, 1);
+  put16(out, 6, inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    out.resize((out.size() + 3) & ~size_t(3), 0);
+    size_t entry = 8 + i * entry_size;
+    put16(out, entry, inputs[i].file_index);
+    put32(out, entry + 4, out.size());
+    put32(out, entry + 8, inputs[i].data.size());
+    out.insert(out.end(), inputs[i].data.begin(), inputs[i].data.end());
+  }
+
+  if (!writeFile(argv[0], out)) return 1;
+  printf("%s: %zu images, %zu bytes\n", argv[0], inputs.size(), out.size());
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "encode") == 0) return cmdEncode(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "pack") == 0) return cmdPack(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "animate") == 0) return cmdAnimate(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "layer") == 0) return cmdLayer(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "partition") == 0) return cmdPartition(argc - 2, argv + 2);
+
+  fprintf(stderr, "usage: clktool <command> ...\n"
+                  "  encode [--rgb565] <image.bmp...>          convert BMP files to compressed CLK v2\n"
+                  "  pack <output.face> <name> <image files...>   pack the digits of a face into one file\n"
+                  "  animate [--rgb565] <output.ani> <frame ms> <idle frames...> [--change <frames...>]\n"
+                  "                                            build an animated digit\n"
+                  "  layer [--rgb565] <face> <digit images...>   split a face into background and glyphs\n"
+                  "  partition <output.bin> <image files...>   pack images for the faces partition\n");
+  return 1;
+}
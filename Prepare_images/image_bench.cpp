@@ -0,0 +1,391 @@
+/*
+ * image_bench - runs the clock's image loading code (ImageStorage, FacePack, ImageDecoder)
+ * on a development machine, against a directory laid out like the SPIFFS image.
+ *
+ * Build and run from the repository root:
+ *   g++ -O2 -std=c++11 -IEleksTubeHAX_pio/src -o image_bench Prepare_images/image_bench.cpp \
+ *       EleksTubeHAX_pio/src/ImageDecoder.cpp EleksTubeHAX_pio/src/ImageStorage.cpp EleksTubeHAX_pio/src/FacePack.cpp \
+ *       EleksTubeHAX_pio/src/FaceCatalog.cpp
+ *   ./image_bench EleksTubeHAX_pio/data [iterations]
+ *
+ * It lists the faces the clock would find (FaceCatalog), with their names. Then for every image found
+ * (face packs /1.face, /2.face ..., and single files /10.bmp, /10.clk ...) it prints
+ * the file size, the average open + decode time, the decoded frame and a checksum of the picture as it
+ * would appear on the display. Images of the same digit in different formats must have the same checksum
+ * (unless the encoder had to reduce colors), which makes this a quick check for the decoders as well.
+ * Glyphs of layered faces are checked as drawn, over the background of their face (/1bg.clk or in the pack).
+ * Timings are for the host CPU, so only compare them with each other.
+ *
+ * Then it times the row kernels (EleksTubeHAX_pio/src/RowKernels.h) against the plain per-pixel loops:
+ * expanding each image for the display as pushed (dimmed and undimmed), blending two images for a
+ * crossfade, and decoding a 24 bit BMP made from the first image. Outputs of both must be identical.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ImageDecoder.h"
+#include "ImageStorage.h"
+#include "FacePack.h"
+#include "FaceCatalog.h"
+#include "RowKernels.h"
+
+// Display size of the supported clocks
+static const int16_t display_width = 135;
+static const int16_t display_height = 240;
+
+static uint32_t get32le(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24); }
+static void put32le(uint8_t *p, uint32_t x) { p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24; }
+
+// One malloc'ed frame per file index, reused when the same image is decoded again.
+class HostFrames : public FrameAllocator {
+public:
+  ~HostFrames() {
+    for (auto &entry : frames) free(entry.second.frame);
+  }
+  ImageFrame* acquire(uint16_t file_index, size_t data_bytes) override {
+    Entry &entry = frames[file_index];
+    if (entry.frame == nullptr || entry.capacity < data_bytes) {
+      free(entry.frame);
+      entry.frame = (ImageFrame*)malloc(sizeof(ImageFrame) + data_bytes);
+      entry.capacity = data_bytes;
+    }
+    if (entry.frame != nullptr) entry.frame->pixels = entry.frame->data();
+    return entry.frame;
+  }
+  const ImageFrame* get(uint16_t file_index) { return frames[file_index].frame; }
+  template <typename F> void forEach(F f) {
+    for (auto &entry : frames) if (entry.second.frame != nullptr) f(entry.first, entry.second.frame);
+  }
+
+private:
+  struct Entry {
+    ImageFrame *frame = nullptr;
+    size_t capacity = 0;
+  };
+  std::map<uint16_t, Entry> frames;
+};
+
+// Color of the display pixel x, y: black outside the image, or the background outside a glyph.
+static uint16_t pixelAt(const ImageFrame *frame, int16_t x, int16_t y, const ImageFrame *background = nullptr) {
+  int16_t col = x - frame->x, row = y - frame->y;
+  if (col < 0 || row < 0 || col >= frame->width || row >= frame->height) {
+    return (frame->sprite && background != nullptr) ? pixelAt(background, x, y) : 0;
+  }
+  const uint8_t *line = frame->row(row);
+  if (frame->format == ImageFrame::rgb565) return ((const uint16_t*)line)[col];
+  uint32_t bit = uint32_t(frame->src_x + col) * frame->bits;
+  uint8_t index = (line[bit / 8] >> (8 - frame->bits - bit % 8)) & ((1 << frame->bits) - 1);
+  return frame->palette[index];
+}
+
+// FNV-1a over the RGB565 picture on the display
+static uint32_t pictureChecksum(const ImageFrame *frame, const ImageFrame *background) {
+  uint32_t hash = 2166136261u;
+  for (int16_t y = 0; y < display_height; y++) {
+    for (int16_t x = 0; x < display_width; x++) {
+      uint16_t color = pixelAt(frame, x, y, background);
+      hash = (hash ^ (color & 0xFF)) * 16777619u;
+      hash = (hash ^ (color >> 8)) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+struct Result {
+  double us;
+  uint32_t size;
+  const ImageFrame *frame;
+};
+
+// Opens (through the storage or the pack) and decodes one image iterations times.
+template <typename Open>
+static bool bench(ImageDecoder &decoder, HostFrames &frames, uint16_t file_index, int iterations, Open open, Result &result) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    ImageReader *reader = open();
+    if (reader == nullptr) return false;
+    if (!decoder.decode(*reader, file_index)) {
+      printf("  %d: %s\n", file_index, decoder.getError());
+      return false;
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  result.us = std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+  result.frame = frames.get(file_index);
+  return true;
+}
+
+static void printResult(const char *what, uint16_t file_index, const Result &r, const ImageFrame *background,
+                        std::map<uint16_t, uint32_t> &checksums) {
+  uint32_t checksum = pictureChecksum(r.frame, background);
+  const char *compare = "";
+  auto known = checksums.find(file_index);
+  if (known == checksums.end()) {
+    checksums[file_index] = checksum;
+  } else {
+    compare = (known->second == checksum) ? "  same picture" : "  DIFFERENT picture";
+  }
+  printf("%-12s %8u bytes %9.1f us  %3u x %3u %2u bit%s  %08x%s\n", what, r.size, r.us,
+         r.frame->width, r.frame->height, r.frame->bits, r.frame->sprite ? " glyph" : "", checksum, compare);
+}
+
+template <typename F>
+static double timeUs(int iterations, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) f();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+}
+
+// Same tables as TFTs::buildDimmingLut()
+static void buildDimmingLut(DimLut &lut, uint8_t dimming) {
+  for (uint8_t i = 0; i < 64; i++) {
+    uint8_t level = (dimming == 255) ? i : (i * dimming) >> 8;
+    if (i < 32) {
+      lut.red[i] = RowKernels::swap16(level << 11);
+      lut.blue[i] = RowKernels::swap16(level);
+    }
+    lut.green[i] = RowKernels::swap16(level << 5);
+  }
+}
+
+// Expanding every image for the display, full screen, as TFTs::fillStrip() does.
+static void benchPushKernels(HostFrames &frames, int iterations) {
+  static uint16_t kernel_out[display_width * display_height], reference_out[display_width * display_height];
+  for (uint8_t dimming : {255, 128}) {
+    DimLut lut;
+    buildDimmingLut(lut, dimming);
+    double kernel_us = 0, reference_us = 0;
+    int count = 0, mismatches = 0;
+    frames.forEach([&](uint16_t, const ImageFrame *frame) {
+      uint16_t palette[256];
+      for (int i = 0; i < 256; i++) palette[i] = lut.apply(frame->palette[i]);
+      bool dimmed = dimming < 255;
+      kernel_us += timeUs(iterations, [&]() {
+        LineKernel kernel = RowKernels::selectLineKernel(frame, dimmed, 0, 0, display_width, display_height);
+        for (int16_t line = 0; line < display_height; line++) {
+          kernel(frame, line, 0, display_width, palette, lut, kernel_out + line * display_width);
+        }
+      });
+      reference_us += timeUs(iterations, [&]() {
+        for (int16_t line = 0; line < display_height; line++) {
+          RowKernels::referenceLine(frame, line, 0, display_width, palette, lut, dimmed, reference_out + line * display_width);
+        }
+      });
+      if (memcmp(kernel_out, reference_out, sizeof(kernel_out)) != 0) mismatches++;
+      count++;
+    });
+    if (count == 0) return;
+    printf("push %-9s per image: per pixel %7.1f us, kernels %7.1f us (%.1fx)%s\n",
+           dimming < 255 ? "dimmed" : "undimmed", reference_us / count, kernel_us / count,
+           reference_us / kernel_us, mismatches ? "  OUTPUT DIFFERS" : "");
+  }
+}
+
+// A crossfade between consecutive images, all 33 steps, as TFTs::pushTransitionFrame() blends them.
+static void benchBlend(HostFrames &frames, int iterations) {
+  static uint16_t from_out[display_width * display_height], to_out[display_width * display_height];
+  static uint16_t kernel_out[display_width * display_height], reference_out[display_width * display_height];
+  DimLut lut;
+  buildDimmingLut(lut, 255);
+  double kernel_us = 0, reference_us = 0;
+  int count = 0, mismatches = 0;
+  const ImageFrame *previous = nullptr;
+  frames.forEach([&](uint16_t, const ImageFrame *frame) {
+    if (previous != nullptr) {
+      uint16_t palette[256];
+      for (int i = 0; i < 256; i++) palette[i] = lut.apply(previous->palette[i]);
+      for (int16_t line = 0; line < display_height; line++) {
+        RowKernels::referenceLine(previous, line, 0, display_width, palette, lut, false, from_out + line * display_width);
+      }
+      for (int i = 0; i < 256; i++) palette[i] = lut.apply(frame->palette[i]);
+      for (int16_t line = 0; line < display_height; line++) {
+        RowKernels::referenceLine(frame, line, 0, display_width, palette, lut, false, to_out + line * display_width);
+      }
+      for (uint8_t alpha = 0; alpha <= 32; alpha++) {
+        // Lines one after the other, like the strips: every other one starts on an odd pixel.
+        kernel_us += timeUs(iterations, [&]() {
+          for (int16_t line = 0; line < display_height; line++) {
+            int32_t i = line * display_width;
+            RowKernels::blendLine(from_out + i, to_out + i, alpha, display_width, kernel_out + i);
+          }
+        }) / 33;
+        reference_us += timeUs(iterations, [&]() {
+          for (int16_t line = 0; line < display_height; line++) {
+            int32_t i = line * display_width;
+            RowKernels::referenceBlend(from_out + i, to_out + i, alpha, display_width, reference_out + i);
+          }
+        }) / 33;
+        if (memcmp(kernel_out, reference_out, sizeof(kernel_out)) != 0) mismatches++;
+      }
+      count++;
+    }
+    previous = frame;
+  });
+  if (count == 0) return;
+  printf("blend crossfade per image: per channel %7.1f us, kernels %7.1f us (%.1fx)%s\n",
+         reference_us / count, kernel_us / count, reference_us / kernel_us, mismatches ? "  OUTPUT DIFFERS" : "");
+}
+
+// The 24 bit BMP loop as it was before the row kernels: per-pixel conversion and bounds check.
+static void referenceDecode24(const std::vector<uint8_t> &bmp, uint16_t *buffer) {
+  int32_t w = get32le(&bmp[18]), h = get32le(&bmp[22]);
+  uint32_t line_size = ((24 * w + 31) >> 5) * 4;
+  int16_t x = (display_width - w) / 2, y = (display_height - h) / 2;
+  memset(buffer, 0, display_width * display_height * sizeof(uint16_t));
+  for (int16_t row = h - 1; row >= 0; row--) {
+    const uint8_t *bptr = &bmp[get32le(&bmp[10]) + (h - 1 - row) * line_size];
+    for (int16_t col = 0; col < w; col++) {
+      uint8_t b = *bptr++, g = *bptr++, r = *bptr++;
+      uint16_t color = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+      int32_t bufferIndex = (row + y) * display_width + (col + x);
+      if (bufferIndex >= 0 && bufferIndex < display_width * display_height) buffer[bufferIndex] = color;
+    }
+  }
+}
+
+// A 24 bit BMP with the picture of frame
+static std::vector<uint8_t> makeBmp24(const ImageFrame *frame) {
+  static uint16_t picture[display_width * display_height];
+  DimLut lut;
+  buildDimmingLut(lut, 255);
+  uint16_t palette[256];
+  for (int i = 0; i < 256; i++) palette[i] = lut.apply(frame->palette[i]);
+  for (int16_t line = 0; line < frame->height; line++) {
+    RowKernels::referenceLine(frame, line + frame->y, frame->x, frame->width, palette, lut, false, picture + line * frame->width);
+  }
+  int w = frame->width, h = frame->height;
+  uint32_t line_size = ((24 * w + 31) >> 5) * 4;
+  std::vector<uint8_t> bmp(54 + line_size * h, 0);
+  bmp[0] = 'B'; bmp[1] = 'M';
+  put32le(&bmp[2], bmp.size());
+  put32le(&bmp[10], 54);
+  put32le(&bmp[14], 40);
+  put32le(&bmp[18], w);
+  put32le(&bmp[22], h);
+  bmp[26] = 1;
+  bmp[28] = 24;
+  for (int row = 0; row < h; row++) {
+    uint8_t *dst = &bmp[54 + (h - 1 - row) * line_size];
+    for (int col = 0; col < w; col++) {
+      uint16_t c = RowKernels::swap16(picture[row * w + col]);
+      *dst++ = (c << 3) & 0xF8;
+      *dst++ = (c >> 3) & 0xFC;
+      *dst++ = (c >> 8) & 0xF8;
+    }
+  }
+  return bmp;
+}
+
+static void benchDecode24(HostFrames &frames, int iterations) {
+  const ImageFrame *first = nullptr;
+  frames.forEach([&](uint16_t, const ImageFrame *frame) { if (first == nullptr) first = frame; });
+  if (first == nullptr) return;
+  std::vector<uint8_t> bmp = makeBmp24(first);
+  static uint16_t reference[display_width * display_height];
+
+  HostFrames decoded;
+  ImageDecoder decoder(decoded, display_width, display_height);
+  double kernel_us = timeUs(iterations, [&]() {
+    MemoryImageReader reader(bmp.data(), bmp.size());
+    decoder.decode(reader, 0);
+  });
+  double reference_us = timeUs(iterations, [&]() { referenceDecode24(bmp, reference); });
+  const ImageFrame *frame = decoded.get(0);
+  bool same = frame != nullptr;
+  for (int16_t y = 0; same && y < display_height; y++) {
+    for (int16_t x = 0; same && x < display_width; x++) same = pixelAt(frame, x, y) == reference[y * display_width + x];
+  }
+  printf("decode 24 bit BMP:        per pixel %7.1f us, kernels %7.1f us (%.1fx)%s\n",
+         reference_us, kernel_us, reference_us / kernel_us, same ? "" : "  OUTPUT DIFFERS");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: image_bench <data directory> [iterations]\n");
+    return 1;
+  }
+  int iterations = (argc > 2) ? atoi(argv[2]) : 20;
+  if (iterations < 1) iterations = 1;
+
+  PosixImageStorage storage(argv[1]);
+  if (!storage.begin()) {
+    fprintf(stderr, "%s is not a directory\n", argv[1]);
+    return 1;
+  }
+  HostFrames frames;
+  ImageDecoder decoder(frames, display_width, display_height);
+  std::map<uint16_t, uint32_t> checksums;
+  printf("%s: %zu bytes of images, %d iterations\n", argv[1], storage.usedBytes(), iterations);
+
+  FaceCatalog catalog;
+  uint8_t faces = catalog.build(storage);
+  printf("%d clock faces:", faces);
+  for (uint8_t face = 1; face <= faces; face++) printf(" %d \"%s\"%s", face, catalog.getName(face), face < faces ? "," : "\n");
+  if (faces == 0) printf("\n");
+
+  double total_us = 0;
+  int images = 0;
+  // All faces with images, also those the catalog doesn't count (other file format, after a gap)
+  for (uint8_t face = 1; face <= FaceCatalog::max_faces; face++) {
+    FacePack pack;
+    if (pack.open(storage, face)) {
+      printf("/%d.face \"%s\"\n", face, pack.getName());
+      // The background of a layered face first, the glyphs are checked over it
+      const ImageFrame *background = nullptr;
+      for (uint8_t digit = 0; digit <= FacePack::background; digit++) {
+        uint8_t entry = (digit == 0) ? FacePack::background : digit - 1;
+        Result r;
+        uint32_t offset;
+        if (!pack.find(entry, &offset, &r.size)) continue;
+        uint16_t file_index = (entry == FacePack::background) ? FaceCatalog::backgroundIndex(face) : face * 10 + entry;
+        if (!bench(decoder, frames, file_index, iterations,
+                   [&]() -> ImageReader* { return pack.select(entry) ? &pack.getFile() : nullptr; }, r)) continue;
+        char what[16];
+        snprintf(what, sizeof(what), (entry == FacePack::background) ? "  background" : "  digit %d", entry);
+        if (entry == FacePack::background) background = r.frame;
+        printResult(what, file_index, r, background, checksums);
+        total_us += r.us;
+        images++;
+      }
+    }
+
+    for (const char *extension : {"bmp", "clk"}) {
+      const ImageFrame *background = nullptr;
+      for (uint8_t digit = 0; digit <= 10; digit++) {
+        // Background of a layered face first, /1bg.clk for face 1
+        uint16_t file_index = (digit == 0) ? FaceCatalog::backgroundIndex(face) : face * 10 + digit - 1;
+        char filename[16];
+        if (digit == 0) snprintf(filename, sizeof(filename), "/%dbg.%s", face, extension);
+        else snprintf(filename, sizeof(filename), "/%d.%s", file_index, extension);
+        ImageFile file;
+        Result r;
+        if (!storage.exists(filename)) continue;
+        if (!bench(decoder, frames, file_index, iterations,
+                   [&]() -> ImageReader* { return storage.open(filename, file) ? &file : nullptr; }, r)) continue;
+        r.size = file.size();
+        if (digit == 0) background = r.frame;
+        printResult(filename, file_index, r, background, checksums);
+        total_us += r.us;
+        images++;
+      }
+    }
+  }
+
+  if (images == 0) {
+    printf("No images found\n");
+    return 1;
+  }
+  printf("%d images, average %.1f us per image\n", images, total_us / images);
+
+  benchPushKernels(frames, iterations);
+  benchBlend(frames, iterations);
+  benchDecode24(frames, iterations);
+  return 0;
+}